@@ -36,6 +36,43 @@ lcr3(uint64_t addr)
                  : "r" (addr));
 }
 
+static inline uint64_t
+rcr3(void)
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    return cr3;
+}
+
+static inline uint64_t
+rcr4(void)
+{
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static inline void
+lcr4(uint64_t val)
+{
+    asm volatile("mov %0, %%cr4" : : "r" (val));
+}
+
+// drop the TLB entries translating the page at addr, in the current PCID
+static inline void
+invlpg(vaddr_t addr)
+{
+    asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static inline void
+cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid"
+                 : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                 : "a" (leaf), "c" (0));
+}
+
 static inline void
 lgdt(struct segdesc *gdt, size_t size)
 {
@@ -101,6 +138,28 @@ sti(void)
     asm volatile("sti");
 }
 
+static inline uint64_t
+rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// spin-wait hint, eases pressure on the memory bus and the sibling hyperthread
+static inline void
+pause(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
+// enable interrupts and halt, the sti shadow makes this atomic
+static inline void
+sti_hlt(void)
+{
+    asm volatile("sti; hlt" : : : "memory");
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
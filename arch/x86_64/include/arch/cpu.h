@@ -32,6 +32,14 @@
 
 #define CR4_PSE         0x00000010      // Page size extension
 #define CR4_PAE         0x00000020      // Page size extension
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+
+// CR3 flags when CR4_PCIDE is set
+#define CR3_PCID_MASK   0x0000000000000FFF
+#define CR3_NOFLUSH     0x8000000000000000 // keep the new PCID's TLB entries
+
+// CPUID.1:ECX feature flags
+#define CPUID_ECX_PCID  0x00020000
 
 
 #ifndef __ASSEMBLER__
@@ -49,7 +57,8 @@ struct x86_64_cpu {
     volatile uint32_t started;   // Has the CPU started?
     int num_disabled;            // Depth of cli nesting.
     int intr_enabled;            // Were interrupts enabled before it's first diabled?
-    struct x86_64_cpu *cpu;          // stores current cpu struct address
+    struct x86_64_cpu *cpu;          // stores current cpu struct address, read through gs by mycpu
+    uintptr_t percpu_offset;     // offset from .percpu variables to this cpu's copy
 };
 #define MAX_NCPU 32
 extern struct x86_64_cpu x86_64_cpus[MAX_NCPU];
@@ -58,8 +67,38 @@ extern int ncpu;
 /*
  * Return the ``x86_cpu`` struct for the current running processor.
  * Should only be called when interrupt is disabled or when there is only one processor up.
+ * The gs base of each processor points at its own cpu struct, see seg_init.
  */
-struct x86_64_cpu *mycpu(void);
+static inline struct x86_64_cpu*
+mycpu(void)
+{
+    struct x86_64_cpu *cpu;
+    // volatile: the result changes if the thread migrates, must not be reused
+    asm volatile("movq %%gs:%c1, %0" : "=r" (cpu) : "i" (__builtin_offsetof(struct x86_64_cpu, cpu)));
+    return cpu;
+}
+
+/* Return the current processor's percpu_offset with a single gs relative load */
+static inline uintptr_t
+cpu_percpu_offset(void)
+{
+    uintptr_t ofs;
+    asm volatile("movq %%gs:%c1, %0" : "=r" (ofs) : "i" (__builtin_offsetof(struct x86_64_cpu, percpu_offset)));
+    return ofs;
+}
+
+/*
+ * Find the ``x86_cpu`` struct for the current running processor by its LAPIC ID.
+ * Slow, only used to set up the gs base.
+ */
+struct x86_64_cpu *cpu_lookup(void);
+
+/* Return the index of cpu in x86_64_cpus */
+static inline int
+cpu_index(struct x86_64_cpu *cpu)
+{
+    return cpu - x86_64_cpus;
+}
 
 // Saved registers for kernel context switches.
 // Don't need to save all the segment registers (%cs, etc),
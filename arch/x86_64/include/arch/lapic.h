@@ -24,4 +24,29 @@ uint8_t lapic_read_id(void);
 
 void lapic_eoi(void);
 
+/*
+ * Put the LAPIC timer in periodic mode, firing once per timer tick.
+ */
+void lapic_timer_periodic(void);
+
+/*
+ * Put the LAPIC timer in one-shot mode, firing once after nticks timer ticks.
+ * nticks is capped at what the counter can hold, 0 stops the timer. Returns
+ * the number of ticks actually programmed.
+ */
+uint64_t lapic_timer_oneshot(uint64_t nticks);
+
+/*
+ * Return the number of whole timer ticks elapsed since lapic_timer_oneshot.
+ * *carry holds the partial tick left over from the last call and is updated
+ * with this one's, so partial ticks add up instead of being dropped.
+ */
+uint64_t lapic_timer_elapsed(uint32_t *carry);
+
+/*
+ * Send interrupt vector to the processor with the given LAPIC ID.
+ * Interrupt must be off so the two ICR writes are not interleaved.
+ */
+void lapic_send_ipi(uint8_t apicid, int vector);
+
 #endif /* _ARCH_X86_64_LAPIC_H_ */
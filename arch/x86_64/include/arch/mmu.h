@@ -145,6 +145,11 @@ struct gatedesc {
 #define PDPTX_SHIFT 30
 #define PML4X_SHIFT 39
 
+// A page directory entry with PTE_PS set maps a 2 MiB huge page
+#define HUGE_PG_SIZE    (1UL << PDX_SHIFT)
+#define HUGE_PG_ORDER   (PDX_SHIFT - PG_SHIFT)
+#define HUGE_PG_PAGES   (1UL << HUGE_PG_ORDER)
+
 #define VPN(v) ((vaddr_t)(v) & ~0xFFF)
 #define PPN(p) ((paddr_t)(p) & ~0xFFF & PHYS_ADDR_MASK)
 #define ENTRY_IDX(v, shift) (((v) >> shift) & 0x1FF)
@@ -0,0 +1,44 @@
+#ifndef _ARCH_X86_64_PERCPU_H_
+#define _ARCH_X86_64_PERCPU_H_
+
+#include <arch/cpu.h>
+
+/*
+ * Per-cpu variables. DEFINE_PER_CPU places a variable in the .percpu
+ * section, which only serves as a template: at boot every cpu gets its own
+ * copy, in its own cache lines, and x86_64_cpu.percpu_offset records where
+ * it is relative to the template. A cpu reaches its copy through the gs
+ * base without any lookup; other cpus' copies are reached by cpu index.
+ *
+ * Accessing this cpu's copy requires interrupt off (or some other way of
+ * not migrating) just like mycpu.
+ */
+
+#define CACHELINE_SIZE      64
+#define PERCPU_AREA_SIZE    8192
+
+#define DEFINE_PER_CPU(type, name) \
+    __attribute__((section(".percpu"))) type name
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __attribute__((section(".percpu"))) type name
+
+/* Pointer to cpu's copy of name, cpu is an index into x86_64_cpus */
+#define per_cpu_ptr(name, cpu) \
+    ((typeof(&(name))) ((uintptr_t)&(name) + x86_64_cpus[(cpu)].percpu_offset))
+
+#define per_cpu(name, cpu) (*per_cpu_ptr(name, cpu))
+
+/* Pointer to the current cpu's copy of name */
+#define this_cpu_ptr(name) \
+    ((typeof(&(name))) ((uintptr_t)&(name) + cpu_percpu_offset()))
+
+#define this_cpu(name) (*this_cpu_ptr(name))
+
+/*
+ * Give every cpu found by mp_init its copy of the .percpu section.
+ * Must run on the boot cpu before any per-cpu variable is used.
+ */
+void percpu_init(void);
+
+#endif /* _ARCH_X86_64_PERCPU_H_ */
@@ -34,6 +34,10 @@
 // Syscall
 #define T_SYSCALL       64
 
+// Inter-processor interrupts
+#define T_IPI_RESCHED   0xF0    // wake an idle cpu to look for work
+#define T_IPI_TLB       0xF1    // serve pending TLB shootdown requests
+
 // Error codes
 #define ERR_X86_TRAP_REG_FAIL 1
 
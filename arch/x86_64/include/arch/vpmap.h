@@ -5,6 +5,16 @@
 
 struct vpmap {
     pml4e_t *pml4;
+    uint64_t id;                // never reused, tells PCID owners apart
+    uint16_t pcid;              // TLB tag when PCIDs are enabled, shared by ids that collide
+    volatile uint32_t cpumask;  // cpus whose TLB may hold entries of this vpmap
 };
 
+/*
+ * Enable PCIDs if the cpu has them and start tracking which vpmap the
+ * current cpu has loaded. Called once on every cpu once mycpu works. TLB
+ * shootdowns reach other cpus after every cpu got here.
+ */
+void vpmap_cpu_init(void);
+
 #endif /* _ARCH_X86_64_VPMAP_H_ */
@@ -9,12 +9,19 @@
 #include <arch/asm.h>
 #include <arch/lapic.h>
 #include <lib/stddef.h>
+#include <lib/string.h>
+#include <arch/percpu.h>
 #include <kernel/kmalloc.h>
 
 extern struct thread* swtch(struct context**, struct context*);
 
+// bounds of the .percpu section, see kernel.ld
+extern char __percpu_start[], __percpu_end[];
+// each cpu's copy of the .percpu section
+static char percpu_areas[MAX_NCPU][PERCPU_AREA_SIZE] __attribute__((aligned(CACHELINE_SIZE)));
+
 struct x86_64_cpu*
-mycpu(void)
+cpu_lookup(void)
 {
     uint8_t lapic_id;
     int i;
@@ -29,6 +36,20 @@ mycpu(void)
     return 0;
 }
 
+void
+percpu_init(void)
+{
+    size_t size = __percpu_end - __percpu_start;
+
+    if (size > PERCPU_AREA_SIZE) {
+        panic("per-cpu data does not fit in PERCPU_AREA_SIZE");
+    }
+    for (int i = 0; i < ncpu; i++) {
+        memcpy(percpu_areas[i], __percpu_start, size);
+        x86_64_cpus[i].percpu_offset = (uintptr_t)percpu_areas[i] - (uintptr_t)__percpu_start;
+    }
+}
+
 void
 cpu_clear_thread(struct x86_64_cpu *c)
 {
@@ -6,15 +6,20 @@
 #include <arch/vm.h>
 #include <arch/trap.h>
 #include <arch/cpu.h>
+#include <arch/percpu.h>
+#include <arch/vpmap.h>
 
 void
 arch_init(void)
 {
     mp_init();
+    percpu_init();
+    // sets up the gs base, needed by mycpu
+    seg_init();
+    vpmap_cpu_init();
     lapic_init();
     pic_init();
     ioapic_init();
-    seg_init();
     idt_init();
     idt_load();
     xchg(&(mycpu()->started), 1); // inform other processors we are up
@@ -23,7 +28,9 @@ arch_init(void)
 void
 arch_init_ap(void)
 {
+    // sets up the gs base, needed by mycpu
     seg_init();
+    vpmap_cpu_init();
     lapic_init();
     idt_load();
     xchg(&(mycpu()->started), 1); // inform other processors we are up
@@ -1,4 +1,5 @@
 #include <kernel/console.h>
+#include <kernel/timer.h>
 #include <arch/types.h>
 #include <arch/lapic.h>
 #include <arch/trap.h>
@@ -27,9 +28,12 @@
 // SIV fields
 #define LAPIC_EN    0x00000100
 // TIMER related fields
+#define ONESHOT     0x00000000
 #define PERIODIC    0x00020000
 #define DIV_1       0x0000000B
-#define TIMER_INTVL 10000000
+// QEMU's LAPIC timer counts at 1GHz with DIV_1
+#define TIMER_INTVL (1000000000 / TIMER_FREQ)
+#define TIMER_MAX_TICKS (0xFFFFFFFF / TIMER_INTVL)
 // LVT fields
 #define MASK        0x00010000
 // IPI fields
@@ -77,8 +81,7 @@ lapic_init(void)
 
     // Initialize APIC timer interrupt.
     lapic_reg_write(REG_DCR, DIV_1);
-    lapic_reg_write(REG_ICR, TIMER_INTVL);
-    lapic_reg_write(REG_TIMER, PERIODIC | T_IRQ_TIMER);
+    lapic_timer_periodic();
 
     // Initialize error interrupt.
     lapic_reg_write(REG_ERROR, T_IRQ_ERROR);
@@ -153,3 +156,41 @@ lapic_eoi(void)
 {
     lapic_reg_write(REG_EOI, 0);
 }
+
+void
+lapic_timer_periodic(void)
+{
+    lapic_reg_write(REG_TIMER, PERIODIC | T_IRQ_TIMER);
+    lapic_reg_write(REG_ICR, TIMER_INTVL);
+}
+
+uint64_t
+lapic_timer_oneshot(uint64_t nticks)
+{
+    if (nticks > TIMER_MAX_TICKS) {
+        nticks = TIMER_MAX_TICKS;
+    }
+    // writing the initial count starts the countdown
+    lapic_reg_write(REG_TIMER, ONESHOT | T_IRQ_TIMER);
+    lapic_reg_write(REG_ICR, nticks * TIMER_INTVL);
+    return nticks;
+}
+
+uint64_t
+lapic_timer_elapsed(uint32_t *carry)
+{
+    uint64_t count = (uint64_t)lapic[REG_ICR] - lapic[REG_CCR] + *carry;
+
+    *carry = count % TIMER_INTVL;
+    return count / TIMER_INTVL;
+}
+
+void
+lapic_send_ipi(uint8_t apicid, int vector)
+{
+    lapic_reg_write(REG_ICR_HI, apicid << 24);
+    lapic_reg_write(REG_ICR_LO, vector);
+    // Wait until sent
+    while (lapic[REG_ICR_LO] & IPI_DELIVER) {
+    }
+}
@@ -11,7 +11,7 @@ void
 seg_init(void)
 {
     struct x86_64_cpu *cpu;
-    cpu = mycpu();
+    cpu = cpu_lookup();
     uint32_t *tss = (uint32_t*)&cpu->ts;
     tss[16] = 0x00680000; // IO Map Base = End of TSS
 
@@ -24,4 +24,11 @@ seg_init(void)
     *(uint64_t*) &cpu->gdt[SEG_TSS_UPPER] = ((uint64_t)&cpu->ts) >> 32;
     lgdt(cpu->gdt, sizeof(cpu->gdt));
     ltr(SEG_TSS << 3);
+
+    // Point gs at this cpu's struct for mycpu. Must come after any gs
+    // selector load, which clears the base. User mode gets its own gs base
+    // through swapgs in trapasm.S.
+    cpu->cpu = cpu;
+    wrmsr(MSR_IA32_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
 }
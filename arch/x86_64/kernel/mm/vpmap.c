@@ -5,23 +5,133 @@
 #include <kernel/console.h>
 #include <kernel/util.h>
 #include <kernel/trap.h>
+#include <kernel/swap.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
 #include <lib/stddef.h>
 #include <arch/mmu.h>
 #include <arch/asm.h>
+#include <arch/cpu.h>
+#include <arch/percpu.h>
+#include <arch/lapic.h>
+#include <arch/trap.h>
 
 /*
  * vpmap allocator
  */
 static struct kmem_cache *vpmap_allocator = NULL;
 
+/*
+ * TLB shootdown. Each vpmap tracks the cpus whose TLB may hold its entries.
+ * A change to present entries is invalidated locally and, in one batch per
+ * vpmap call, on each of those cpus through an IPI. The initiator waits for
+ * every target with interrupts off and serves requests sent to itself while
+ * it waits, so two cpus shooting at each other can't deadlock.
+ *
+ * With PCIDs, each vpmap tags its TLB entries with a PCID derived from its id,
+ * and switching to it keeps the entries a cpu still has for it. A cpu
+ * remembers which vpmap last owned each PCID. A PCID whose owner changed, or
+ * whose entries went stale while another vpmap was loaded, is flushed on the
+ * next switch to it instead of right away.
+ */
+#define NR_PCIDS            128
+// ranges longer than this are flushed with a CR3 reload instead of invlpg
+#define TLB_INVLPG_MAX      32
+// pages of a huge page vpmap_copy copies with one bulk allocation
+#define COPY_BATCH          32
+
+struct tlb_state {
+    struct vpmap *current;          // vpmap loaded on this cpu
+    volatile uint32_t pending;      // cpus whose request this cpu has yet to serve
+    uint64_t pcid_owner[NR_PCIDS];  // vpmap whose entries a PCID may hold, 0 if none
+};
+static DEFINE_PER_CPU(struct tlb_state, tlb_state);
+
+/* A shootdown request, indexed by the initiating cpu */
+struct tlb_request {
+    struct vpmap *vpmap;
+    vaddr_t vaddr;
+    size_t n;
+    volatile int acks;              // targets yet to serve it
+};
+static struct tlb_request tlb_requests[MAX_NCPU];
+
+static uint64_t vpmap_next_id = 0;
+static bool pcid_enabled = False;
+// cpus that went through vpmap_cpu_init, shootdowns start once all did
+static volatile uint32_t tlb_cpus = 0;
+static volatile bool tlb_ready = False;
+
+/*
+ * Invalidate n pages from vaddr of vpmap in the current cpu's TLB, or mark
+ * its PCID stale if another vpmap is loaded. Interrupts must be off.
+ */
+static void tlb_invalidate_local(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
+
+/* Serve the shootdown requests pending on the current cpu */
+static void tlb_serve_requests(void);
+
+static void tlb_trap_handler(irq_t irq, void *dev, void *regs);
+
+/* Number of cpus in mask, the kernel is built without libgcc's popcount */
+static int
+cpumask_weight(uint32_t mask)
+{
+    int n = 0;
+
+    for (; mask != 0; mask &= mask - 1) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * A page in swap keeps its swapid in the address bits of a non-present pte.
+ */
+#define SWAPID_PTE(swapid) ((pte_t)(swapid) << PG_SHIFT)
+#define PTE_SWAPID(pte) ((swapid_t)(PPN(pte) >> PG_SHIFT))
+#define PTE_IN_SWAP(pte) (((pte) & PTE_P) == 0 && PTE_SWAPID(pte) != SWAPID_NONE)
+
+/*
+ * Find the page directory entry for virtual address ``vaddr``. If ``alloc`` is
+ * set, allocate upper level tables if not present.
+ */
+static pde_t *find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc);
+
 /*
  * Find the page table entry for virtual address ``vaddr``. If ``alloc`` is set,
- * allocate a page table if not present.
+ * allocate a page table if not present, splitting a huge page if one maps
+ * vaddr. Otherwise the PDE of a huge page mapping vaddr is returned, callers
+ * tell the two apart by PTE_PS.
  */
 static pte_t *find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc);
 
+/*
+ * Replace the huge page mapped by pde with a page table mapping the same
+ * memory with 4 KiB pages, each of which can then be unmapped on its own.
+ * A huge page shared copy-on-write is split for all its sharers, whose huge
+ * page entries then hold a reference on each page.
+ * Return ERR_NOMEM if no page table could be allocated.
+ */
+static err_t split_pde(pde_t *pde);
+
+/*
+ * True while the huge page at base is still one block, False once a sharer
+ * split it.
+ */
+static bool huge_whole(paddr_t base);
+
+/*
+ * Physical address of the 4 KiB page at vaddr, mapped by pte.
+ */
+static paddr_t pte_page_addr(pte_t pte, vaddr_t vaddr);
+
+/*
+ * ``perm`` without write access if the page (or huge page) at paddr is still
+ * shared copy-on-write. The first write fault gives it a private copy.
+ */
+static pteperm_t cow_perm(pteperm_t perm, paddr_t paddr);
+
 /*
  * Clear entry of a pte. Decrement page reference count if page present. Free
  * swap entry if in swap.
@@ -42,35 +152,49 @@ static err_t map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size,
  */
 static void unmap_pages(pml4e_t *pml4, vaddr_t vaddr, vaddr_t end, int free_swap, int free_imm);
 
-/* Utility functions for unmapping other page dir*/
-static void unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr,
-    int pdptx_start, int pdptx_end, int free_swap, int free_imm);
+/*
+ * Utility functions for unmapping other page dir, base is the virtual address
+ * mapped by the first entry of the table.
+ */
+static void unmap_pdpt(pdpte_t *pdpt, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr,
+    int free_swap, int free_imm);
 
-static void unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr,
-    int pdx_start, int pdx_end, int free_swap, int free_imm);
+static void unmap_pd(pde_t *pde, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr,
+    int free_swap, int free_imm);
+
+/*
+ * Virtual address mapped by the first byte of pml4 entry pml4x, sign extended.
+ */
+#define PML4X_VADDR(pml4x) \
+    (((vaddr_t)(pml4x) << PML4X_SHIFT) | ((pml4x) >= N_PML4E_PER_PG / 2 ? 0xFFFF000000000000 : 0))
+
+/*
+ * Intersection of [start, end) with the span of a table entry mapping
+ * [base, base + span), as an inclusive range so it can't overflow.
+ */
+#define RANGE_FIRST(start, base) ((start) > (base) ? (start) : (base))
+#define RANGE_LAST(end, base, span) ((end) - 1 < (base) + (span) - 1 ? (end) - 1 : (base) + (span) - 1)
 
 /*
  * memperm to pteperm translation.
  */
 static pteperm_t memperm_to_pteperm(memperm_t memperm);
 
-static pte_t*
-find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+static pde_t*
+find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc)
 {
     kassert(pml4);
     pml4e_t *pml4e;
     pdpte_t *pdpt, *pdpte;
-    pde_t *pgdir, *pde;
-    pte_t *pgtab;
+    pde_t *pgdir;
     paddr_t paddr;
 
     // top level walk
     pml4e = &pml4[PML4X(vaddr)];
     if ((*pml4e & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pml4e = paddr | PTE_P | PTE_W | PTE_U;
     }
 
@@ -78,21 +202,40 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
     pdpt = (pdpte_t* )KMAP_P2V(PML4E_ADDR(*pml4e));
     pdpte = &pdpt[PDPTX(vaddr)];
     if ((*pdpte & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pdpte = paddr | PTE_P | PTE_W | PTE_U;
     }
 
-    // third level walk
     pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(*pdpte));
-    pde = &pgdir[PDX(vaddr)];
+    return &pgdir[PDX(vaddr)];
+}
+
+static pte_t*
+find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+{
+    pde_t *pde;
+    pte_t *pgtab;
+    paddr_t paddr;
+
+    if ((pde = find_pde(pml4, vaddr, alloc)) == NULL) {
+        return NULL;
+    }
+
+    // third level walk
+    if ((*pde & PTE_P) && (*pde & PTE_PS)) {
+        if (!alloc) {
+            return (pte_t*)pde;
+        }
+        if (split_pde(pde) != ERR_OK) {
+            return NULL;
+        }
+    }
     if ((*pde & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pde = paddr | PTE_P | PTE_W | PTE_U;
     }
 
@@ -100,13 +243,63 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
     return &pgtab[PTX(vaddr)];
 }
 
+static err_t
+split_pde(pde_t *pde)
+{
+    pte_t *pgtab;
+    paddr_t paddr, base;
+    size_t i;
+
+    kassert((*pde & PTE_P) && (*pde & PTE_PS));
+    if (pmem_alloc(&paddr) != ERR_OK) {
+        return ERR_NOMEM;
+    }
+    base = PDE_ADDR(*pde);
+    pgtab = (pte_t*) KMAP_P2V(paddr);
+    for (i = 0; i < N_PTE_PER_PG; i++) {
+        pgtab[i] = (base + i * PG_SIZE) | (PDE_FLAGS(*pde) & ~PTE_PS);
+    }
+    // every 4 KiB page now holds its own references, or already did if
+    // another sharer split the block
+    pmem_split(base);
+    // The huge TLB entry still translates to the same memory. Whoever changes
+    // one of the new entries flushes its page, and invlpg drops the huge entry.
+    *pde = paddr | PTE_P | PTE_W | PTE_U;
+    return ERR_OK;
+}
+
+static bool
+huge_whole(paddr_t base)
+{
+    return paddr_to_page(base)->order != 0;
+}
+
+static paddr_t
+pte_page_addr(pte_t pte, vaddr_t vaddr)
+{
+    if (pte & PTE_PS) {
+        return PDE_ADDR(pte) + (vaddr & (HUGE_PG_SIZE - 1) & ~(PG_SIZE - 1));
+    }
+    return PTE_ADDR(pte);
+}
+
+static pteperm_t
+cow_perm(pteperm_t perm, paddr_t paddr)
+{
+    if ((perm & PTE_W) && pmem_get_refcnt(paddr) > 1) {
+        return perm & ~PTE_W;
+    }
+    return perm;
+}
+
 static void
 clear_pte(pte_t *pte, int free_swap) {
     kassert(pte);
     if (*pte & PTE_P) {
         pmem_dec_refcnt(PPN(*pte));
+    } else if (free_swap && PTE_IN_SWAP(*pte)) {
+        swap_free(PTE_SWAPID(*pte));
     }
-    //*pte = PTE_FLAGS(*pte) & 0xffe;
     *pte = 0;
 }
 
@@ -139,13 +332,12 @@ unmap_pages(pml4e_t *pml4, vaddr_t start, vaddr_t end, int free_swap, int free_i
 {
     kassert(PML4X(start) <= PML4X(end-1));
 
-    int pml4x, pdptx, limit;
+    int pml4x;
     // Optimization: instead of walking the page table for each page in range
     // (using find_pte), iterate through the page directory and each page table.
-    for (pml4x = PML4X(start), pdptx = PDPTX(start); pml4x <= PML4X(end-1); pml4x++, pdptx = 0) {
+    for (pml4x = PML4X(start); pml4x <= PML4X(end-1); pml4x++) {
         if (pml4[pml4x] & PTE_P) {
-            limit = pdptx < PDPTX(end) ? N_PDPTE_PER_PG : PDPTX(end) + 1;
-            unmap_pdpt((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[pml4x])), start, end, pdptx, limit, free_swap, free_imm);
+            unmap_pdpt((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[pml4x])), PML4X_VADDR(pml4x), start, end, free_swap, free_imm);
             if (free_imm) {
                 pmem_free(PML4E_ADDR(pml4[pml4x]));
             }
@@ -154,14 +346,16 @@ unmap_pages(pml4e_t *pml4, vaddr_t start, vaddr_t end, int free_swap, int free_i
 }
 
 static void
-unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int pdptx_start, int pdptx_end, int free_swap, int free_imm)
+unmap_pdpt(pdpte_t *pdpt, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm)
 {
-    int pdptx, pdx, limit;
+    const vaddr_t span = 1UL << PDPTX_SHIFT;
+    vaddr_t first = RANGE_FIRST(start_addr, base);
+    vaddr_t last = RANGE_LAST(end_addr, base, span * N_PDPTE_PER_PG);
+    int pdptx;
 
-    for (pdptx = pdptx_start, pdx = PDX(start_addr); pdptx < pdptx_end; pdptx++, pdx = 0) {
+    for (pdptx = PDPTX(first); pdptx <= PDPTX(last); pdptx++) {
         if (pdpt[pdptx] & PTE_P) {
-            limit = pdx < PDX(end_addr) ? N_PDE_PER_PG : PDX(end_addr) + 1;
-            unmap_pd((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx])), start_addr, end_addr, pdx, limit, free_swap, free_imm);
+            unmap_pd((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx])), base + pdptx * span, start_addr, end_addr, free_swap, free_imm);
             if (free_imm) {
                 pmem_free(PDPTE_ADDR(pdpt[pdptx]));
             }
@@ -170,22 +364,39 @@ unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int pdptx_start,
 }
 
 static void
-unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr, int pdx_start, int pdx_end, int free_swap, int free_imm)
+unmap_pd(pde_t *pde, vaddr_t base, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm)
 {
-    int pdx, ptx, limit;
+    vaddr_t first = RANGE_FIRST(start_addr, base);
+    vaddr_t last = RANGE_LAST(end_addr, base, HUGE_PG_SIZE * N_PDE_PER_PG);
+    vaddr_t pd_base;
+    int pdx, ptx;
     pte_t *pgtable;
 
-    for (pdx = pdx_start, ptx = PTX(start_addr); pdx < pdx_end; pdx++, ptx = 0) {
-        if (pde[pdx] & PTE_P) {
-            limit = ptx < PTX(end_addr) ? N_PTE_PER_PG : PTX(end_addr) + 1;
-            pgtable = (pte_t*) KMAP_P2V(PDE_ADDR(pde[pdx]));
-            for (; ptx < limit; ptx++) {
-                clear_pte(&pgtable[ptx], free_swap);
+    for (pdx = PDX(first); pdx <= PDX(last); pdx++) {
+        if ((pde[pdx] & PTE_P) == 0) {
+            continue;
+        }
+        pd_base = base + pdx * HUGE_PG_SIZE;
+        if (pde[pdx] & PTE_PS) {
+            if (start_addr <= pd_base && pd_base + HUGE_PG_SIZE - 1 <= end_addr - 1) {
+                // whole huge page goes away
+                pmem_dec_refcnt_block(PDE_ADDR(pde[pdx]), HUGE_PG_PAGES);
+                pde[pdx] = 0;
+                continue;
             }
-            if (free_imm) {
-                pmem_free(PDE_ADDR(pde[pdx]));
+            // partial unmap, fall back to 4 KiB pages. Without memory for a
+            // page table the whole huge page stays mapped.
+            if (split_pde(&pde[pdx]) != ERR_OK) {
+                continue;
             }
         }
+        pgtable = (pte_t*) KMAP_P2V(PDE_ADDR(pde[pdx]));
+        for (ptx = PTX(RANGE_FIRST(start_addr, pd_base)); ptx <= PTX(RANGE_LAST(end_addr, pd_base, HUGE_PG_SIZE)); ptx++) {
+            clear_pte(&pgtable[ptx], free_swap);
+        }
+        if (free_imm) {
+            pmem_free(PDE_ADDR(pde[pdx]));
+        }
     }
 }
 
@@ -243,6 +454,9 @@ vpmap_init(void)
     }
     kvpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
     memset(kvpmap->pml4, 0, pg_size);
+    kvpmap->id = ++vpmap_next_id;
+    kvpmap->pcid = 0;
+    kvpmap->cpumask = 0;
 
     // Create kernel mappings
     for (m = kernel_mappings; m < &kernel_mappings[N_ELEM(kernel_mappings)]; m++) {
@@ -273,11 +487,14 @@ vpmap_create(void)
     if ((vpmap = kmem_cache_alloc(vpmap_allocator)) == NULL) {
         return NULL;
     }
-    if (pmem_alloc(&paddr) != ERR_OK) {
+    if (pmem_alloc_zeroed(&paddr) != ERR_OK) {
         return NULL;
     }
     vpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
-    memset(vpmap->pml4, 0, pg_size);
+    vpmap->id = __sync_add_and_fetch(&vpmap_next_id, 1);
+    // PCID 0 stays with the kernel vpmap
+    vpmap->pcid = 1 + vpmap->id % (NR_PCIDS - 1);
+    vpmap->cpumask = 0;
 
     // TODO: initialize with no regions?
     return vpmap;
@@ -286,12 +503,78 @@ vpmap_create(void)
 err_t
 vpmap_load(struct vpmap *vpmap)
 {
+    struct tlb_state *st;
+    uint32_t self;
+    uint64_t cr3;
+
     kassert(vpmap);
     kassert(vpmap->pml4);
-    lcr3(KMAP_V2P(vpmap->pml4));
+    cr3 = KMAP_V2P(vpmap->pml4);
+    // early boot, only the kernel vpmap is around and mycpu may not work yet
+    if (!tlb_ready) {
+        lcr3(cr3);
+        return ERR_OK;
+    }
+    intr_set_level(INTR_OFF);
+    st = this_cpu_ptr(tlb_state);
+    if (st->current == vpmap) {
+        intr_set_level(INTR_ON);
+        return ERR_OK;
+    }
+    self = 1u << cpu_index(mycpu());
+    // without PCIDs the CR3 write below flushes the old vpmap's entries
+    if (!pcid_enabled) {
+        __sync_fetch_and_and(&st->current->cpumask, ~self);
+    }
+    // a locked op, a shootdown that misses this bit changed its entries before
+    // this cpu can walk them
+    __sync_fetch_and_or(&vpmap->cpumask, self);
+    st->current = vpmap;
+    if (pcid_enabled) {
+        cr3 |= vpmap->pcid;
+        if (st->pcid_owner[vpmap->pcid] == vpmap->id) {
+            cr3 |= CR3_NOFLUSH;
+        } else {
+            st->pcid_owner[vpmap->pcid] = vpmap->id;
+        }
+    }
+    lcr3(cr3);
+    intr_set_level(INTR_ON);
     return ERR_OK;
 }
 
+void
+vpmap_cpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    struct tlb_state *st = this_cpu_ptr(tlb_state);
+    uint32_t self = 1u << cpu_index(mycpu());
+
+    // the boot cpu decides, every cpu is the same model
+    if (cpu_index(mycpu()) == 0) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        pcid_enabled = (ecx & CPUID_ECX_PCID) != 0;
+    }
+    // the kernel vpmap is loaded with CR3's PCID bits clear, as required
+    if (pcid_enabled) {
+        lcr4(rcr4() | CR4_PCIDE);
+    }
+    lcr3(KMAP_V2P(kvpmap->pml4));
+    st->current = kvpmap;
+    st->pending = 0;
+    st->pcid_owner[0] = kvpmap->id;
+    __sync_fetch_and_or(&kvpmap->cpumask, self);
+    if (cpumask_weight(__sync_or_and_fetch(&tlb_cpus, self)) == ncpu) {
+        tlb_ready = True;
+    }
+}
+
+err_t
+vpmap_register_trap_handler(void)
+{
+    return trap_register_handler(T_IPI_TLB, NULL, tlb_trap_handler);
+}
+
 err_t
 vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm)
 {
@@ -302,6 +585,31 @@ vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t
     return map_pages(vpmap->pml4, pg_round_down(vaddr), pg_round_down(paddr), n * pg_size, memperm_to_pteperm(memperm));
 }
 
+err_t
+vpmap_map_huge(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, memperm_t memperm)
+{
+    pde_t *pde;
+
+    kassert(vpmap);
+    kassert((vaddr & (HUGE_PG_SIZE - 1)) == 0 && (paddr & (HUGE_PG_SIZE - 1)) == 0);
+    // only take over a range that has no page table yet
+    if ((pde = find_pde(vpmap->pml4, vaddr, 1)) == NULL || (*pde & PTE_P)) {
+        return ERR_VPMAP_MAP;
+    }
+    *pde = paddr | PTE_P | PTE_PS | memperm_to_pteperm(memperm);
+    return ERR_OK;
+}
+
+bool
+vpmap_huge_unmapped(struct vpmap *vpmap, vaddr_t vaddr)
+{
+    pde_t *pde;
+
+    kassert(vpmap);
+    pde = find_pde(vpmap->pml4, vaddr, 0);
+    return pde == NULL || !(*pde & PTE_P);
+}
+
 void
 vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap)
 {
@@ -312,6 +620,29 @@ vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap)
     vaddr_t end = start + n * pg_size;
     kassert(PML4X(start) <= PML4X(end));
     unmap_pages(vpmap->pml4, start, end, free_swap, 0);
+    vpmap_flush_tlb(vpmap, start, n);
+}
+
+err_t
+vpmap_unmap_clean(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr)
+{
+    pte_t *pte, old;
+
+    kassert(vpmap);
+    pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte == NULL || (*pte & PTE_P) == 0 || (*pte & PTE_PS) || PTE_ADDR(*pte) != paddr) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    // once the entry is gone from memory and every TLB, no write can dirty
+    // the page without faulting, so the bit taken out is final
+    old = __sync_lock_test_and_set(pte, 0);
+    vpmap_flush_tlb(vpmap, vaddr, 1);
+    if (old & PTE_D) {
+        *pte = old;
+        return ERR_VPMAP_DIRTY;
+    }
+    pmem_dec_refcnt(PTE_ADDR(old));
+    return ERR_OK;
 }
 
 void
@@ -332,29 +663,123 @@ err_t
 vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vaddr_t dstaddr, size_t n, memperm_t memperm) {
     kassert(srcvpmap && dstvpmap);
     pte_t *src_pte, *dst_pte;
-    pteperm_t perm = memperm_to_pteperm(memperm);
-    size_t i;
+    pde_t *dst_pde;
+    // shared pages are read-only on both sides until the first write
+    pteperm_t perm = memperm_to_pteperm(memperm) & ~PTE_W;
+    size_t i, j, count;
+    err_t err = ERR_OK;
+    paddr_t pages[COPY_BATCH];
+    vaddr_t srcstart;
 
-    srcaddr = pg_round_down(srcaddr);
+    srcaddr = srcstart = pg_round_down(srcaddr);
     dstaddr = pg_round_down(dstaddr);
     for (i = 0; i < n; i++, srcaddr += pg_size, dstaddr += pg_size) {
         if ((src_pte = find_pte(srcvpmap->pml4, srcaddr, 0)) == NULL ||
             PPN(*src_pte) == 0) {
             continue;
         }
+        if (PTE_IN_SWAP(*src_pte)) {
+            // both sides read their own copy back in
+            if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
+                PPN(*dst_pte) != 0) {
+                err = ERR_VPMAP_MAP;
+                break;
+            }
+            swap_dup(PTE_SWAPID(*src_pte));
+            *dst_pte = *src_pte;
+            continue;
+        }
+        if (*src_pte & PTE_PS) {
+            // share a whole huge page when it lines up
+            if ((srcaddr & (HUGE_PG_SIZE - 1)) == 0 && (dstaddr & (HUGE_PG_SIZE - 1)) == 0 &&
+                n - i >= HUGE_PG_PAGES && (dst_pde = find_pde(dstvpmap->pml4, dstaddr, 1)) != NULL &&
+                (*dst_pde & PTE_P) == 0) {
+                *src_pte &= ~PTE_W;
+                pmem_inc_refcnt_block(PDE_ADDR(*src_pte), HUGE_PG_PAGES, 1);
+                *dst_pde = PDE_ADDR(*src_pte) | PTE_P | PTE_PS | perm;
+                i += HUGE_PG_PAGES - 1;
+                srcaddr += HUGE_PG_SIZE - pg_size;
+                dstaddr += HUGE_PG_SIZE - pg_size;
+                continue;
+            }
+            // a 4 KiB page of a huge page has no reference count of its own,
+            // it can only be copied, along with the rest of the huge page in range
+            count = min(n - i, HUGE_PG_PAGES - (srcaddr & (HUGE_PG_SIZE - 1)) / pg_size);
+            count = min(count, COPY_BATCH);
+            if ((err = pmem_alloc_bulk(pages, count)) != ERR_OK) {
+                break;
+            }
+            for (j = 0; j < count; j++) {
+                if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr + j * pg_size, 1)) == NULL ||
+                    PPN(*dst_pte) != 0) {
+                    err = ERR_VPMAP_MAP;
+                    break;
+                }
+                memcpy((void*)KMAP_P2V(pages[j]), (void*)KMAP_P2V(pte_page_addr(*src_pte, srcaddr + j * pg_size)), pg_size);
+                *dst_pte = PPN(pages[j]) | PTE_P | memperm_to_pteperm(memperm);
+            }
+            if (err != ERR_OK) {
+                pmem_free_bulk(pages + j, count - j);
+                break;
+            }
+            i += count - 1;
+            srcaddr += (count - 1) * pg_size;
+            dstaddr += (count - 1) * pg_size;
+            continue;
+        }
         if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
             PPN(*dst_pte) != 0) {
             // Return an error if address already mapped
-            return ERR_VPMAP_MAP;
+            err = ERR_VPMAP_MAP;
+            break;
+        }
+        *src_pte &= ~PTE_W;
+        pmem_inc_refcnt(PTE_ADDR(*src_pte), 1);
+        *dst_pte = PPN(*src_pte) | PTE_P | perm;
+    }
+    // the source may have lost write access to some pages
+    vpmap_flush_tlb(srcvpmap, srcstart, n);
+    return err;
+}
+
+err_t
+vpmap_cow(struct vpmap *vpmap, vaddr_t vaddr, memperm_t memperm) {
+    kassert(vpmap);
+    pte_t *pte;
+    paddr_t old, paddr;
+
+    if ((pte = find_pte(vpmap->pml4, vaddr, 0)) == NULL || (*pte & PTE_P) == 0) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    if (*pte & PTE_W) {
+        // another thread got here first
+        return ERR_OK;
+    }
+    if (*pte & PTE_PS) {
+        old = paddr = PDE_ADDR(*pte);
+        if (!huge_whole(old) || pmem_get_refcnt(old) > 1) {
+            // still shared: split it and copy only the page written to, the
+            // rest stay shared and fault one at a time like 4 KiB pages
+            if (split_pde(pte) != ERR_OK) {
+                return ERR_NOMEM;
+            }
+            pte = find_pte(vpmap->pml4, vaddr, 0);
         }
-        err_t err;
-        paddr_t paddr;
-        if ((err = pmem_alloc(&paddr)) != ERR_OK) {
-            return err;
+    }
+    if (!(*pte & PTE_PS)) {
+        // once every other sharer has copied or unmapped the page, it is ours
+        old = paddr = PTE_ADDR(*pte);
+        if (pmem_get_refcnt(old) > 1) {
+            if (pmem_alloc(&paddr) != ERR_OK) {
+                return ERR_NOMEM;
+            }
+            memcpy((void*)KMAP_P2V(paddr), (void*)KMAP_P2V(old), pg_size);
+            pmem_dec_refcnt(old);
         }
-        memcpy((void*)KMAP_P2V(paddr), (void*)KMAP_P2V(PTE_ADDR(*src_pte)), pg_size);
-        *dst_pte = PPN(paddr) | PTE_P | perm;
     }
+    *pte = paddr | (*pte & (PTE_P | PTE_PS)) | memperm_to_pteperm(memperm);
+    // invlpg drops a huge page's entry as well
+    vpmap_flush_tlb(vpmap, vaddr, 1);
     return ERR_OK;
 }
 
@@ -387,14 +812,31 @@ vpmap_lookup_vaddr(struct vpmap *vpmap, vaddr_t vaddr, paddr_t *paddr, swapid_t
     if (pte) {
         if (*pte & PTE_P) {
             if (paddr) {
-                *paddr = PPN(*pte) + (vaddr - VPN(vaddr));
+                *paddr = pte_page_addr(*pte, vaddr) + (vaddr - VPN(vaddr));
             }
             return ERR_OK;
         }
+        if (swapid && PTE_IN_SWAP(*pte)) {
+            *swapid = PTE_SWAPID(*pte);
+        }
     }
     return ERR_VPMAP_NOTPRESENT;
 }
 
+err_t
+vpmap_put_swapid(struct vpmap *vpmap, vaddr_t vaddr, swapid_t swapid) {
+    kassert(vpmap);
+    kassert(swapid != SWAPID_NONE);
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    // huge pages are never swapped
+    if (pte == NULL || (*pte & PTE_P) == 0 || (*pte & PTE_PS)) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    *pte = SWAPID_PTE(swapid);
+    vpmap_flush_tlb(vpmap, vaddr, 1);
+    return ERR_OK;
+}
+
 paddr_t
 kmap_v2p(vaddr_t vaddr)
 {
@@ -414,7 +856,7 @@ kmap_io2v(paddr_t paddr)
     return KMAP_IO2V(paddr);
 }
 
-void
+err_t
 vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm) {
     kassert(vpmap);
     pteperm_t perm = memperm_to_pteperm(memperm);
@@ -422,11 +864,30 @@ vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm)
     vaddr = pg_round_down(vaddr);
     // TODO: fix pte flags. only using the last 3 bits right now.
     for (i = 0; i < n; i++) {
-        pte_t* pte = find_pte(vpmap->pml4, vaddr+i*pg_size, 0);
-        if (pte) {
-            *pte = PPN(*pte) | (PTE_FLAGS(*pte)&PTE_P) | perm;
+        vaddr_t v = vaddr + i * pg_size;
+        pte_t* pte = find_pte(vpmap->pml4, v, 0);
+        if (pte && (*pte & PTE_PS)) {
+            if ((v & (HUGE_PG_SIZE - 1)) == 0 && n - i >= HUGE_PG_PAGES) {
+                // the counts of a split block are per page, leave it to the COW fault
+                *pte = PDE_ADDR(*pte) | (PDE_FLAGS(*pte) & (PTE_P | PTE_PS)) |
+                       (huge_whole(PDE_ADDR(*pte)) ? cow_perm(perm, PDE_ADDR(*pte)) : (perm & ~PTE_W));
+                i += HUGE_PG_PAGES - 1;
+                continue;
+            }
+            // range covers part of the huge page, split it
+            if ((pte = find_pte(vpmap->pml4, v, 1)) == NULL) {
+                vpmap_flush_tlb(vpmap, vaddr, i);
+                return ERR_NOMEM;
+            }
+        }
+        if (pte && (*pte & PTE_P)) {
+            *pte = PPN(*pte) | PTE_P | cow_perm(perm, PTE_ADDR(*pte));
+        } else if (pte) {
+            *pte = PPN(*pte) | perm;
         }
     }
+    vpmap_flush_tlb(vpmap, vaddr, n);
+    return ERR_OK;
 }
 
 void
@@ -437,6 +898,16 @@ vpmap_set_dirty(struct vpmap *vpmap, vaddr_t vaddr) {
     }
 }
 
+void
+vpmap_clear_dirty(struct vpmap *vpmap, vaddr_t vaddr) {
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte && (*pte & PTE_D)) {
+        *pte = *pte & ~PTE_D;
+        // the cpu only sets the dirty bit when the cached entry lacks it
+        vpmap_flush_tlb(vpmap, vaddr, 1);
+    }
+}
+
 err_t
 vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty) {
     kassert(dirty);
@@ -460,13 +931,110 @@ vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed) {
 }
 
 void
-vpmap_flush_tlb() {
+vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr) {
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte && (*pte & PTE_A)) {
+        *pte = *pte & ~PTE_A;
+        // a cached entry would let accesses go by without setting the bit
+        vpmap_flush_tlb(vpmap, vaddr, 1);
+    }
+}
+
+void
+vpmap_flush_tlb(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    struct tlb_request *req;
+    uint32_t self, targets;
+    int cpu;
+
+    kassert(vpmap);
+    if (n == 0) {
+        return;
+    }
+    if (!tlb_ready) {
+        // a single cpu is running, reloading CR3 flushes everything
+        lcr3(rcr3());
+        return;
+    }
+    // no migrating while this cpu's request is out
     intr_set_level(INTR_OFF);
-    vaddr_t pml4 = (vaddr_t) kvpmap->pml4;
-    struct proc *p = proc_current();
-    if (p) {
-        pml4 = (vaddr_t) p->as.vpmap->pml4;
+    cpu = cpu_index(mycpu());
+    self = 1u << cpu;
+    // the page table changes must be visible before reading who caches them
+    __sync_synchronize();
+    // kernel mappings are in every vpmap
+    targets = vpmap == kvpmap ? tlb_cpus : vpmap->cpumask;
+    tlb_invalidate_local(vpmap, pg_round_down(vaddr), n);
+    if ((targets &= ~self) != 0) {
+        req = &tlb_requests[cpu];
+        req->vpmap = vpmap;
+        req->vaddr = pg_round_down(vaddr);
+        req->n = n;
+        req->acks = cpumask_weight(targets);
+        __sync_synchronize();
+        for (int i = 0; i < ncpu; i++) {
+            if (targets & (1u << i)) {
+                __sync_fetch_and_or(&per_cpu_ptr(tlb_state, i)->pending, self);
+                lapic_send_ipi(x86_64_cpus[i].lapic_id, T_IPI_TLB);
+            }
+        }
+        while (req->acks > 0) {
+            tlb_serve_requests();
+            pause();
+        }
     }
-    lcr3(KMAP_V2P(pml4));
     intr_set_level(INTR_ON);
 }
+
+static void
+tlb_invalidate_local(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    struct tlb_state *st = this_cpu_ptr(tlb_state);
+
+    if (vpmap == kvpmap) {
+        // every vpmap maps the kernel, the one loaded is flushed below
+        if (pcid_enabled) {
+            // the other PCIDs cache kernel entries too, flush them when next used
+            memset(st->pcid_owner, 0, sizeof(st->pcid_owner));
+            st->pcid_owner[st->current->pcid] = st->current->id;
+        }
+    } else if (st->current != vpmap) {
+        // nothing to do right away, the next switch to vpmap starts afresh
+        if (pcid_enabled && st->pcid_owner[vpmap->pcid] == vpmap->id) {
+            st->pcid_owner[vpmap->pcid] = 0;
+        }
+        __sync_fetch_and_and(&vpmap->cpumask, ~(1u << cpu_index(mycpu())));
+        return;
+    }
+    if (n > TLB_INVLPG_MAX) {
+        // writing CR3 without CR3_NOFLUSH flushes the current PCID
+        lcr3(rcr3());
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        invlpg(vaddr + i * pg_size);
+    }
+}
+
+static void
+tlb_serve_requests(void)
+{
+    struct tlb_state *st = this_cpu_ptr(tlb_state);
+    uint32_t pending = __sync_lock_test_and_set(&st->pending, 0);
+    struct tlb_request *req;
+
+    for (int i = 0; pending != 0; i++, pending >>= 1) {
+        if (pending & 1) {
+            req = &tlb_requests[i];
+            tlb_invalidate_local(req->vpmap, req->vaddr, req->n);
+            __sync_fetch_and_sub(&req->acks, 1);
+        }
+    }
+}
+
+static void
+tlb_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    tlb_serve_requests();
+    trap_notify_irq_completion();
+}
@@ -23,6 +23,8 @@ x86_64_syscall_trap_handler(irq_t irq, void *dev, void *regs)
     kassert(irq == T_SYSCALL);
     tf = (struct trapframe*)regs;
     thread_current()->tf = tf;
+    // syscall gate disables interrupts on entry, syscalls run with them on
+    intr_set_level(INTR_ON);
     tf->rax = syscall(tf->rax, (void*) tf);
 }
 
@@ -25,8 +25,9 @@ idt_init(void)
     for (i = 0; i < 256; i++) {
         idt[i] = GATE(vectors[i], SEG_KCODE << 3, 0, DPL_KERNEL);
     }
-    // Syscall from user space requires DPL_USER
-    idt[T_SYSCALL] = GATE(vectors[T_SYSCALL], SEG_KCODE << 3, 1, DPL_USER);
+    // Syscall from user space requires DPL_USER. Interrupt gate so that
+    // alltraps can swapgs before anything interrupts it.
+    idt[T_SYSCALL] = GATE(vectors[T_SYSCALL], SEG_KCODE << 3, 0, DPL_USER);
 }
 
 void
@@ -49,9 +50,9 @@ tf_proc(struct trapframe *tf, struct proc *p, uint64_t entry_point, uint64_t sta
     uint64_t *sp;
     kassert(tf && p);
     // double check given stackptr is mapped to a physical address
-    sleeplock_acquire(&p->as.as_lock);
+    rwsleeplock_acquire_read(&p->as.as_lock);
     kassert(vpmap_lookup_vaddr(p->as.vpmap, stack_ptr, &paddr, NULL) == ERR_OK);
-    sleeplock_release(&p->as.as_lock);
+    rwsleeplock_release_read(&p->as.as_lock);
     sp = (uint64_t*) kmap_p2v(paddr);
 
     tf->cs = (SEG_UCODE << 3) | DPL_USER;
@@ -148,3 +149,15 @@ intr_set_level(intr_t level)
     }
     return current_level;
 }
+
+void
+intr_wait(void)
+{
+    struct x86_64_cpu *cpu = mycpu();
+
+    kassert(intr_get_level() == INTR_OFF);
+    kassert(cpu->num_disabled == 1 && cpu->intr_enabled);
+    // interrupt handlers expect interrupts to be fully enabled when they hit
+    cpu->num_disabled = 0;
+    sti_hlt();
+}
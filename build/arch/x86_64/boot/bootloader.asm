@@ -0,0 +1,386 @@
+
+build/arch/x86_64/boot/bootloader.o:     file format elf32-i386
+
+
+Disassembly of section .text:
+
+00007c00 <start>:
+# with %cs=0 %ip=7c00.
+
+.code16
+.globl start
+start:
+    cli
+    7c00:	fa                   	cli
+
+# Zero DS, ES and SS
+    xorw %ax, %ax
+    7c01:	31 c0                	xor    %eax,%eax
+    movw %ax, %ds
+    7c03:	8e d8                	mov    %eax,%ds
+    movw %ax, %es
+    7c05:	8e c0                	mov    %eax,%es
+    movw %ax, %ss
+    7c07:	8e d0                	mov    %eax,%ss
+
+00007c09 <seta20.1>:
+
+# Enable address line A20
+seta20.1:
+    inb $0x64, %al
+    7c09:	e4 64                	in     $0x64,%al
+    testb $0x2, %al
+    7c0b:	a8 02                	test   $0x2,%al
+    jnz seta20.1
+    7c0d:	75 fa                	jne    7c09 <seta20.1>
+
+    movb $0xd1, %al
+    7c0f:	b0 d1                	mov    $0xd1,%al
+    outb %al, $0x64
+    7c11:	e6 64                	out    %al,$0x64
+
+00007c13 <seta20.2>:
+
+seta20.2:
+    inb $0x64, %al
+    7c13:	e4 64                	in     $0x64,%al
+    testb $0x2, %al
+    7c15:	a8 02                	test   $0x2,%al
+    jnz seta20.2
+    7c17:	75 fa                	jne    7c13 <seta20.2>
+
+    movb $0xdf, %al
+    7c19:	b0 df                	mov    $0xdf,%al
+    outb %al, $0x60
+    7c1b:	e6 60                	out    %al,$0x60
+
+00007c1d <e820_start>:
+
+# Detect E820 memory map
+e820_start:
+    xorl %ebx, %ebx
+    7c1d:	66 31 db             	xor    %bx,%bx
+    movw $E820_MAP_PADDR, %di # store e820 entires at E820_MAP_PADDR
+    7c20:	bf                   	.byte 0xbf
+    7c21:	00                   	.byte 0x0
+    7c22:	90                   	nop
+
+00007c23 <e820_loop>:
+e820_loop:
+    movl $0x534D4150, %edx
+    7c23:	66 ba 50 41          	mov    $0x4150,%dx
+    7c27:	4d                   	dec    %ebp
+    7c28:	53                   	push   %ebx
+    movl $0xE820, %eax
+    7c29:	66 b8 20 e8          	mov    $0xe820,%ax
+    7c2d:	00 00                	add    %al,(%eax)
+    movl $20, %ecx # ignore ACPI 3.0 extended attributes
+    7c2f:	66 b9 14 00          	mov    $0x14,%cx
+    7c33:	00 00                	add    %al,(%eax)
+    int $0x15
+    7c35:	cd 15                	int    $0x15
+    jc e820_end # carry should be cleared
+    7c37:	72 15                	jb     7c4e <e820_end>
+    cmpl $0x534D4150, %eax
+    7c39:	66 3d 50 41          	cmp    $0x4150,%ax
+    7c3d:	4d                   	dec    %ebp
+    7c3e:	53                   	push   %ebx
+    jne e820_end # eax should be set to the magic number
+    7c3f:	75 0d                	jne    7c4e <e820_end>
+    cmpw $20, %cx
+    7c41:	83 f9 14             	cmp    $0x14,%ecx
+    jg e820_skip # entry should be at least 20 bytes
+    7c44:	7f 03                	jg     7c49 <e820_skip>
+    addw $20, %di # next entry
+    7c46:	83 c7 14             	add    $0x14,%edi
+
+00007c49 <e820_skip>:
+e820_skip:
+    test %ebx, %ebx
+    7c49:	66 85 db             	test   %bx,%bx
+    jne e820_loop # done when ebx=0
+    7c4c:	75 d5                	jne    7c23 <e820_loop>
+
+00007c4e <e820_end>:
+e820_end:
+    mov $E820_MAP_PADDR_END, %eax
+    7c4e:	66 b8 fc 8f          	mov    $0x8ffc,%ax
+    7c52:	00 00                	add    %al,(%eax)
+    mov %edi, (%eax)
+    7c54:	67 66 89 38          	mov    %di,(%bx,%si)
+
+# Switch to protected mode
+    lgdt gdtdesc
+    7c58:	0f 01 16             	lgdtl  (%esi)
+    7c5b:	a4                   	movsb  %ds:(%esi),%es:(%edi)
+    7c5c:	7c 0f                	jl     7c6d <start32+0x1>
+    movl %cr0, %eax
+    7c5e:	20 c0                	and    %al,%al
+    orl $CR0_PE, %eax
+    7c60:	66 83 c8 01          	or     $0x1,%ax
+    movl %eax, %cr0
+    7c64:	0f 22 c0             	mov    %eax,%cr0
+
+    ljmp $(SEG_KCODE<<3), $start32
+    7c67:	ea                   	.byte 0xea
+    7c68:	6c                   	insb   (%dx),%es:(%edi)
+    7c69:	7c 08                	jl     7c73 <start32+0x7>
+	...
+
+00007c6c <start32>:
+
+.code32
+start32:
+# Set up data segment
+    movw $(SEG_KDATA<<3), %ax
+    7c6c:	66 b8 10 00          	mov    $0x10,%ax
+    movw %ax, %ds
+    7c70:	8e d8                	mov    %eax,%ds
+    movw %ax, %es
+    7c72:	8e c0                	mov    %eax,%es
+    movw %ax, %ss
+    7c74:	8e d0                	mov    %eax,%ss
+    movw $0, %ax
+    7c76:	66 b8 00 00          	mov    $0x0,%ax
+    movw %ax, %fs
+    7c7a:	8e e0                	mov    %eax,%fs
+    movw %ax, %gs
+    7c7c:	8e e8                	mov    %eax,%gs
+
+# call into C bootloader code
+    movl $start, %esp
+    7c7e:	bc 00 7c 00 00       	mov    $0x7c00,%esp
+    call bootmain
+    7c83:	e8 d4 00 00 00       	call   7d5c <bootmain>
+
+# halt the CPU if returned
+    hlt
+    7c88:	f4                   	hlt
+    7c89:	8d 76 00             	lea    0x0(%esi),%esi
+
+00007c8c <gdt>:
+	...
+    7c94:	ff                   	(bad)
+    7c95:	ff 00                	incl   (%eax)
+    7c97:	00 00                	add    %al,(%eax)
+    7c99:	9a cf 00 ff ff 00 00 	lcall  $0x0,$0xffff00cf
+    7ca0:	00                   	.byte 0x0
+    7ca1:	92                   	xchg   %eax,%edx
+    7ca2:	cf                   	iret
+	...
+
+00007ca4 <gdtdesc>:
+    7ca4:	17                   	pop    %ss
+    7ca5:	00                   	.byte 0x0
+    7ca6:	8c 7c 00 00          	mov    %?,0x0(%eax,%eax,1)
+
+00007caa <wait_disk>:
+
+static inline uint8_t
+inb(uint16_t port)
+{
+    uint8_t res;
+    asm volatile("inb %1, %0"
+    7caa:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7caf:	ec                   	in     (%dx),%al
+
+void
+wait_disk()
+{
+    // Wait for disk ready.
+    while((inb(0x1F7) & 0xC0) != 0x40) {
+    7cb0:	83 e0 c0             	and    $0xffffffc0,%eax
+    7cb3:	3c 40                	cmp    $0x40,%al
+    7cb5:	75 f8                	jne    7caf <wait_disk+0x5>
+    }
+}
+    7cb7:	c3                   	ret
+
+00007cb8 <read_sect>:
+
+void
+read_sect(void *dst, uint32_t offset)
+{
+    7cb8:	55                   	push   %ebp
+    7cb9:	89 e5                	mov    %esp,%ebp
+    7cbb:	57                   	push   %edi
+    7cbc:	50                   	push   %eax
+    7cbd:	8b 4d 0c             	mov    0xc(%ebp),%ecx
+    // Issue command
+    wait_disk();
+    7cc0:	e8 e5 ff ff ff       	call   7caa <wait_disk>
+}
+
+static inline void
+outb(uint16_t port, uint8_t data)
+{
+    asm volatile("outb %0, %1"
+    7cc5:	b0 01                	mov    $0x1,%al
+    7cc7:	ba f2 01 00 00       	mov    $0x1f2,%edx
+    7ccc:	ee                   	out    %al,(%dx)
+    7ccd:	ba f3 01 00 00       	mov    $0x1f3,%edx
+    7cd2:	89 c8                	mov    %ecx,%eax
+    7cd4:	ee                   	out    %al,(%dx)
+    outb(0x1F2, 1);   // count = 1
+    outb(0x1F3, offset);
+    outb(0x1F4, offset >> 8);
+    7cd5:	89 c8                	mov    %ecx,%eax
+    7cd7:	ba f4 01 00 00       	mov    $0x1f4,%edx
+    7cdc:	c1 e8 08             	shr    $0x8,%eax
+    7cdf:	ee                   	out    %al,(%dx)
+    outb(0x1F5, offset >> 16);
+    7ce0:	89 c8                	mov    %ecx,%eax
+    7ce2:	ba f5 01 00 00       	mov    $0x1f5,%edx
+    7ce7:	c1 e8 10             	shr    $0x10,%eax
+    7cea:	ee                   	out    %al,(%dx)
+    outb(0x1F6, (offset >> 24) | 0xE0);
+    7ceb:	89 c8                	mov    %ecx,%eax
+    7ced:	ba f6 01 00 00       	mov    $0x1f6,%edx
+    7cf2:	c1 e8 18             	shr    $0x18,%eax
+    7cf5:	83 c8 e0             	or     $0xffffffe0,%eax
+    7cf8:	ee                   	out    %al,(%dx)
+    7cf9:	b0 20                	mov    $0x20,%al
+    7cfb:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7d00:	ee                   	out    %al,(%dx)
+    outb(0x1F7, 0x20);  // cmd 0x20 - read sectors
+
+    // Read data.
+    wait_disk();
+    7d01:	e8 a4 ff ff ff       	call   7caa <wait_disk>
+    asm volatile("cld; rep insl"
+    7d06:	b9 80 00 00 00       	mov    $0x80,%ecx
+    7d0b:	8b 7d 08             	mov    0x8(%ebp),%edi
+    7d0e:	ba f0 01 00 00       	mov    $0x1f0,%edx
+    7d13:	fc                   	cld
+    7d14:	f3 6d                	rep insl (%dx),%es:(%edi)
+    insl(0x1F0, dst, SECT_SIZE/4);
+}
+    7d16:	5a                   	pop    %edx
+    7d17:	5f                   	pop    %edi
+    7d18:	5d                   	pop    %ebp
+    7d19:	c3                   	ret
+
+00007d1a <read_seg>:
+
+void
+read_seg(uint8_t *paddr, uint32_t count, uint32_t offset)
+{
+    7d1a:	55                   	push   %ebp
+    7d1b:	89 e5                	mov    %esp,%ebp
+    7d1d:	57                   	push   %edi
+    7d1e:	56                   	push   %esi
+    7d1f:	53                   	push   %ebx
+    7d20:	83 ec 0c             	sub    $0xc,%esp
+    7d23:	8b 5d 10             	mov    0x10(%ebp),%ebx
+    7d26:	8b 7d 08             	mov    0x8(%ebp),%edi
+    uint8_t* end_paddr;
+    end_paddr = paddr + count;
+    7d29:	8b 75 0c             	mov    0xc(%ebp),%esi
+    paddr -= offset % SECT_SIZE;
+    7d2c:	89 d8                	mov    %ebx,%eax
+    // kernel image starts at sector 1 (sector 0 contains bootloader)
+    offset = (offset / SECT_SIZE) + 1;
+    7d2e:	c1 eb 09             	shr    $0x9,%ebx
+    paddr -= offset % SECT_SIZE;
+    7d31:	25 ff 01 00 00       	and    $0x1ff,%eax
+    end_paddr = paddr + count;
+    7d36:	01 fe                	add    %edi,%esi
+    offset = (offset / SECT_SIZE) + 1;
+    7d38:	43                   	inc    %ebx
+    paddr -= offset % SECT_SIZE;
+    7d39:	29 c7                	sub    %eax,%edi
+
+    for (; paddr < end_paddr; paddr += SECT_SIZE, offset++) {
+    7d3b:	39 f7                	cmp    %esi,%edi
+    7d3d:	73 15                	jae    7d54 <read_seg+0x3a>
+        read_sect(paddr, offset);
+    7d3f:	50                   	push   %eax
+    7d40:	50                   	push   %eax
+    7d41:	53                   	push   %ebx
+    for (; paddr < end_paddr; paddr += SECT_SIZE, offset++) {
+    7d42:	43                   	inc    %ebx
+        read_sect(paddr, offset);
+    7d43:	57                   	push   %edi
+    for (; paddr < end_paddr; paddr += SECT_SIZE, offset++) {
+    7d44:	81 c7 00 02 00 00    	add    $0x200,%edi
+        read_sect(paddr, offset);
+    7d4a:	e8 69 ff ff ff       	call   7cb8 <read_sect>
+    for (; paddr < end_paddr; paddr += SECT_SIZE, offset++) {
+    7d4f:	83 c4 10             	add    $0x10,%esp
+    7d52:	eb e7                	jmp    7d3b <read_seg+0x21>
+    }
+}
+    7d54:	8d 65 f4             	lea    -0xc(%ebp),%esp
+    7d57:	5b                   	pop    %ebx
+    7d58:	5e                   	pop    %esi
+    7d59:	5f                   	pop    %edi
+    7d5a:	5d                   	pop    %ebp
+    7d5b:	c3                   	ret
+
+00007d5c <bootmain>:
+{
+    7d5c:	55                   	push   %ebp
+    7d5d:	89 e5                	mov    %esp,%ebp
+    7d5f:	57                   	push   %edi
+    7d60:	53                   	push   %ebx
+    read_seg((uint8_t*) elf, 4196, 0);
+    7d61:	bb 00 00 01 00       	mov    $0x10000,%ebx
+    7d66:	51                   	push   %ecx
+    7d67:	6a 00                	push   $0x0
+    7d69:	68 64 10 00 00       	push   $0x1064
+    7d6e:	68 00 00 01 00       	push   $0x10000
+    7d73:	e8 a2 ff ff ff       	call   7d1a <read_seg>
+    7d78:	83 c4 10             	add    $0x10,%esp
+        if (elf[n] == MULTIBOOT_HEADER_MAGIC) {
+    7d7b:	81 3b 02 b0 ad 1b    	cmpl   $0x1badb002,(%ebx)
+    7d81:	75 31                	jne    7db4 <bootmain+0x58>
+        ((uint32_t) hdr - (uint32_t) elf) - (hdr->header_addr - hdr->load_addr));
+    7d83:	8b 43 10             	mov    0x10(%ebx),%eax
+    read_seg((uint8_t*) hdr->load_addr, (hdr->load_end_addr - hdr->load_addr),
+    7d86:	52                   	push   %edx
+    7d87:	8d 94 03 00 00 ff ff 	lea    -0x10000(%ebx,%eax,1),%edx
+    7d8e:	2b 53 0c             	sub    0xc(%ebx),%edx
+    7d91:	52                   	push   %edx
+    7d92:	8b 53 14             	mov    0x14(%ebx),%edx
+    7d95:	29 c2                	sub    %eax,%edx
+    7d97:	52                   	push   %edx
+    7d98:	50                   	push   %eax
+    7d99:	e8 7c ff ff ff       	call   7d1a <read_seg>
+    if (hdr->bss_end_addr > hdr->load_end_addr) {
+    7d9e:	8b 4b 18             	mov    0x18(%ebx),%ecx
+    7da1:	8b 7b 14             	mov    0x14(%ebx),%edi
+    7da4:	83 c4 10             	add    $0x10,%esp
+    7da7:	39 cf                	cmp    %ecx,%edi
+    7da9:	73 16                	jae    7dc1 <bootmain+0x65>
+        stosb((void*) hdr->load_end_addr, 0,
+    7dab:	29 f9                	sub    %edi,%ecx
+}
+
+static inline void
+stosb(void *addr, uint8_t data, uint32_t cnt)
+{
+    asm volatile("cld; rep stosb"
+    7dad:	31 c0                	xor    %eax,%eax
+    7daf:	fc                   	cld
+    7db0:	f3 aa                	rep stos %al,%es:(%edi)
+                 : "=D" (addr), "=c" (cnt)
+                 : "0" (addr), "1" (cnt), "a" (data)
+                 : "memory", "cc");
+}
+    7db2:	eb 0d                	jmp    7dc1 <bootmain+0x65>
+    for (int n = 0; n < 4196/sizeof(*elf); n++) {
+    7db4:	83 c3 04             	add    $0x4,%ebx
+    7db7:	81 fb 64 10 01 00    	cmp    $0x11064,%ebx
+    7dbd:	75 bc                	jne    7d7b <bootmain+0x1f>
+    7dbf:	eb 0c                	jmp    7dcd <bootmain+0x71>
+    asm volatile("\tmovl %0, %%eax\n"
+    7dc1:	8b 4b 1c             	mov    0x1c(%ebx),%ecx
+    7dc4:	ba 02 b0 ad 2b       	mov    $0x2badb002,%edx
+    7dc9:	89 d0                	mov    %edx,%eax
+    7dcb:	ff d1                	call   *%ecx
+}
+    7dcd:	8d 65 f8             	lea    -0x8(%ebp),%esp
+    7dd0:	5b                   	pop    %ebx
+    7dd1:	5f                   	pop    %edi
+    7dd2:	5d                   	pop    %ebp
+    7dd3:	c3                   	ret
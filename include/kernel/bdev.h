@@ -7,6 +7,7 @@
 #include <kernel/types.h>
 #include <kernel/synch.h>
 #include <kernel/list.h>
+#include <kernel/reclaim.h>
 
 struct bdev;
 struct bdev_request;
@@ -32,6 +33,7 @@ struct bdev {
     void *data; // device specific data
     struct memstore *store; // memstore to read memory pages from this device
     struct super_block *sb; // bdev's super block if available
+    struct shrinker shrinker; // frees the headers of idle cached blocks
 };
 
 // Root block device (for root file system)
@@ -52,7 +54,8 @@ typedef enum {
 
 typedef enum {
     BIO_PENDING,
-    BIO_COMPLETE
+    BIO_COMPLETE,
+    BIO_ERROR // the device reported an error, buffer contents are undefined
 } bio_status_t;
 
 /*
@@ -99,7 +102,8 @@ void bio_free(struct bio *bio);
 
 /*
  * Submit a block device request. This function is synchronous: it returns only
- * when the request is completed by the block device.
+ * when the request is completed by the block device, with bio->status set to
+ * BIO_COMPLETE or BIO_ERROR.
  */
 void bdev_make_request(struct bio *bio);
 
@@ -108,7 +112,7 @@ void bdev_make_request(struct bio *bio);
  */
 struct blk_header {
     // Lock to protect data structures in the header
-    struct sleeplock lock;
+    struct mutex lock;
     // List node for page->blk_headers
     Node node;
     // Block device that the block belongs to
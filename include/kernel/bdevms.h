@@ -6,6 +6,7 @@
  */
 
 #include <kernel/memstore.h>
+#include <kernel/bdev.h>
 
 struct bdevms_info {
     struct bdev *bdev;
@@ -21,4 +22,14 @@ struct memstore *bdevms_alloc(struct bdev *bdev);
  */
 void bdevms_free(struct memstore *store);
 
+/*
+ * Read or write the page at paddr from or to the page sized run of blocks of
+ * bdev starting at blk.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate the request.
+ * ERR_FAULT - The device reported an error.
+ */
+err_t bdevms_page_io(struct bdev *bdev, blk_t blk, paddr_t paddr, bio_op_t op);
+
 #endif /* _BDEVMS_H_ */
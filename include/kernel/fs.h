@@ -77,7 +77,7 @@ struct super_block
     struct radix_tree_root s_icache; // Inode cache lookup table
     unsigned int s_ref;              // Reference counter.
     state_t s_state;                 // State of in-memory superblock.
-    struct sleeplock s_lock;         // Lock protecting superblock data structures.
+    struct rwsleeplock s_lock;       // Lock protecting superblock data structures.
     void *s_fs_info;                 // Filesystem specific superblock info
     struct super_operations *s_ops;  // Superblock operations
 };
@@ -210,7 +210,7 @@ struct inode
 {
     inum_t i_inum;                  // Inode number
     struct super_block *sb;         // Superblock
-    unsigned int i_ref;             // Reference counter. Note that reference counter is protected by the superblock's s_lock
+    unsigned int i_ref;             // Reference counter. Protected by the superblock's s_lock, held for read it may only be incremented atomically
     unsigned int i_nlink;           // Number of links
     ftype_t i_ftype;                // File type
     fmode_t i_mode;                 // File permission
@@ -289,6 +289,17 @@ struct inode_operations
      * ERR_INCOMP - Failed to fill in the entire page.
      */
     err_t (*fillpage)(struct inode *inode, offset_t ofs, struct page *page);
+    /*
+     * Write a memory page back to an inode at ofs. Only the part of the page
+     * within the file is written, the file never grows.
+     *
+     * Precondition:
+     * Caller must be in a journal transaction.
+     *
+     * Return:
+     * ERR_INCOMP - Failed to write the page.
+     */
+    err_t (*writepage)(struct inode *inode, offset_t ofs, struct page *page);
     /*
      * Create a new hard link in directory dir that refers to inode src. The
      * new hard link has name ``name``.
@@ -367,6 +378,11 @@ err_t fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode);
  */
 void fs_release_inode(struct inode *inode);
 
+/*
+ * Take another reference to an inode the caller already holds a reference to.
+ */
+void fs_reopen_inode(struct inode *inode);
+
 /*
  * Look up an inode using a path name. The caller is responsible for releasing
  * the inode after use.
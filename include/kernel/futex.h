@@ -0,0 +1,34 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <kernel/types.h>
+#include <kernel/vm.h>
+
+/*
+ * Futexes let user space block on a 32-bit word of its own memory. A futex is
+ * identified by (address space, user virtual address), waiters hang off a
+ * fixed hash table of wait queues.
+ */
+
+/* Initialize the futex wait queues. */
+void futex_init(void);
+
+/*
+ * If the word at uaddr in as, the current process's address space, still
+ * holds val, sleep until woken by futex_wake on the same word. The check and
+ * the sleep are atomic with respect to futex_wake. A word on a page that is
+ * not present is faulted in first.
+ *
+ * Return:
+ * ERR_OK - Woken by futex_wake.
+ * ERR_INVAL - uaddr is not 4-byte aligned.
+ * ERR_FAULT - uaddr is not valid memory in as.
+ * ERR_NOMEM - The word's page could not be faulted in.
+ * ERR_AGAIN - The word no longer holds val.
+ */
+err_t futex_wait(struct addrspace *as, vaddr_t uaddr, int val);
+
+/* Wake up to n threads waiting on uaddr in as, return the number woken. */
+int futex_wake(struct addrspace *as, vaddr_t uaddr, int n);
+
+#endif /* _FUTEX_H_ */
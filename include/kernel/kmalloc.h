@@ -8,10 +8,13 @@
  * 1. Allocation of fixed-size objects. An object allocator is created by
  * calling ``kmem_cache_create`` with the object size. The object allocator
  * provides two functions, ``kmem_cache_alloc`` and ``kmem_cache_free``, to
- * allocate and free objects.
+ * allocate and free objects, and bulk versions of both for batches.
  *
  * 2. A generic kmalloc function. The caller specifies the size of allocation.
  * The function however may allocate more memory than requested.
+ *
+ * Object allocators keep freed objects in per-cpu magazines [Bonwick01], so
+ * most allocations and frees don't touch the allocator's lock.
  */
 
 #include <kernel/types.h>
@@ -26,20 +29,43 @@ struct slab {
     Node node;
     // Address of the first object
     void *objs;
-    // Index of the next free slot
-    int free;
+    // First free object, each free object holds the address of the next
+    void *freelist;
+    // Number of allocated objects
+    int inuse;
     // Size of the slab (number of pages)
     size_t n_pages;
 };
 
+struct kmem_magazine;
+struct kmem_cpu_cache;
+
 /*
  * Object allocator.
  */
 struct kmem_cache {
     List full; // Linked-list of slabs that are fully allocated
-    List free; // Linked-list of slabs that have free slots
+    List free; // Linked-list of slabs that have free slots and allocated objects
+    List empty; // Linked-list of slabs without allocated objects
     struct spinlock lock;
     size_t obj_size;
+    // Slab layout: pages per slab, objects per slab, number of colors
+    size_t slab_pages;
+    int slab_objs;
+    int n_colors;
+    // Color of the next slab
+    int color_next;
+    // Per-cpu magazines, indexed by cpu, NULL if the allocator has none
+    struct kmem_cpu_cache *cpu_caches;
+    // Depot of full and empty magazines shared by all cpus
+    struct spinlock depot_lock;
+    struct kmem_magazine *depot_full;
+    struct kmem_magazine *depot_empty;
+    size_t depot_nfull;
+    // Node in the list of all allocators with magazines
+    Node cache_node;
+    // kmalloc_reap calls working on the allocator, protected by the list's lock
+    int reap_pins;
 };
 
 /*
@@ -47,8 +73,14 @@ struct kmem_cache {
  */
 void kmalloc_init(void);
 
+/*
+ * Enable per-cpu magazines, per-cpu data must be set up.
+ */
+void kmalloc_magazine_init(void);
+
 /*
  * Create an allocator that allocates/frees objects of size ``size``.
+ * Return NULL if out of memory or if size is too large for a slab.
  */
 struct kmem_cache *kmem_cache_create(size_t size);
 
@@ -67,6 +99,51 @@ void *kmem_cache_alloc(struct kmem_cache *kmem_cache);
  */
 void kmem_cache_free(struct kmem_cache *kmem_cache, void *obj);
 
+/*
+ * Allocate n objects from the allocator into objs. Takes the allocator's
+ * locks once per batch instead of once per object.
+ *
+ * Return:
+ * ERR_OK - All n objects allocated.
+ * ERR_NOMEM - Failed to allocate n objects, none are allocated.
+ */
+err_t kmem_cache_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+
+/*
+ * Free the n objects in objs and return them to the allocator.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+
+/*
+ * Largest allocation kmalloc serves from its object allocators. Larger ones
+ * get a run of exactly as many pages as they need.
+ */
+#define KMALLOC_MAX_SIZE 4096
+
+/*
+ * Statistics of a kmalloc size class.
+ */
+struct kmalloc_class_stat {
+    size_t size;    // object size, 0 for the class of large allocations
+    size_t allocs;
+    size_t frees;
+    size_t wasted;  // bytes allocated beyond the requested sizes, over all allocations
+};
+
+/*
+ * Fill in the statistics of up to n kmalloc size classes, smallest first,
+ * summed over all cpus. Return the number of classes filled in.
+ */
+int kmalloc_stats(struct kmalloc_class_stat *stats, int n);
+
+/*
+ * Return the empty slabs of every allocator to pmem, after moving the objects
+ * cached in magazine depots back to their slabs. Each allocator keeps a small
+ * reserve of empty slabs, and objects in per-cpu magazines stay there. Return
+ * the number of pages freed.
+ */
+size_t kmalloc_reap(void);
+
 /*
  * Allocate ``size`` bytes of memory.
  */
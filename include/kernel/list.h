@@ -50,6 +50,9 @@ int list_empty(List* list);
 /* Append node at the end of a list. */
 void list_append(List* list, Node* node);
 
+/* Insert node in front of before, which may be the list's end. */
+void list_insert(Node* before, Node* node);
+
 /* Append node behind the largest smaller node according to comparator func. */
 void list_append_ordered(List *list, Node *node, comparator *compare, void *aux);
 
@@ -36,6 +36,12 @@ struct memstore {
     struct sleeplock pgcache_lock;
     struct radix_tree_root cached_pages;
 
+    /*
+     * Clean cached pages may be dropped under memory pressure, fillpage reads
+     * them back. False by default.
+     */
+    bool reclaimable;
+
     /*
      * Fill a page with data read from this store at the offset position. Each
      * type of memstore implements its own version of the fillpage function.
@@ -51,6 +57,13 @@ struct memstore {
      * err_t write(struct memstore *this, paddr_t paddr, offset_t ofs);
      */
     err_t (*write)(struct memstore*, paddr_t, offset_t);
+
+    /*
+     * Take and drop a reference on whatever owns this store, so the store
+     * outlives every memregion mapping it. NULL if the store needs none.
+     */
+    void (*get)(struct memstore*);
+    void (*put)(struct memstore*);
 };
 
 /*
@@ -59,8 +72,10 @@ struct memstore {
 struct memstore *memstore_alloc(void);
 
 /*
- * Free a memstore. Specific memstore implementation should clean up store->data
- * before calling this function.
+ * Free a memstore, dropping the page cache's references to cached pages.
+ * No memregion may map the store anymore.
+ * Specific memstore implementation should clean up store->data before calling
+ * this function.
  */
 void memstore_free(struct memstore *store);
 
@@ -22,6 +22,15 @@ struct memstore;
  */
 struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
 
+/*
+ * Return the page at ofs if it is in the page cache, NULL otherwise. Never
+ * reads from the memstore.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+struct page *pgcache_lookup_page(struct memstore *store, offset_t ofs);
+
 /*
  * Remove a cached page from the page cache.
  *
@@ -30,4 +39,14 @@ struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
  */
 void pgcache_remove_page(struct memstore *memstore, offset_t ofs);
 
+/*
+ * Copy buf, just written to the store at [ofs, ofs + len) behind the cache's
+ * back, into the cached pages it overlaps. Mappings of those pages see the
+ * new data, and writing one back later doesn't undo the write.
+ *
+ * Precondition:
+ * Caller must not hold store->pgcache_lock, buf may fault on the store.
+ */
+void pgcache_update(struct memstore *store, offset_t ofs, const void *buf, size_t len);
+
 #endif /* _PGCACHE_H_ */
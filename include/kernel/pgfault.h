@@ -9,4 +9,16 @@
  
 void handle_page_fault(vaddr_t fault_addr, int present, int write, int user);
 
+/*
+ * Make the non-present user page at addr of the current process present, as
+ * if user space had touched it, for kernel code that reads user memory
+ * through the kernel mapping. The caller looks the page up again after.
+ *
+ * Return:
+ * ERR_OK - The page is mapped, or memory was freed and the caller retries.
+ * ERR_NOMEM - Out of memory, and nothing could be reclaimed.
+ * ERR_FAULT - addr is not valid user memory, or its page could not be read.
+ */
+err_t fault_in_user_page(vaddr_t addr, int write);
+
 #endif /* _PGFAULT_H_ */
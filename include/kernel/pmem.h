@@ -14,7 +14,7 @@
  * Each physical page has an associated struct page.
  */
 struct page {
-    struct sleeplock lock;
+    struct mutex lock;
     Node node;
     struct kmem_cache *kmem_cache;
     struct slab *slab;
@@ -24,13 +24,29 @@ struct page {
     int refcnt;
     // size of the block (power of two number of pages)
     int order;
-    // Status of the page. Contains the following flags:
-    // - DIRTY
+    // Status of the page. Contains the PAGE_*_BIT flags below.
     state_t state;
     // used by bdev to locate block headers
     List blk_headers;
+    // memstore whose page cache holds the page, and the offset within it
+    struct memstore *store;
+    offset_t ofs;
+    // link in the page reclaim lists
+    Node lru_node;
+    // number of pages of a large kmalloc allocation, on its first page
+    size_t kmalloc_pages;
 };
 
+// Page state bits
+#define PAGE_DIRTY_BIT 0
+// Page is free and sits in a per-cpu cache, it must not be merged with its buddy
+#define PAGE_PCP_BIT 1
+// Page is on one of the reclaim lists, and which one
+#define PAGE_LRU_BIT 2
+#define PAGE_ACTIVE_BIT 3
+// Page cache lookup since reclaim last looked at the page
+#define PAGE_REFERENCED_BIT 4
+
 /*
  * Translate physical address to struct page.
  */
@@ -51,11 +67,30 @@ void pmem_boot_init(void);
  */
 void pmem_init(void);
 
+/*
+ * Enable the per-cpu caches of free pages, per-cpu data must be set up.
+ */
+void pmem_pcp_init(void);
+
 /*
  * Print physical memory status
  */
 void pmem_info(void);
 
+/*
+ * Number of free pages, counting those held in per-cpu caches and the zero
+ * pool. Read without locking, so only an estimate.
+ */
+size_t pmem_nr_free(void);
+
+/*
+ * Free page watermarks, scaled to the amount of physical memory. Page reclaim
+ * is woken when free pages drop below the low watermark and stops once they
+ * are back above the high one.
+ */
+extern size_t pmem_wmark_low;
+extern size_t pmem_wmark_high;
+
 /*
  * Machine-dependent physical memory initialization: store the physical memory
  * configuration in a ``pmemconfig`` struct.
@@ -76,6 +111,17 @@ void pmem_arch_init(void);
  */
 err_t pmem_alloc(paddr_t *paddr);
 
+/*
+ * Same as pmem_alloc, but the page is filled with zeros. Prefers pages zeroed
+ * in the background by the zero thread.
+ */
+err_t pmem_alloc_zeroed(paddr_t *paddr);
+
+/*
+ * Start the thread that keeps a pool of zeroed pages.
+ */
+void pmem_zero_init(void);
+
 /*
  * Allocate n physical pages. Physical pages are guaranteed to be contiguous.
  * Store the address of the first physical page in ``paddr``.
@@ -86,11 +132,51 @@ err_t pmem_alloc(paddr_t *paddr);
  */
 err_t pmem_nalloc(paddr_t *paddr, size_t n);
 
+/*
+ * Split the block allocated at ``paddr`` into single pages, each with the
+ * block's reference count, so that they can be freed one at a time. Nothing
+ * happens if the block was split already.
+ */
+void pmem_split(paddr_t paddr);
+
+/*
+ * Allocate exactly n contiguous physical pages. The buddy block holding them
+ * is carved into aligned power-of-two blocks, and the ones past the first n
+ * pages go back to the free lists right away. The pages must be freed with
+ * pmem_nfree_exact.
+ *
+ * Return:
+ * ERR_OK - n physical pages successfully allocated.
+ * ERR_NOMEM - Failed to allocated physical pages.
+ */
+err_t pmem_nalloc_exact(paddr_t *paddr, size_t n);
+
+/*
+ * Deallocate n physical pages allocated by pmem_nalloc_exact.
+ */
+void pmem_nfree_exact(paddr_t paddr, size_t n);
+
 /*
  * Deallocate one physical page at ``addr``.
  */
 void pmem_free(paddr_t paddr);
 
+/*
+ * Allocate n physical pages, not necessarily contiguous, and store their
+ * addresses in paddrs. Takes the allocator's locks once per batch instead of
+ * once per page.
+ *
+ * Return:
+ * ERR_OK - n physical pages successfully allocated.
+ * ERR_NOMEM - Failed to allocate n pages, none are allocated.
+ */
+err_t pmem_alloc_bulk(paddr_t *paddrs, size_t n);
+
+/*
+ * Deallocate the n single physical pages in paddrs.
+ */
+void pmem_free_bulk(paddr_t *paddrs, size_t n);
+
 /*
  * Deallocate n physical pages starting at ``addr``.
  */
@@ -108,13 +194,24 @@ void pmem_set_page_dirty(struct page *page, int dirty);
 int pmem_get_refcnt(paddr_t paddr);
 
 /*
- * Increment the reference count of a physical page by n.
+ * Increment the reference count of a physical page by n. For a block of
+ * pages allocated together, paddr is its first page and the count covers
+ * the whole block.
  */
 void pmem_inc_refcnt(paddr_t paddr, int n);
 
 /*
- * Decrement the reference count of a physical page by 1.
+ * Decrement the reference count of a physical page (or block) by 1, freeing
+ * it when the count drops to zero.
  */
 void pmem_dec_refcnt(paddr_t paddr);
 
+/*
+ * Increment by n, or decrement by 1, the references on every page of the
+ * npages block at paddr: the count of the block while it is whole, or of
+ * each page once pmem_split split it under a holder that did not know.
+ */
+void pmem_inc_refcnt_block(paddr_t paddr, size_t npages, int n);
+void pmem_dec_refcnt_block(paddr_t paddr, size_t npages);
+
 #endif /* _PMEM_H_ */
@@ -72,6 +72,26 @@ bool proc_detach_thread(struct thread *t);
  */
 int proc_wait(pid_t, int *status);
 
+/*
+ * Set the priority of every thread of process pid, which must be the current
+ * process or one of its children.
+ *
+ * Return:
+ * ERR_OK - Priority is set.
+ * ERR_INVAL - Priority is not within [PRI_MIN, PRI_MAX].
+ * ERR_NOTEXIST - No live process with the given pid.
+ * ERR_PERM - Process pid is neither the caller nor one of its children.
+ */
+err_t proc_set_priority(pid_t pid, int priority);
+
+/*
+ * Find the live process with the smallest pid above pid, wrapping around to
+ * the smallest one, whose address space lock can be taken without waiting.
+ * Return it with as_lock held for writing, the process is not freed before
+ * the lock is released. NULL if there is no such process.
+ */
+struct proc *proc_lock_next_as(pid_t pid);
+
 /* Exit a process with a status */
 void proc_exit(int);
 
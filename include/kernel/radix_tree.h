@@ -63,4 +63,10 @@ err_t radix_tree_insert(struct radix_tree_root *root, int index, void *leaf);
  */
 void *radix_tree_remove(struct radix_tree_root *root, int index);
 
+/*
+ * Return the leaf node with the smallest index no less than *index, and store
+ * its index in *index. Return NULL if there is no such node.
+ */
+void *radix_tree_next(struct radix_tree_root *root, int *index);
+
 #endif /* _RADIX_TREE_H_ */
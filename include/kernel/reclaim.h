@@ -0,0 +1,77 @@
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+#include <kernel/types.h>
+
+/*
+ * Page reclaim. Cached pages of reclaimable memstores sit on an active and an
+ * inactive list. Reclaim ages pages with a second chance clock over the
+ * accessed bits of their mappings, and drops clean inactive pages from the
+ * page cache after unmapping them through the store's reverse mapping. A
+ * kswapd thread does this in the background whenever free memory falls below
+ * the low watermark. Once the page cache runs dry, subsystems are asked to
+ * drop the kernel objects they cache through their shrinkers, and the slabs
+ * this empties go back to pmem. After that, anonymous pages go to swap.
+ */
+
+#include <kernel/list.h>
+
+struct page;
+
+/*
+ * A subsystem's callback for freeing its cached kernel objects.
+ */
+struct shrinker {
+    // Free up to nr unused cached objects, return the number freed. Called
+    // without spinlocks held. May not block on locks that a reclaiming
+    // thread could hold, use try-acquire instead.
+    size_t (*scan)(struct shrinker *shrinker, size_t nr);
+    void *data;     // for use by the subsystem
+    Node node;      // node in the list of shrinkers
+};
+
+/* Initialize the reclaim lists and start kswapd. */
+void reclaim_init(void);
+
+/*
+ * Put a page newly inserted into the page cache on the inactive list.
+ *
+ * Precondition:
+ * Caller must hold page->store->pgcache_lock.
+ */
+void reclaim_add_page(struct page *page);
+
+/*
+ * Take a page about to leave the page cache off the reclaim lists. No-op for
+ * pages not on them.
+ *
+ * Precondition:
+ * Caller must hold page->store->pgcache_lock.
+ */
+void reclaim_remove_page(struct page *page);
+
+/*
+ * Note a page cache hit on page, giving it a second chance.
+ *
+ * Precondition:
+ * Caller must hold page->store->pgcache_lock.
+ */
+void reclaim_mark_accessed(struct page *page);
+
+/*
+ * Add a shrinker to or remove it from the ones reclaim calls. Must be called
+ * after reclaim_init.
+ */
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+
+/* Ask kswapd to free pages up to the high watermark. */
+void reclaim_wakeup(void);
+
+/*
+ * Try to free n pages right away, return the number freed. Caller must not
+ * hold a spinlock, dropping a page frees page cache nodes to kmalloc.
+ */
+size_t reclaim_pages(size_t n);
+
+#endif /* _RECLAIM_H_ */
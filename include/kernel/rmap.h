@@ -2,13 +2,20 @@
 #define _RMAP_H_
 
 #include <kernel/list.h>
+#include <kernel/synch.h>
+#include <kernel/types.h>
 
 /*
- * Reverse mapping for tracking shared memory regions.
+ * Reverse mapping for tracking shared memory regions. Each memstore keeps the
+ * memregions mapping it, so a cached page of the store can be found in every
+ * address space it is mapped into.
  */
 
+struct memregion;
+
 struct rmap {
-    List regions;
+    struct sleeplock lock;  // protects regions, held across TLB shootdowns
+    List regions;           // memregions mapping the store, linked by rmap_node
 };
 
 /*
@@ -31,9 +38,37 @@ void rmap_construct(struct rmap *rmap);
  */
 void rmap_destroy(struct rmap *rmap);
 
+/*
+ * Add and remove a memregion mapping the store.
+ *
+ * Precondition:
+ * Caller must hold region->as->as_lock.
+ */
+void rmap_add_region(struct rmap *rmap, struct memregion *region);
+void rmap_remove_region(struct rmap *rmap, struct memregion *region);
+
+/*
+ * Test and clear the accessed bit of every mapping of the cached page at
+ * paddr. Mappings in an address space that is busy count as accessed.
+ *
+ * Precondition:
+ * Caller must hold the store's pgcache_lock.
+ */
+bool rmap_referenced(struct rmap *rmap, paddr_t paddr);
+
 /*
  * Unmap all memory mappings of a physical page
+ *
+ * Precondition:
+ * Caller must hold the store's pgcache_lock.
+ *
+ * Return:
+ * ERR_OK - No mapping of the page is left.
+ * ERR_LOCK_BUSY - An address space mapping the page is busy.
+ * ERR_RMAP_DIRTY - A mapping has unwritten changes to the page.
+ * Mappings already removed when an error is returned stay removed.
  */
+#define ERR_RMAP_DIRTY 1
 err_t rmap_unmap(struct rmap *rmap, paddr_t paddr);
 
 #endif /* _RMAP_H_ */
@@ -4,18 +4,19 @@
 #include <kernel/synch.h>
 #include <kernel/thread.h>
 
-struct spinlock sched_lock;
-
 /* initialize lists used by scheduler */
 void sched_sys_init();
 
+/* Register the handler for resched IPIs sent to idle cpus */
+err_t sched_register_trap_handler(void);
+
 /* start scheduling for the calling AP, interrupt must be off when calling this */
 err_t sched_start();
 
 /* start scheduling for the calling AP, interrupt must be off when calling this */
 err_t sched_start_ap();
 
-/* Add thread to ready queue */
+/* Add thread to the run queue of the cpu it last ran on */
 void sched_ready(struct thread*);
 
 /* 
@@ -24,5 +25,23 @@ void sched_ready(struct thread*);
 */
 void sched_sched(threadstate_t next_state, void* lock) ;
 
+/*
+ * Release the current cpu's run queue lock held across a context switch.
+ * Called by a thread right after it is switched to, interrupt must be off.
+ */
+void sched_finish_switch(void);
+
+/*
+ * Idle loop run by each cpu's idle thread, never returns. Halts the cpu with
+ * its tick stopped while no run queue has work.
+ */
+void sched_idle(void) __attribute__((noreturn));
+
+/* Age the current cpu's run queue, called on every timer tick */
+void sched_tick(void);
+
+/* Return number of threads on the given cpu's run queue */
+size_t sched_nr_ready(int cpu);
+
 
 #endif /* _SCHED_H_ */
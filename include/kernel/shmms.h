@@ -8,13 +8,21 @@
  */
 
 /*
- * Allocate a shared memory memstore. TODO: parameters
+ * Shared memory memstore descriptor.
+ */
+struct shmms_info {
+    int ref;                // memregions mapping the store
+};
+
+/*
+ * Allocate a shared memory memstore. The store is freed when the last
+ * memregion mapping it goes away.
  * Return NULL if failed to allocate.
  */
 struct memstore *shmms_alloc(void);
 
 /*
- * Free a shared memory memstore.
+ * Free a shared memory memstore that was never mapped.
  */
 void shmms_free(struct memstore *store);
 
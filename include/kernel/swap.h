@@ -0,0 +1,51 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for anonymous memory. Swap is a dedicated region of a block
+ * device, accessed through a swap memstore, and divided into page sized
+ * slots. A swapid names a slot, SWAPID_NONE is never a valid one. Slots are
+ * reference counted, so a forked child shares its parent's swapped out pages
+ * the same way it shares resident ones.
+ */
+#include <kernel/types.h>
+
+struct bdev;
+
+/*
+ * Set up the swap area on bdev. Swap stays disabled if its bookkeeping can't
+ * be allocated.
+ */
+void swap_init(struct bdev *bdev);
+
+/*
+ * Allocate a free slot with a reference count of one.
+ *
+ * Return:
+ * ERR_OK - Slot allocated, its swapid is stored in *swapid.
+ * ERR_NOMEM - Swap is full or disabled.
+ */
+err_t swap_alloc(swapid_t *swapid);
+
+/*
+ * Take and drop a reference on a slot. The slot is free again once the last
+ * reference is dropped.
+ */
+void swap_dup(swapid_t swapid);
+void swap_free(swapid_t swapid);
+
+/*
+ * Write the page at paddr to a slot, or read a slot into the page at paddr.
+ * Return ERR_NOMEM if the request could not be allocated, ERR_FAULT if the
+ * disk reported an error.
+ */
+err_t swap_write(swapid_t swapid, paddr_t paddr);
+err_t swap_read(swapid_t swapid, paddr_t paddr);
+
+/*
+ * Write up to n cold anonymous pages of user processes to swap and free them.
+ * Return the number of pages freed.
+ */
+size_t swap_out(size_t n);
+
+#endif /* _SWAP_H_ */
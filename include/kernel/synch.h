@@ -5,13 +5,45 @@
 
 #define SPIN 0
 #define SLEEP 1
+#define RWSLEEP 2
+#define MUTEX 3
 #define LOCK_TYPE(lk) (*(uint8_t*)lk)
 
-/* Spinlock */
+/*
+ * Contention statistics, shared by all locks initialized at the same
+ * spinlock_init/sleeplock_init call site. Registered on first use.
+ * Successful acquires are counted per cpu, so an uncontended acquire doesn't
+ * write to a cache line shared with the site's other locks; the shared
+ * counters are only updated by acquires that had to wait anyway.
+ */
+struct lock_stat {
+    const char *name;           // lock expression passed to the init macro
+    const char *file;
+    int line;
+    volatile int registered;    // registration state, slot is valid once done
+    int slot;                   // 1 + index of the per-cpu acquire counter, 0 if none
+    struct lock_stat *next;     // next registered lock_stat
+    uint64_t contended;         // acquires that had to wait
+    uint64_t spin_cycles;       // tsc cycles spent waiting
+};
+
+#define LOCK_STAT_INIT(lock) { .name = #lock, .file = __FILE__, .line = __LINE__ }
+
+/*
+ * Spinlock, a ticket lock: acquirers take the next ticket and spin until
+ * owner reaches it, so the lock is handed out in FIFO order.
+ */
 struct spinlock {
     uint8_t type;
-    uint8_t lock_status;
+    union {
+        uint32_t tickets;
+        struct {
+            uint16_t owner;     // ticket being served
+            uint16_t next;      // next ticket to hand out
+        };
+    };
     struct thread *holder;
+    struct lock_stat *stat;
 };
 
 /* Condition variable */
@@ -27,11 +59,45 @@ struct sleeplock {
     struct thread *holder;
 };
 
+/*
+ * Reader-writer sleeplock, any number of readers or a single writer.
+ * Writers are preferred: once a writer waits, new readers block, so a
+ * thread must not take the read lock again while already holding it.
+ */
+struct rwsleeplock {
+    uint8_t type;
+    struct spinlock lk;         // spinlock that protects the fields below
+    struct condvar readers;     // blocked readers
+    struct condvar writers;     // blocked writers
+    int nreaders;               // threads holding the read lock
+    int nwriters_waiting;       // writers blocked in rwsleeplock_acquire_write
+    struct thread *holder;      // thread holding the write lock
+};
+
+/*
+ * Adaptive mutex for short critical sections that may still block. An
+ * acquirer spins while the holder is running on another cpu, and only
+ * sleeps once the holder is descheduled or the spin budget runs out.
+ */
+struct mutex {
+    uint8_t type;
+    struct spinlock lk;         // protects waiters, only taken on the slow path
+    struct condvar waiters;
+    int nwaiters;               // threads on the slow path, checked by release
+    struct thread *holder;      // set with compare-and-swap
+};
+
 void synch_init(void);
 
 /* spinlock operations */
 
-void spinlock_init(struct spinlock *lock);
+void spinlock_init_stat(struct spinlock *lock, struct lock_stat *stat);
+
+/* Initialize a spinlock, locks initialized here share one lock_stat */
+#define spinlock_init(lock) do { \
+    static struct lock_stat __lock_stat = LOCK_STAT_INIT(lock); \
+    spinlock_init_stat((lock), &__lock_stat); \
+} while (0)
 
 err_t spinlock_try_acquire(struct spinlock* lock);
 
@@ -41,7 +107,13 @@ void spinlock_release(struct spinlock *lock);
 
 /* sleep lock operations */
 
-void sleeplock_init(struct sleeplock *lock);
+void sleeplock_init_stat(struct sleeplock *lock, struct lock_stat *stat);
+
+/* Initialize a sleeplock, its internal spinlock reports to a lock_stat for this call site */
+#define sleeplock_init(lock) do { \
+    static struct lock_stat __lock_stat = LOCK_STAT_INIT(lock); \
+    sleeplock_init_stat((lock), &__lock_stat); \
+} while (0)
 
 err_t sleeplock_try_acquire(struct sleeplock* lock);
 
@@ -49,18 +121,66 @@ void sleeplock_acquire(struct sleeplock *lock);
 
 void sleeplock_release(struct sleeplock *lock);
 
-/* generic lock (can be spin or sleeplock) operations */
+/* reader-writer sleep lock operations */
+
+void rwsleeplock_init_stat(struct rwsleeplock *lock, struct lock_stat *stat);
+
+/* Initialize a rwsleeplock, its internal spinlock reports to a lock_stat for this call site */
+#define rwsleeplock_init(lock) do { \
+    static struct lock_stat __lock_stat = LOCK_STAT_INIT(lock); \
+    rwsleeplock_init_stat((lock), &__lock_stat); \
+} while (0)
+
+void rwsleeplock_acquire_read(struct rwsleeplock *lock);
+
+void rwsleeplock_release_read(struct rwsleeplock *lock);
+
+void rwsleeplock_acquire_write(struct rwsleeplock *lock);
+
+err_t rwsleeplock_try_acquire_write(struct rwsleeplock *lock);
+
+void rwsleeplock_release_write(struct rwsleeplock *lock);
+
+/* adaptive mutex operations */
+
+void mutex_init_stat(struct mutex *lock, struct lock_stat *stat);
+
+/* Initialize a mutex, its slow path spinlock reports to a lock_stat for this call site */
+#define mutex_init(lock) do { \
+    static struct lock_stat __lock_stat = LOCK_STAT_INIT(lock); \
+    mutex_init_stat((lock), &__lock_stat); \
+} while (0)
+
+err_t mutex_try_acquire(struct mutex *lock);
+
+void mutex_acquire(struct mutex *lock);
+
+void mutex_release(struct mutex *lock);
+
+/* generic lock (spinlock, mutex or sleeplock, not rwsleeplock) operations */
 
 void lock_acquire(void *lock);
 
 void lock_release(void *lock);
 
+/* Return the first registered lock_stat, follow next for the rest */
+struct lock_stat* lock_stat_list(void);
+
+/* Return the successful acquires of a lock_stat's locks, summed over cpus */
+uint64_t lock_stat_acquires(struct lock_stat *stat);
+
 /* condition variable operations */
 
 void condvar_init(struct condvar *cv);
 
 void condvar_wait(struct condvar *cv, void* lock);
 
+/*
+ * Like condvar_wait, but give up after nticks timer ticks.
+ * Returns ERR_OK if signaled, ERR_TIMEOUT if timed out. Lock is held again either way.
+ */
+err_t condvar_wait_timeout(struct condvar *cv, void* lock, uint64_t nticks);
+
 void condvar_signal(struct condvar *cv);
 
 void condvar_broadcast(struct condvar *cv);
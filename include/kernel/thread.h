@@ -3,9 +3,11 @@
 
 #include <kernel/types.h>
 #include <kernel/list.h>
+#include <lib/syscall-flags.h>
 
 #define THREAD_NAME_LEN 32
-#define DEFAULT_PRI 10
+/* Thread priorities are PRI_MIN to PRI_MAX, user space sets them too */
+#define NUM_PRI (PRI_MAX - PRI_MIN + 1)
 
 /* States a thread can be in. */
 typedef enum {
@@ -21,11 +23,14 @@ struct thread {
     int priority;
     tid_t tid;
     threadstate_t state;
+    int cpu;                    // index of the cpu whose run queue the thread goes on, -1 if never queued
     struct proc *proc;
     struct context* sched_ctx;  // thread context used for scheduling
     struct trapframe *tf;       // current trapframe of the thread
     Node node;                  // used to track the thread in ready list or other blocking list 
     Node thread_node;           // connect threads belonging to the same process
+    struct memregion *region_cache; // memregion this thread last looked up
+    uint64_t region_cache_seq;      // region_seq of its addrspace at the time
 };
 
 typedef int thread_func(void *aux);
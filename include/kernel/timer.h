@@ -2,10 +2,65 @@
 #define _TIMER_H_
 
 #include <kernel/types.h>
+#include <kernel/list.h>
+/* TIMER_FREQ ticks per second, the arch timer is programmed to match */
+#include <lib/syscall-flags.h>
+
+/* Timer callback, runs in the timer thread so it may block but must not re-arm its timer */
+typedef void timer_func(void *aux);
+
+typedef enum {
+    TIMER_IDLE,     /* not armed */
+    TIMER_PENDING,  /* armed, waiting in the timer wheel */
+    TIMER_EXPIRED,  /* fired, waiting for the timer thread */
+    TIMER_RUNNING,  /* callback is running */
+} timerstate_t;
+
+struct timer {
+    Node node;          // links the timer in a wheel slot or the expired list
+    uint64_t expires;   // tick the timer fires at
+    timer_func *func;
+    void *aux;
+    timerstate_t state; // protected by the timer lock
+};
 
 /*
  * Register timer trap handler. Return ERR_TRAP_REG_FAIL if failed to register.
  */
 err_t timer_register_trap_handler(void);
 
+/* Start the timer thread that runs expired timer callbacks */
+void timer_sys_init(void);
+
+/* Return number of timer ticks since boot */
+uint64_t timer_get_ticks(void);
+
+/* Initialize a timer that calls func(aux) when it fires */
+void timer_setup(struct timer *t, timer_func *func, void *aux);
+
+/* Arm an idle timer to fire at tick expires, fires on the next tick if expires has passed */
+void timer_add(struct timer *t, uint64_t expires);
+
+/*
+ * Disarm a timer. If its callback is running, wait for it to finish.
+ * Returns True if the timer was disarmed before its callback ran.
+ */
+bool timer_cancel(struct timer *t);
+
+/*
+ * Stop the periodic tick of an idle cpu until the next timer deadline, or
+ * until the next interrupt on cpus that don't keep time. The cpu keeping time
+ * only stops once all others have. Interrupt must be off.
+ */
+void timer_tick_stop(void);
+
+/*
+ * Restart the periodic tick if it was stopped, bringing the tick count up to
+ * date first. Returns True if the tick was stopped. Interrupt must be off.
+ */
+bool timer_tick_restart(void);
+
+/* Put the current thread to sleep for nticks timer ticks */
+void timer_sleep(uint64_t nticks);
+
 #endif /* _TIMER_H_ */
@@ -88,4 +88,11 @@ intr_t intr_get_level(void);
  */
 intr_t intr_set_level(intr_t level);
 
+/*
+ * Machine-dependent function to atomically enable interrupts and wait for the
+ * next one. Caller must have disabled interrupts exactly once with
+ * intr_set_level, returns with interrupts enabled.
+ */
+void intr_wait(void);
+
 #endif /* _TRAP_H_ */
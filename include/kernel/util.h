@@ -10,4 +10,9 @@
  */
 #define N_ELEM(array) (sizeof(array) / sizeof((array)[0]))
 
+/*
+ * Round x up to a multiple of align
+ */
+#define ROUND_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
 #endif /* _UTIL_H_ */
@@ -37,19 +37,33 @@ typedef enum {
 struct memregion {
     struct addrspace *as;
     Node as_node;           // used to connect all memregions within an addrspace
+    Node rmap_node;         // links memregions mapping the same memstore
+    struct memregion *left, *right; // children in the addrspace's region tree
+    int height;             // height of the subtree rooted here
+    vaddr_t subtree_start;  // start of the lowest memregion in the subtree
+    vaddr_t subtree_end;    // end of the highest memregion in the subtree
+    size_t subtree_gap;     // largest hole between memregions of the subtree
     vaddr_t start;          // starting addr of memregion
     vaddr_t end;            // ending addr of memregion
     memperm_t perm;
     int shared;             // 1:shared 0:private
     struct memstore *store;
     offset_t ofs;           // offset into memstore
+    size_t store_size;      // bytes from start backed by store, the rest reads as zeros
+    size_t fa_window;       // pages fault-around maps past a fault, adapts to the access pattern
+    vaddr_t fa_start;       // [fa_start, fa_end) was mapped ahead by the last fault-around
+    vaddr_t fa_end;
 };
 
 struct addrspace {
-    List regions;
+    List regions;           // memregions ordered by address
+    struct memregion *region_tree; // the same memregions in an AVL tree keyed by start
+    uint64_t region_seq;    // changes whenever a memregion goes away
     struct vpmap *vpmap;
-    struct sleeplock as_lock;
+    struct rwsleeplock as_lock;
+    struct sleeplock pt_lock; // page table updates by faults, which hold as_lock for reading
     struct memregion *heap; // track heap memregion to ease extension
+    vaddr_t swap_hand;      // where as_swap_out resumes its scan
 };
 
 // Kernel address space.
@@ -82,11 +96,67 @@ void as_destroy(struct addrspace *as);
 void as_dump(struct addrspace *as, vaddr_t vaddr);
 
 /*
- * Copy src address space's memregions into dst_as.
+ * Copy src address space's memregions into dst_as. Memory is shared
+ * copy-on-write, so the cost does not depend on how much of it is resident.
  * Return ERR_OK on success, ERR_NOMEM if fails to allocate memregion in dst.
  */
 err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as);
 
+/*
+ * Handle a fault at addr on an unmapped page. A page in swap is read back in.
+ * Otherwise, outside the heap, regions without a memstore get a zeroed page,
+ * and other pages are read through the store's page cache. The cached page
+ * itself is mapped unless the region is private and writable. Those get a
+ * private copy on write, immediately if write is set.
+ * Return ERR_OK if the page is now mapped, ERR_VM_INVALID if addr is not in
+ * such a region, ERR_NOMEM if out of memory, ERR_FAULT if the store or swap
+ * could not be read.
+ */
+err_t as_fill_page(struct addrspace *as, vaddr_t addr, int write);
+
+/*
+ * Map pages following the page at addr, which a fault just mapped, when they
+ * are already in the page cache or are anonymous and cheap to zero. The window
+ * grows while faults in the memregion are sequential and shrinks otherwise.
+ * as_fill_page does this by itself, other fault paths call it.
+ */
+void as_fault_around(struct addrspace *as, vaddr_t addr);
+
+/*
+ * Unmap the memregion starting at addr that spans size bytes (rounded up to
+ * pages). Dirty pages of a shared file mapping are written back first.
+ * Return ERR_VM_INVALID if no region matches exactly, or it is the heap.
+ */
+err_t as_unmap_memregion(struct addrspace *as, vaddr_t addr, size_t size);
+
+/*
+ * Write dirty pages in [addr, addr + size) of a shared, writable memregion
+ * back to its memstore. Other regions have nothing to write.
+ * Return ERR_VM_INVALID if the range is not within one region, ERR_FAULT if
+ * the store failed to write a page.
+ */
+err_t as_sync_memregion(struct addrspace *as, vaddr_t addr, size_t size);
+
+/*
+ * Handle a write fault at addr on a page mapped read-only because it is
+ * shared copy-on-write.
+ * Return ERR_OK if the page is now writable, ERR_VM_INVALID if addr is not
+ * in a writable region or nothing is mapped there, ERR_NOMEM if the copy
+ * could not be allocated.
+ */
+err_t as_resolve_cow(struct addrspace *as, vaddr_t addr);
+
+/*
+ * Scan up to scan pages of the private memregions of as, resuming where the
+ * last scan stopped, and move up to n of them to swap. A page is swapped out
+ * if nothing else maps it and it was not accessed since the previous scan.
+ * Return the number of pages freed.
+ *
+ * Precondition:
+ * Caller must hold as->as_lock for writing.
+ */
+size_t as_swap_out(struct addrspace *as, size_t n, size_t scan);
+
 /*
  * Allocate and map a region of memory within the address space. Region need to
  * be page aligned.
@@ -135,7 +205,8 @@ err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_boun
 
 /*
  * Change permission of a region of memory.
- * Return ERR_VM_INVALID if permission error.
+ * Return ERR_VM_INVALID if permission error, ERR_NOMEM if the mappings could
+ * not be updated, in which case the region keeps its old permission.
  */
 err_t memregion_set_perm(struct memregion *region, memperm_t perm);
 
@@ -15,6 +15,7 @@
  */
 #define ERR_VPMAP_NOTPRESENT 1 // entry not present
 #define ERR_VPMAP_MAP 2 // failed to map entries
+#define ERR_VPMAP_DIRTY 3 // page has unwritten changes
 
 // Kernel vpmap
 extern struct vpmap *kvpmap;
@@ -41,11 +42,36 @@ err_t vpmap_load(struct vpmap *vpmap);
 err_t vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm);
 
 /*
- * Remove mappings starting at virtual address vaddr for n pages.
+ * Map the huge page at ``paddr`` at ``vaddr``, both aligned to the huge page
+ * size, with a single page directory entry. The huge page must have been
+ * allocated as one block. Return ERR_VPMAP_MAP if part of the range is
+ * already mapped with regular pages.
+ */
+err_t vpmap_map_huge(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, memperm_t memperm);
+
+/*
+ * Return True if nothing, not even a page table, is mapped in the huge page
+ * sized range at ``vaddr``, i.e. vpmap_map_huge could map it.
+ */
+bool vpmap_huge_unmapped(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Remove mappings starting at virtual address vaddr for n pages. A huge page
+ * only partially in range is split into regular pages first.
  * If free_swap is set, any mapping that resides in swap will be removed from swap.
  */
 void vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap);
 
+/*
+ * Remove the regular page mapping at vaddr if it maps paddr and the page is
+ * clean. The entry is cleared and flushed before its dirty bit is tested, so
+ * a write through a stale TLB entry can't slip in after the test; a dirty
+ * entry is put back as it was.
+ * Return ERR_VPMAP_NOTPRESENT if vaddr does not map paddr, ERR_VPMAP_DIRTY if
+ * the page was dirty and stays mapped.
+ */
+err_t vpmap_unmap_clean(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr);
+
 /*
  * Remove all mappings in a vpmap.
  */
@@ -54,10 +80,21 @@ void vpmap_destroy(struct vpmap *vpmap);
 /*
  * Copy mapping of n pages from src vpmap to dst vpmap.
  * memperm indicates the memory permission for src and dst after the copy.
+ * Pages are shared copy-on-write rather than copied: both sides map them
+ * read-only and hold a reference, vpmap_cow gives the first writer a copy.
  * Return ERR_VPMAP_MAP if failed to map pages in dstvpmap
  */
 err_t vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vaddr_t dstaddr, size_t n, memperm_t memperm);
 
+/*
+ * Resolve a write fault on the copy-on-write page mapped at vaddr, remapping
+ * it with memperm. The page is copied only if it is still shared. A shared huge
+ * page is split, and only the 4 KiB page at vaddr is copied.
+ * Return ERR_VPMAP_NOTPRESENT if nothing is mapped at vaddr, ERR_NOMEM if the
+ * copy could not be allocated.
+ */
+err_t vpmap_cow(struct vpmap *vpmap, vaddr_t vaddr, memperm_t memperm);
+
 /*
  * Copy mapping of first level entries from kernel vpmap to dst vpmap. Permission is perserved.
  * Return ERR_VPMAP_MAP if failed to map pages in dstvpmap
@@ -65,8 +102,9 @@ err_t vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr
 err_t vpmap_copy_kernel_mapping(struct vpmap *dstvpmap);
 
 /*
- * Putting x into pte entry of vaddr entry.
- * Return ERR_VPMAP_NOTPRESENT if entry not present.
+ * Replace the mapping of the regular page at vaddr with swapid, the caller
+ * takes over the reference the mapping held on the page.
+ * Return ERR_VPMAP_NOTPRESENT if no regular page is mapped at vaddr.
  */
 err_t vpmap_put_swapid(struct vpmap *vpmap, vaddr_t vaddr, swapid_t swapid);
 
@@ -94,14 +132,21 @@ vaddr_t kmap_io2v(paddr_t io_paddr);
 
 /*
  * Change permission of a region of memory.
+ * Return ERR_NOMEM if a huge page partly in the range could not be split; the
+ * pages before it have the new permission by then.
  */
-void vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm);
+err_t vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm);
 
 /*
  * Mark the page as dirty.
  */
 void vpmap_set_dirty(struct vpmap *vpmap, vaddr_t vaddr);
 
+/*
+ * Mark the page as clean, after its content has been written back.
+ */
+void vpmap_clear_dirty(struct vpmap *vpmap, vaddr_t vaddr);
+
 /*
  * Check if the page is dirty.
  * Return ERR_VPMAP_NOTPRESET if no physical page is mapped to the address.
@@ -115,8 +160,17 @@ err_t vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty);
 err_t vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed);
 
 /*
- *  Flush tlb
+ * Clear the accessed bit of the page, so the next access sets it again.
+ */
+void vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Invalidate the TLB entries of n pages from vaddr in vpmap on every cpu that
+ * may cache them, with invlpg for small ranges. vpmap functions that change
+ * present entries do this themselves, once per call.
+ * Must not be called with a spinlock held, other cpus spinning on it could
+ * not answer.
  */
-void vpmap_flush_tlb();
+void vpmap_flush_tlb(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
 
 #endif /* _VPMAP_H_ */
@@ -16,3 +16,6 @@
 #define ERR_CHILD -14
 #define ERR_PGFAULT_ALLOC -15
 #define ERR_LOCK_BUSY -16
+#define ERR_TIMEOUT -17
+#define ERR_AGAIN -18
+#define ERR_PERM -19
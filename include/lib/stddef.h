@@ -35,5 +35,6 @@
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
 #define min(a, b) ((a < b) ? a : b)
+#define max(a, b) ((a > b) ? a : b)
 
 #endif /* _STDDEF_H_ */
@@ -0,0 +1,27 @@
+#ifndef _SYSCALL_FLAGS_H_
+#define _SYSCALL_FLAGS_H_
+
+/*
+ * Flag and type arguments of system calls, shared by the kernel and user space.
+ */
+
+// Protection and flags for syscall mmap
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+
+// Timer ticks per second, the unit of sys_info ticks
+#define TIMER_FREQ      100
+
+// Priority range for syscall setpriority, higher value runs first
+#define PRI_MIN         0
+#define PRI_MAX         31
+#define DEFAULT_PRI     10
+
+// object types for kmemaccess
+#define KMEM_THREAD     0
+#define KMEM_INODE      1
+
+#endif /* _SYSCALL_FLAGS_H_ */
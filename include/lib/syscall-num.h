@@ -22,3 +22,13 @@
 #define SYS_pipe    21
 #define SYS_info    22
 #define SYS_halt    23
+#define SYS_setpriority 24
+#define SYS_lockstat 25
+#define SYS_futex_wait 26
+#define SYS_futex_wake 27
+#define SYS_mmap    28
+#define SYS_munmap  29
+#define SYS_msync   30
+#define SYS_kmembench 31
+#define SYS_kmemaccess 32
+#define SYS_kmallocstat 33
@@ -0,0 +1,40 @@
+#ifndef _USYNCH_H_
+#define _USYNCH_H_
+
+/*
+ * User-level mutex and condition variable built on futex_wait/futex_wake.
+ * Uncontended operations stay in user space.
+ */
+
+struct umutex {
+    int state;      // 0 unlocked, 1 locked, 2 locked with possible waiters
+};
+
+struct ucondvar {
+    int seq;        // bumped by every signal and broadcast
+};
+
+void umutex_init(struct umutex *m);
+
+void umutex_lock(struct umutex *m);
+
+/*
+ * Return 0 if the mutex is acquired, ERR_LOCK_BUSY if it is held.
+ */
+int umutex_trylock(struct umutex *m);
+
+void umutex_unlock(struct umutex *m);
+
+void ucondvar_init(struct ucondvar *cv);
+
+/*
+ * Release m, block until signaled, then reacquire m. Wakeups may be
+ * spurious, callers recheck their condition in a loop.
+ */
+void ucondvar_wait(struct ucondvar *cv, struct umutex *m);
+
+void ucondvar_signal(struct ucondvar *cv);
+
+void ucondvar_broadcast(struct ucondvar *cv);
+
+#endif /* _USYNCH_H_ */
@@ -3,6 +3,7 @@
 
 #include <arch/types.h>
 #include <lib/errcode.h>
+#include <lib/syscall-flags.h>
 #include <kernel/types.h>
 
 /*
@@ -41,6 +42,30 @@ struct dirent {
 
 struct sys_info {
     size_t num_pgfault;
+    size_t num_cpus;        // number of cpus up
+    size_t ticks;           // timer ticks since boot
+    size_t num_faultaround; // pages mapped ahead of faults by fault-around
+    size_t num_faultaround_hit; // of those, pages seen used at the next fault
+};
+
+#define LOCKSTAT_NAME_LEN 32
+/* Contention statistics of the locks initialized at one kernel call site */
+struct lockstat {
+    char name[LOCKSTAT_NAME_LEN];   // lock expression at the init site
+    char file[LOCKSTAT_NAME_LEN];
+    int line;
+    size_t acquires;
+    size_t contended;       // acquires that had to spin
+    size_t spin_cycles;     // tsc cycles spent spinning
+};
+
+/* Usage statistics of one kmalloc size class */
+struct kmallocstat {
+    size_t size;            // object size, 0 for allocations past the largest class
+    size_t allocs;
+    size_t frees;
+    size_t live;            // objects allocated and not yet freed
+    size_t wasted;          // bytes allocated beyond the requested sizes, over all allocations
 };
 
 /*
@@ -296,4 +321,118 @@ void info(struct sys_info *info);
  * Halt the computer
  */
 void halt();
+/*
+ * Set the scheduling priority of process pid, the caller itself or one of its
+ * children. Higher priority runs first; waiting processes slowly gain
+ * priority so none is starved.
+ *
+ * Return:
+ * ERR_OK - Priority is set.
+ * ERR_INVAL - Priority is not within [PRI_MIN, PRI_MAX].
+ * ERR_NOTEXIST - No live process with the given pid.
+ * ERR_PERM - Process pid is neither the caller nor one of its children.
+ */
+int setpriority(int pid, int priority);
+/*
+ * Copy contention statistics of up to n kernel lock classes into buf.
+ *
+ * Return:
+ * Number of records copied.
+ * ERR_INVAL - n is negative.
+ * ERR_FAULT - buf is not a valid user buffer.
+ */
+int lockstat(struct lockstat *buf, int n);
+/*
+ * Block while the word at addr holds val, until futex_wake is called on addr.
+ * Wakeups may be spurious, callers recheck the word in a loop.
+ *
+ * Return:
+ * ERR_OK - Woken up.
+ * ERR_AGAIN - The word no longer held val.
+ * ERR_INVAL - addr is not 4-byte aligned.
+ * ERR_FAULT - addr is not a valid user address.
+ * ERR_NOMEM - The page holding addr could not be faulted in.
+ */
+int futex_wait(int *addr, int val);
+/*
+ * Wake up to n threads of this process blocked in futex_wait on addr.
+ *
+ * Return:
+ * Number of threads woken up.
+ * ERR_INVAL - n is negative.
+ */
+int futex_wake(int *addr, int n);
+/*
+ * Map length bytes of the file open at fd, starting at offset, into the
+ * address space. With MAP_ANONYMOUS, fd is ignored and the mapping starts out
+ * zero-filled. addr is the address to map at, or NULL to let the kernel pick.
+ * prot is PROT_READ, optionally with PROT_WRITE. flags has exactly one of
+ * MAP_SHARED and MAP_PRIVATE: shared mappings see each other's writes, and
+ * for files msync carries them to the file. Private writes are copied.
+ * Mappings are inherited by fork, shared ones remain shared.
+ *
+ * Return:
+ * On success, the address of the mapping.
+ * ERR_INVAL - Invalid length, offset, addr, prot or flags, or fd isn't a
+ *             regular file open for reading (and writing, for a shared
+ *             writable mapping).
+ * ERR_NOMEM - Out of memory, or no room at addr.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, offset_t offset);
+/*
+ * Remove the mapping created by mmap at addr. length must cover the whole
+ * mapping. Dirty pages of a shared file mapping are written back first.
+ *
+ * Return:
+ * ERR_OK - Mapping removed.
+ * ERR_INVAL - addr and length don't describe a mapping.
+ */
+int munmap(void *addr, size_t length);
+/*
+ * Write the modified pages in [addr, addr + length) of a shared file mapping
+ * back to the file. A no-op for other mappings.
+ *
+ * Return:
+ * ERR_OK - Pages written.
+ * ERR_INVAL - The range is not within one mapping.
+ * ERR_FAULT - Failed to write to the file.
+ */
+int msync(void *addr, size_t length);
+/*
+ * Allocate and free n kernel objects of size bytes with kmalloc, in batches,
+ * for benchmarking the kernel allocator. Only in kernels built with
+ * KMEM_DEBUG=1.
+ *
+ * Return:
+ * ERR_OK - All allocations succeeded.
+ * ERR_INVAL - size is 0 or above 64 KiB, or n is negative or above 2^20.
+ * ERR_NOMEM - An allocation failed.
+ * ERR_PERM - The kernel was built without KMEM_DEBUG.
+ */
+int kmembench(size_t size, int n);
+/*
+ * Allocate n kernel objects the size of a struct thread (KMEM_THREAD) or a
+ * struct inode (KMEM_INODE) from a fresh object allocator, then read the
+ * first word of every object rounds times, following a list threaded through
+ * them. For measuring how object placement uses the cpu caches. Only in
+ * kernels built with KMEM_DEBUG=1.
+ *
+ * Return:
+ * On success, tsc cycles per 1000 object reads.
+ * ERR_INVAL - Unknown type, n not in [1, 16384] or rounds not in [1, 1000].
+ * ERR_NOMEM - An allocation failed.
+ * ERR_PERM - The kernel was built without KMEM_DEBUG.
+ */
+int kmemaccess(int type, int n, int rounds);
+/*
+ * Copy statistics of up to n kmalloc size classes into buf, smallest class
+ * first. Allocations too large for any class are counted in a last class of
+ * size 0.
+ *
+ * Return:
+ * On success, the number of classes copied.
+ * ERR_INVAL - n is negative.
+ * ERR_FAULT - Address of buf is invalid.
+ */
+int kmallocstat(struct kmallocstat *buf, int n);
 #endif /* _USYSCALL_H_ */
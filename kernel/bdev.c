@@ -2,6 +2,8 @@
 #include <kernel/kmalloc.h>
 #include <kernel/vm.h>
 #include <kernel/pgcache.h>
+#include <kernel/memstore.h>
+#include <kernel/radix_tree.h>
 #include <kernel/pmem.h>
 #include <kernel/vpmap.h>
 #include <kernel/bdevms.h>
@@ -10,6 +12,7 @@
 #include <lib/errcode.h>
 #include <lib/bits.h>
 #include <kernel/ide.h>
+#include <arch/mmu.h>
 
 static struct kmem_cache *bdev_allocator = NULL;
 static struct kmem_cache *bio_allocator = NULL;
@@ -20,6 +23,8 @@ static struct kmem_cache *bio_allocator = NULL;
 
 // Return the number of blocks in a page
 #define N_BLKS_PER_PAGE (pg_size / BDEV_BLK_SIZE)
+// Same, as a constant for sizing arrays of a page's headers
+#define MAX_BLKS_PER_PAGE (PG_SIZE / BDEV_BLK_SIZE)
 
 // Given a block, return the first block in the page which the requested block
 // belongs to.
@@ -61,18 +66,37 @@ static int blocks_zero_ref(struct page *page);
  */
 static void free_blk_headers(struct page *page);
 
+/*
+ * Check if all blocks in a page are clean.
+ *
+ * Precondition:
+ * Caller must hold page->lock, and no block may be referenced.
+ */
+static int blocks_clean(struct page *page);
+
+/*
+ * Shrinker for the block cache. For cached pages whose blocks are all
+ * unreferenced and written back, frees the block headers and drops the page
+ * from the page cache unless it is used elsewhere. The next bdev_get_blk reads
+ * the page and sets the headers up again. Return the number of headers and
+ * pages freed.
+ */
+static size_t blk_header_scan(struct shrinker *shrinker, size_t nr);
+
 static err_t
 init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_blk)
 {
     struct blk_header *bh;
+    void *headers[MAX_BLKS_PER_PAGE];
     blk_t index;
 
     if (list_empty(&page->blk_headers)) {
+        if (kmem_cache_alloc_bulk(blk_header_allocator, headers, N_BLKS_PER_PAGE) != ERR_OK) {
+            return ERR_NOMEM;
+        }
         for (index = 0; index < N_BLKS_PER_PAGE; index++) {
-            if ((bh = kmem_cache_alloc(blk_header_allocator)) == NULL) {
-                return ERR_NOMEM;
-            }
-            sleeplock_init(&bh->lock);
+            bh = headers[index];
+            mutex_init(&bh->lock);
             list_append(&page->blk_headers, &bh->node);
             bh->bdev = bdev;
             bh->blk = first_blk + index;
@@ -103,11 +127,28 @@ blocks_zero_ref(struct page *page)
     return True;
 }
 
+static int
+blocks_clean(struct page *page)
+{
+    Node *n;
+
+    for (n = list_begin(&page->blk_headers);
+         n != list_end(&page->blk_headers);
+         n = list_next(n)) {
+        if (bdev_is_blk_dirty(list_entry(n, struct blk_header, node))) {
+            return False;
+        }
+    }
+    return True;
+}
+
 static void
 free_blk_headers(struct page *page)
 {
     Node *curr, *next;
     struct blk_header *bh;
+    void *headers[MAX_BLKS_PER_PAGE];
+    size_t n = 0;
 
     // If page is dirty, do not free headers -- a kernel thread will write the
     // dirty page back to bdev, and free the headers.
@@ -118,9 +159,52 @@ free_blk_headers(struct page *page)
         bh = list_entry(curr, struct blk_header, node);
         // Page must be clean
         kassert(!bdev_is_blk_dirty(bh));
+        kassert(n < MAX_BLKS_PER_PAGE);
         next = list_remove(curr); // we are going to free the curr node
-        kmem_cache_free(blk_header_allocator, bh);
+        headers[n++] = bh;
+    }
+    kmem_cache_free_bulk(blk_header_allocator, headers, n);
+}
+
+static size_t
+blk_header_scan(struct shrinker *shrinker, size_t nr)
+{
+    struct bdev *bdev = shrinker->data;
+    struct memstore *store = bdev->store;
+    struct page *page;
+    paddr_t paddr;
+    int index;
+    size_t freed = 0;
+
+    // whoever holds these may be the one reclaiming
+    if (sleeplock_try_acquire(&store->pgcache_lock) != ERR_OK) {
+        return 0;
+    }
+    for (index = 0; freed < nr && (page = radix_tree_next(&store->cached_pages, &index)) != NULL; index++) {
+        if (mutex_try_acquire(&page->lock) != ERR_OK) {
+            continue;
+        }
+        if (!blocks_zero_ref(page) || !blocks_clean(page)) {
+            mutex_release(&page->lock);
+            continue;
+        }
+        if (!list_empty(&page->blk_headers)) {
+            // every block was written back, nothing is left for writeback
+            pmem_set_page_dirty(page, False);
+            free_blk_headers(page);
+            freed += N_BLKS_PER_PAGE;
+        }
+        mutex_release(&page->lock);
+        // getters find the page and lock it under pgcache_lock, which we hold
+        paddr = page_to_paddr(page);
+        if (pmem_get_refcnt(paddr) == 1) {
+            pgcache_remove_page(store, (offset_t)index * pg_size);
+            pmem_dec_refcnt(paddr);
+            freed++;
+        }
     }
+    sleeplock_release(&store->pgcache_lock);
+    return freed;
 }
 
 void
@@ -158,8 +242,11 @@ bdev_alloc(dev_t dev)
         bdev->data = NULL;
         if ((bdev->store = bdevms_alloc(bdev)) == NULL) {
             kmem_cache_free(bdev_allocator, bdev);
-            bdev = NULL;
+            return NULL;
         }
+        bdev->shrinker.scan = blk_header_scan;
+        bdev->shrinker.data = bdev;
+        shrinker_register(&bdev->shrinker);
     }
     return bdev;
 }
@@ -168,6 +255,7 @@ void
 bdev_free(struct bdev *bdev)
 {
     // XXX handle remaining requests in the queue?
+    shrinker_unregister(&bdev->shrinker);
     bdevms_free(bdev->store);
     kmem_cache_free(bdev_allocator, bdev);
 }
@@ -210,7 +298,7 @@ bdev_make_request(struct bio *bio)
     bio->bdev->request_handler(bio->bdev);
     // Wait for block operation to complete
     spinlock_acquire(&bio->lock);
-    while (bio->status != BIO_COMPLETE) {
+    while (bio->status == BIO_PENDING) {
         condvar_wait(&bio->cv, &bio->lock);
     }
     spinlock_release(&bio->lock);
@@ -235,9 +323,9 @@ void
 bdev_set_blk_dirty(struct blk_header *bh, int dirty) {
     bh->state = set_state_bit(bh->state, BLK_HEADER_DIRTY, dirty);
     if (dirty) {
-        sleeplock_acquire(&bh->page->lock);
+        mutex_acquire(&bh->page->lock);
         pmem_set_page_dirty(bh->page, True);
-        sleeplock_release(&bh->page->lock);
+        mutex_release(&bh->page->lock);
     }
     // Code that writes dirty pages back to bdev is responsible for clearing the
     // page's dirty bit
@@ -249,7 +337,7 @@ bdev_get_blk(struct bdev *bdev, blk_t blk)
     struct blk_header *bh;
 
     if ((bh = bdev_get_blk_unlocked(bdev, blk)) != NULL) {
-        sleeplock_acquire(&bh->lock);
+        mutex_acquire(&bh->lock);
     }
     return bh;
 }
@@ -266,11 +354,13 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
         sleeplock_release(&bdev->store->pgcache_lock);
         return NULL;
     }
+    // lock the page before dropping pgcache_lock, the block cache shrinker
+    // drops idle pages
+    mutex_acquire(&page->lock);
     sleeplock_release(&bdev->store->pgcache_lock);
 
-    sleeplock_acquire(&page->lock);
     if (init_blk_headers(page, bdev, FIRST_BLK_IN_PAGE(blk)) != ERR_OK) {
-        sleeplock_release(&page->lock);
+        mutex_release(&page->lock);
         // XXX dec reference count on the page
         return NULL;
     }
@@ -283,7 +373,7 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
         kassert(bh);
         if (bh->blk == blk) {
             bh->ref++;
-            sleeplock_release(&page->lock);
+            mutex_release(&page->lock);
             return bh;
         }
     }
@@ -293,7 +383,7 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
 void
 bdev_release_blk(struct blk_header *bh)
 {
-    sleeplock_release(&bh->lock);
+    mutex_release(&bh->lock);
     bdev_release_blk_unlocked(bh);
 }
 
@@ -301,14 +391,14 @@ void
 bdev_release_blk_unlocked(struct blk_header *bh)
 {
     struct page *page = bh->page;
-    sleeplock_acquire(&page->lock);
+    mutex_acquire(&page->lock);
     kassert(bh->ref > 0);
     bh->ref--;
     // if bh still has references, no need to test blocks_zero_ref
     if (bh->ref == 0 && blocks_zero_ref(page)) {
         free_blk_headers(page);
     }
-    sleeplock_release(&page->lock);
+    mutex_release(&page->lock);
     // XXX dec reference count on the page
 }
 
@@ -25,23 +25,17 @@ static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
     struct bdevms_info *info;
-    struct bio *bio;
+    err_t err;
 
     kassert(store);
     kassert(store->info);
     kassert(page);
     info = (struct bdevms_info*)store->info;
-    if ((bio = bio_alloc()) == NULL) {
-        return ERR_MEMSTORE_NOMEM;
-    }
-    bio->bdev = info->bdev;
     // Direct translation: use memstore offset as raw address for the block device
-    bio->blk = pg_round_down(ofs) / BDEV_BLK_SIZE;
-    bio->size = pg_size / BDEV_BLK_SIZE;
-    bio->buffer = (void*)kmap_p2v(page_to_paddr(page));
-    bio->op = BIO_READ;
-    bdev_make_request(bio);
-    bio_free(bio);
+    err = bdevms_page_io(info->bdev, pg_round_down(ofs) / BDEV_BLK_SIZE, page_to_paddr(page), BIO_READ);
+    if (err != ERR_OK) {
+        return err == ERR_NOMEM ? ERR_MEMSTORE_NOMEM : ERR_MEMSTORE_IO;
+    }
     return ERR_OK;
 }
 
@@ -78,6 +72,27 @@ bdevms_alloc(struct bdev *bdev)
     return store;
 }
 
+err_t
+bdevms_page_io(struct bdev *bdev, blk_t blk, paddr_t paddr, bio_op_t op)
+{
+    struct bio *bio;
+    err_t err;
+
+    kassert(bdev);
+    if ((bio = bio_alloc()) == NULL) {
+        return ERR_NOMEM;
+    }
+    bio->bdev = bdev;
+    bio->blk = blk;
+    bio->size = pg_size / BDEV_BLK_SIZE;
+    bio->buffer = (void*)kmap_p2v(paddr);
+    bio->op = op;
+    bdev_make_request(bio);
+    err = bio->status == BIO_COMPLETE ? ERR_OK : ERR_FAULT;
+    bio_free(bio);
+    return err;
+}
+
 void
 bdevms_free(struct memstore *store)
 {
@@ -112,6 +112,7 @@ ide_trap_handler(irq_t irq, void *dev, void *regs)
     struct bdev *bdev;
     struct ide_dev *ide;
     struct bio *bio;
+    err_t err;
     kassert(dev);
 
     bdev = (struct bdev*)dev;
@@ -126,13 +127,14 @@ ide_trap_handler(irq_t irq, void *dev, void *regs)
         bio = bdev_front_bio(bdev, True);
         kassert(bio);
         kassert(bio->status == BIO_PENDING);
-        if (bio->op == BIO_READ) {
+        // the disk has no data for us if the command failed
+        if ((err = ide_wait(bdev)) == ERR_OK && bio->op == BIO_READ) {
             readn(IDE_REG_DATA, bio->buffer, bio->size * BDEV_BLK_SIZE);
         }
         // Complete the request, and wake up the thread waiting for
         // completion
         spinlock_acquire(&bio->lock);
-        bio->status = BIO_COMPLETE;
+        bio->status = err == ERR_OK ? BIO_COMPLETE : BIO_ERROR;
         condvar_signal(&bio->cv);
         spinlock_release(&bio->lock);
         // Issue the next command in the queue (if present)
@@ -20,6 +20,12 @@ static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * A mapping of the file holds a reference to its inode.
+ */
+static void get(struct memstore *store);
+static void put(struct memstore *store);
+
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
@@ -38,8 +44,32 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
-    return ERR_OK;
+    struct filems_info *info;
+    struct super_block *sb;
+    err_t err;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct filems_info*)store->info;
+    sb = info->inode->sb;
+    sb->s_ops->journal_begin_txn(sb);
+    err = info->inode->i_ops->writepage(info->inode, pg_round_down(ofs), paddr_to_page(paddr));
+    sb->s_ops->journal_end_txn(sb);
+    return err == ERR_OK ? ERR_OK : ERR_MEMSTORE_IO;
+}
+
+static void
+get(struct memstore *store)
+{
+    kassert(store);
+    fs_reopen_inode(((struct filems_info*)store->info)->inode);
+}
+
+static void
+put(struct memstore *store)
+{
+    kassert(store);
+    fs_release_inode(((struct filems_info*)store->info)->inode);
 }
 
 struct memstore*
@@ -60,6 +90,9 @@ filems_alloc(struct inode *inode)
             info = (struct filems_info*)store->info;
             store->fillpage = fillpage;
             store->write = write;
+            store->get = get;
+            store->put = put;
+            store->reclaimable = True;
             info->inode = inode;
         } else {
             memstore_free(store);
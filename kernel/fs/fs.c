@@ -4,6 +4,7 @@
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
 #include <kernel/filems.h>
+#include <kernel/pgcache.h>
 #include <kernel/proc.h>
 #include <kernel/jbd.h>
 #include <lib/errcode.h>
@@ -295,7 +296,7 @@ fs_alloc_sb(struct bdev *bdev, struct fs_type *fs_type)
         radix_tree_construct(&sb->s_icache);
         sb->s_ref = 1;
         fs_set_sb_dirty(sb, False);
-        sleeplock_init(&sb->s_lock);
+        rwsleeplock_init(&sb->s_lock);
     }
     return sb;
 }
@@ -409,38 +410,50 @@ err_t fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode)
     err_t err;
     struct inode *res;
 
-    sleeplock_acquire(&sb->s_lock);
-    // Search for the inode in icache
-    if ((res = radix_tree_lookup(&sb->s_icache, inum)) == NULL)
+    // Common case: inode is cached, a read lock keeps it from being freed while
+    // we take a reference. Readers race each other, so the increment is atomic.
+    rwsleeplock_acquire_read(&sb->s_lock);
+    if ((res = radix_tree_lookup(&sb->s_icache, inum)) != NULL)
     {
-        // inode not found: allocate a new inode and insert into icache
-        if ((res = sb->s_ops->alloc_inode(sb)) == NULL)
-        {
-            sleeplock_release(&sb->s_lock);
-            return ERR_NOMEM;
-        }
-        res->i_inum = inum;
-        if ((err = radix_tree_insert(&sb->s_icache, inum, res)) != ERR_OK)
+        __sync_fetch_and_add(&res->i_ref, 1);
+    }
+    rwsleeplock_release_read(&sb->s_lock);
+
+    if (res == NULL)
+    {
+        rwsleeplock_acquire_write(&sb->s_lock);
+        // Search for the inode in icache again, it may have been added since
+        if ((res = radix_tree_lookup(&sb->s_icache, inum)) == NULL)
         {
-            switch (err)
+            // inode not found: allocate a new inode and insert into icache
+            if ((res = sb->s_ops->alloc_inode(sb)) == NULL)
             {
-            case ERR_RADIX_TREE_ALLOC:
-                sb->s_ops->free_inode(res);
-                sleeplock_release(&sb->s_lock);
+                rwsleeplock_release_write(&sb->s_lock);
                 return ERR_NOMEM;
-            case ERR_RADIX_TREE_NODE_EXIST:
-                panic("node should not exist");
-            default:
-                panic("unexpected error code");
+            }
+            res->i_inum = inum;
+            if ((err = radix_tree_insert(&sb->s_icache, inum, res)) != ERR_OK)
+            {
+                switch (err)
+                {
+                case ERR_RADIX_TREE_ALLOC:
+                    sb->s_ops->free_inode(res);
+                    rwsleeplock_release_write(&sb->s_lock);
+                    return ERR_NOMEM;
+                case ERR_RADIX_TREE_NODE_EXIST:
+                    panic("node should not exist");
+                default:
+                    panic("unexpected error code");
+                }
             }
         }
+        else
+        {
+            // inode exists in cache -- just increment its reference counter
+            res->i_ref++;
+        }
+        rwsleeplock_release_write(&sb->s_lock);
     }
-    else
-    {
-        // inode exists in cache -- just increment its reference counter
-        res->i_ref++;
-    }
-    sleeplock_release(&sb->s_lock);
 
     // If inode is not valid, read from the corresponding on-disk inode
     sleeplock_acquire(&res->i_lock);
@@ -461,7 +474,7 @@ err_t fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode)
 void fs_release_inode(struct inode *inode)
 {
     sleeplock_acquire(&inode->i_lock);
-    sleeplock_acquire(&inode->sb->s_lock);
+    rwsleeplock_acquire_write(&inode->sb->s_lock);
 
     kassert(inode->i_inum > 0);
     kassert(inode->i_ref > 0);
@@ -483,16 +496,25 @@ void fs_release_inode(struct inode *inode)
         }
 
         kassert(radix_tree_remove(&inode->sb->s_icache, inode->i_inum) == inode);
-        sleeplock_release(&inode->sb->s_lock);
+        rwsleeplock_release_write(&inode->sb->s_lock);
         inode->sb->s_ops->free_inode(inode);
         return;
     }
 
 done:
-    sleeplock_release(&inode->sb->s_lock);
+    rwsleeplock_release_write(&inode->sb->s_lock);
     sleeplock_release(&inode->i_lock);
 }
 
+void fs_reopen_inode(struct inode *inode)
+{
+    // same as a cache hit in fs_get_inode, releases are excluded by s_lock
+    rwsleeplock_acquire_read(&inode->sb->s_lock);
+    kassert(inode->i_ref > 0);
+    __sync_fetch_and_add(&inode->i_ref, 1);
+    rwsleeplock_release_read(&inode->sb->s_lock);
+}
+
 err_t fs_find_inode(const char *path, struct inode **inode)
 {
     struct inode *parent;
@@ -857,6 +879,11 @@ fs_write_file(struct file *file, const void *buf, size_t count, offset_t *ofs)
     if (file->f_inode)
     {
         sb->s_ops->journal_end_txn(sb);
+        if (ws > 0)
+        {
+            // pages of the file cached for mappings must see the write
+            pgcache_update(file->f_inode->store, *ofs - ws, buf, ws);
+        }
     }
     return ws;
 }
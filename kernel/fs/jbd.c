@@ -99,9 +99,9 @@ write_journal_blks(struct journal *journal)
         if ((jbh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
             return ERR_NOMEM;
         }
-        sleeplock_acquire(&journal->datablks[i]->lock);
+        mutex_acquire(&journal->datablks[i]->lock);
         memmove(jbh->data, journal->datablks[i]->data, BDEV_BLK_SIZE);
-        sleeplock_release(&journal->datablks[i]->lock);
+        mutex_release(&journal->datablks[i]->lock);
         if ((err = bdev_write_blk(jbh)) != ERR_OK) {
             return err;
         }
@@ -152,7 +152,7 @@ apply_journal(struct journal *journal)
 
     for (i = 0; i < journal->next_index; i++) {
         // Write journal data block to file system block
-        sleeplock_acquire(&journal->datablks[i]->lock);
+        mutex_acquire(&journal->datablks[i]->lock);
         if ((err = bdev_write_blk(journal->datablks[i])) != ERR_OK) {
             return err;
         }
@@ -257,9 +257,9 @@ jbd_write_blk(struct journal *journal, struct blk_header *bh)
         panic("JBD: journal is filled up");
     }
     // The journal now holds a reference to the block (and the page).
-    sleeplock_acquire(&bh->page->lock);
+    mutex_acquire(&bh->page->lock);
     bh->ref++;
-    sleeplock_release(&bh->page->lock);
+    mutex_release(&bh->page->lock);
     journal->datablks[journal->next_index++] = bh;
 }
 
@@ -74,6 +74,7 @@ static err_t sfs_mkdir(struct inode *dir, const char *name, fmode_t mode);
 static err_t sfs_rmdir(struct inode *dir, const char *name);
 static err_t sfs_lookup(struct inode *dir, const char *name, struct inode **inode);
 static err_t sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page);
+static err_t sfs_writepage(struct inode *inode, offset_t ofs, struct page *page);
 static err_t sfs_link(struct inode *dir, struct inode *src, const char *name);
 static err_t sfs_unlink(struct inode *dir, const char *name);
 static struct inode_operations sfs_inode_operations = {
@@ -82,6 +83,7 @@ static struct inode_operations sfs_inode_operations = {
     .rmdir = sfs_rmdir,
     .lookup = sfs_lookup,
     .fillpage = sfs_fillpage,
+    .writepage = sfs_writepage,
     .link = sfs_link,
     .unlink = sfs_unlink
 };
@@ -1141,15 +1143,38 @@ static err_t
 sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page)
 {
     void *buf;
+    ssize_t rs;
 
     kassert(inode);
     buf = (void*)kmap_p2v(page_to_paddr(page));
-    if (read_data(inode, buf, pg_size, ofs) < pg_size) {
-        return ERR_INCOMP;
+    // the page holding the end of the file reads as zeros past it
+    if ((rs = read_data(inode, buf, pg_size, ofs)) < pg_size) {
+        if (ofs + rs < inode->i_size) {
+            return ERR_INCOMP;
+        }
+        memset((uint8_t*)buf + rs, 0, pg_size - rs);
     }
     return ERR_OK;
 }
 
+static err_t
+sfs_writepage(struct inode *inode, offset_t ofs, struct page *page)
+{
+    ssize_t count = 0;
+    err_t err = ERR_OK;
+
+    kassert(inode);
+    sleeplock_acquire(&inode->i_lock);
+    if (ofs < inode->i_size) {
+        count = min(inode->i_size - ofs, pg_size);
+    }
+    if (count > 0 && write_data(inode, (void*)kmap_p2v(page_to_paddr(page)), count, ofs) < count) {
+        err = ERR_INCOMP;
+    }
+    sleeplock_release(&inode->i_lock);
+    return err;
+}
+
 static err_t
 sfs_link(struct inode *dir, struct inode *src, const char *name)
 {
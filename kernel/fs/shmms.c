@@ -18,6 +18,13 @@ static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * Count the memregions mapping the store, the last one frees it.
+ */
+static void get(struct memstore *store);
+static void put(struct memstore *store);
+
+static struct kmem_cache *shmms_allocator = NULL;
 
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
@@ -33,19 +40,49 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
+    // shared memory only lives in the page cache, nothing to write back
     return ERR_OK;
 }
 
+static void
+get(struct memstore *store)
+{
+    kassert(store);
+    __sync_fetch_and_add(&((struct shmms_info*)store->info)->ref, 1);
+}
+
+static void
+put(struct memstore *store)
+{
+    kassert(store);
+    if (__sync_sub_and_fetch(&((struct shmms_info*)store->info)->ref, 1) == 0) {
+        shmms_free(store);
+    }
+}
+
 struct memstore*
 shmms_alloc(void)
 {
     struct memstore *store;
+    struct shmms_info *info;
 
+    if (shmms_allocator == NULL) {
+        if ((shmms_allocator = kmem_cache_create(sizeof(struct shmms_info))) == NULL) {
+            return NULL;
+        }
+    }
     if ((store = memstore_alloc()) != NULL) {
-        // TODO: initialize shared memory specific metadata
-        store->fillpage = fillpage;
-        store->write = write;
+        if ((store->info = kmem_cache_alloc(shmms_allocator)) != NULL) {
+            info = (struct shmms_info*)store->info;
+            store->fillpage = fillpage;
+            store->write = write;
+            store->get = get;
+            store->put = put;
+            info->ref = 0;
+        } else {
+            memstore_free(store);
+            store = NULL;
+        }
     }
     return store;
 }
@@ -54,5 +91,7 @@ void
 shmms_free(struct memstore *store)
 {
     kassert(store);
+    kassert(store->info);
+    kmem_cache_free(shmms_allocator, store->info);
     memstore_free(store);
 }
@@ -0,0 +1,119 @@
+#include <kernel/futex.h>
+#include <kernel/synch.h>
+#include <kernel/list.h>
+#include <kernel/vpmap.h>
+#include <kernel/vm.h>
+#include <kernel/pgfault.h>
+#include <kernel/proc.h>
+#include <kernel/console.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+/* A wait queue shared by every futex that hashes to it */
+struct futex_bucket {
+    struct spinlock lock;
+    List waiters;
+};
+
+/* A thread sleeping in futex_wait, lives on the waiter's stack */
+struct futex_waiter {
+    Node node;
+    struct addrspace *as;
+    vaddr_t uaddr;
+    struct condvar cv;
+    bool woken;             // set by futex_wake, protected by the bucket lock
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+/* Return the bucket of the futex at uaddr in as. */
+static struct futex_bucket* futex_bucket(struct addrspace *as, vaddr_t uaddr);
+
+static struct futex_bucket*
+futex_bucket(struct addrspace *as, vaddr_t uaddr)
+{
+    uint64_t key = ((uint64_t)as >> 6) ^ (uaddr >> 2);
+    // fibonacci hashing, spreads nearby words over the table
+    return &futex_table[(key * 0x9E3779B97F4A7C15ull) >> (64 - FUTEX_HASH_BITS)];
+}
+
+void
+futex_init(void)
+{
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spinlock_init(&futex_table[i].lock);
+        list_init(&futex_table[i].waiters);
+    }
+}
+
+err_t
+futex_wait(struct addrspace *as, vaddr_t uaddr, int val)
+{
+    struct futex_bucket *b = futex_bucket(as, uaddr);
+    struct futex_waiter w;
+    paddr_t paddr;
+    swapid_t swapid;
+    err_t err;
+
+    kassert(as && as == &proc_current()->as);
+    if (uaddr & (sizeof(int) - 1)) {
+        return ERR_INVAL;
+    }
+    w.as = as;
+    w.uaddr = uaddr;
+    w.woken = False;
+    condvar_init(&w.cv);
+
+retry:
+    err = ERR_OK;
+    // read the word through the kernel mapping so an unmapped page can't fault
+    // while the bucket lock is held, as_lock keeps the page from going away
+    rwsleeplock_acquire_read(&as->as_lock);
+    spinlock_acquire(&b->lock);
+    if (vpmap_lookup_vaddr(as->vpmap, uaddr, &paddr, &swapid) != ERR_OK) {
+        spinlock_release(&b->lock);
+        rwsleeplock_release_read(&as->as_lock);
+        // never touched or swapped out, fault it in like user space would
+        if ((err = fault_in_user_page(uaddr, False)) != ERR_OK) {
+            return err;
+        }
+        goto retry;
+    } else if (*(volatile int*)kmap_p2v(paddr) != val) {
+        err = ERR_AGAIN;
+    } else {
+        list_append(&b->waiters, &w.node);
+    }
+    rwsleeplock_release_read(&as->as_lock);
+    if (err == ERR_OK) {
+        while (!w.woken) {
+            condvar_wait(&w.cv, &b->lock);
+        }
+    }
+    spinlock_release(&b->lock);
+    return err;
+}
+
+int
+futex_wake(struct addrspace *as, vaddr_t uaddr, int n)
+{
+    struct futex_bucket *b = futex_bucket(as, uaddr);
+    int woken = 0;
+
+    kassert(as);
+    spinlock_acquire(&b->lock);
+    for (Node *node = list_begin(&b->waiters); node != list_end(&b->waiters) && woken < n;) {
+        struct futex_waiter *w = list_entry(node, struct futex_waiter, node);
+        node = list_next(node);
+        if (w->as == as && w->uaddr == uaddr) {
+            list_remove(&w->node);
+            w->woken = True;
+            condvar_signal(&w->cv);
+            woken++;
+        }
+    }
+    spinlock_release(&b->lock);
+    return woken;
+}
@@ -32,6 +32,16 @@ list_append(List* list, Node* node)
     list->header.prev = node; // inserting node to the last element
 }
 
+void
+list_insert(Node* before, Node* node)
+{
+    kassert(before && node);
+    node->prev = before->prev;
+    node->next = before;
+    before->prev->next = node;
+    before->prev = node;
+}
+
 void
 list_append_ordered(List *list, Node *node, comparator *compare, void *aux)
 {
@@ -11,6 +11,11 @@
 #include <kernel/fs.h>
 #include <kernel/vpmap.h>
 #include <kernel/pmem.h>
+#include <kernel/kmalloc.h>
+#include <kernel/timer.h>
+#include <kernel/futex.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
 #include <lib/errcode.h>
 
 int kernel_init(void *args);
@@ -19,6 +24,7 @@ int
 kernel_init(void *args)
 {
     bdev_init();
+    swap_init(root_bdev);
     fs_init();
     mp_start_ap();
     kprintf("OSV initialization...Done\n\n");
@@ -34,23 +40,34 @@ main(void)
 {
     vm_init();
     arch_init();
+    // per-cpu data is available now
+    pmem_pcp_init();
+    kmalloc_magazine_init();
 
     // thread needs to be initialized before other sub systems can use locks
     thread_sys_init();
     synch_init();
     proc_sys_init();
+    futex_init();
     trap_sys_init();
     console_init();
     pmem_info();
 
     // start scheduling: turn on interrupt
     sched_start();
+    // threads may block with a timeout from here on
+    timer_sys_init();
+    // pre-zero free pages in the background
+    pmem_zero_init();
+    // evict page cache pages when memory runs low
+    reclaim_init();
     // Create a kernel thread to run the rest of initialization (in case they
     // need to run blocking I/O)
     struct thread *t = thread_create("init/testing thread", NULL, DEFAULT_PRI);
     kassert(t);
     thread_start_context(t, kernel_init, NULL);
-    for (;;) { }
+    // this thread becomes the idle thread of the boot cpu
+    sched_idle();
 }
 
 // Other CPUs jump here from entry_ap.S.
@@ -61,5 +78,5 @@ main_ap(void)
     arch_init_ap();
     // start scheduling: create an idle thread for this cpu and turn on interrupt
     sched_start_ap();
-    for (;;) { } // loop bc we are idle
+    sched_idle();
 }
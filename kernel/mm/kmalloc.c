@@ -2,23 +2,73 @@
 #include <kernel/pmem.h>
 #include <kernel/vpmap.h>
 #include <kernel/console.h>
+#include <kernel/trap.h>
 #include <kernel/util.h>
 #include <lib/string.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
+#include <arch/cpu.h>
+#include <arch/asm.h>
+#include <arch/percpu.h>
 
 /*
  * We use a slab allocator [Bonwick] to reduce memory fragmentation. Each object
  * allocator dynamically allocates slabs to store fixed-size objects.
- * Each slab is divided into object-sized slots, and a linked list is used to
- * track free slots. The linked list is stored in the beginning of the slab.
+ * Each slab is divided into object-sized slots after a header at the start of
+ * the slab. Free slots are linked through a pointer stored in the slot itself.
+ *
+ * An allocator picks the smallest slab of 2^order pages that wastes at most
+ * 1/SLAB_WASTE_FRACTION of it, up to SLAB_MAX_ORDER. The leftover space is
+ * used for coloring: consecutive slabs start their objects a cache line
+ * further in, so the same object in different slabs falls into different L1
+ * sets.
  */
 
+/*
+ * On top of the slabs sits a magazine layer [Bonwick01]. A magazine is a stack
+ * of up to MAG_ROUNDS free objects. Each cpu has a loaded and a previous
+ * magazine per allocator, touched only by that cpu with interrupts off, so
+ * allocating and freeing is a pop or push without a lock. When both are
+ * empty (alloc) or full (free), the cpu trades one with the allocator's depot
+ * for a full or empty one, which takes the depot lock once per MAG_ROUNDS
+ * objects. Only when the depot has no full magazine does an allocation go to
+ * the slabs. The depot keeps at most DEPOT_FULL_MAX full magazines, a cpu
+ * with one more returns its objects to the slabs instead.
+ */
+#define MAG_ROUNDS      14
+#define DEPOT_FULL_MAX  8
+
+struct kmem_magazine {
+    // Next magazine in a depot list
+    struct kmem_magazine *next;
+    int rounds;
+    void *objs[MAG_ROUNDS];
+};
+
+struct kmem_cpu_cache {
+    struct kmem_magazine *loaded;
+    struct kmem_magazine *prev;
+    // keep cpus off each other's cache lines
+    char pad[CACHELINE_SIZE - 2 * sizeof(struct kmem_magazine*)];
+};
+
 /*
  * Allocator for kmem_cache
  */
 static struct kmem_cache allocator_cache;
 
+/*
+ * Allocator for magazines, which has no magazines itself
+ */
+static struct kmem_cache magazine_cache;
+
+/*
+ * Allocators with magazines. Until per-cpu data is set up, they have none.
+ */
+static struct spinlock cache_list_lock;
+static List cache_list;
+static bool magazines_enabled;
+
 /*
  * kmalloc allocators
  */
@@ -35,14 +85,45 @@ static struct kmalloc_allocator kmalloc_allocators[] =
     { NULL, 512 },
     { NULL, 1024 },
     { NULL, 2048 },
-    { NULL, 4096 }
+    { NULL, KMALLOC_MAX_SIZE }
+};
+
+/*
+ * Per size class counters, the class past the last allocator counts large
+ * allocations. Counted per cpu once per-cpu data is set up, and in boot_stats
+ * while only the boot cpu runs.
+ */
+#define LARGE_CLASS N_ELEM(kmalloc_allocators)
+struct kmalloc_counters {
+    struct {
+        size_t allocs;
+        size_t frees;
+        size_t wasted;
+    } class[LARGE_CLASS + 1];
 };
+static DEFINE_PER_CPU(struct kmalloc_counters, kmalloc_counters);
+static struct kmalloc_counters boot_stats;
+
+#define SLAB_MAX_ORDER      3
+#define SLAB_WASTE_FRACTION 8
+// Empty slabs an allocator keeps through kmalloc_reap, for the next burst
+#define SLAB_EMPTY_RESERVE  1
+// Objects start past the slab header, cache line aligned
+#define SLAB_HDR_SIZE       ROUND_UP(sizeof(struct slab), CACHELINE_SIZE)
+// Largest object that fits a slab of SLAB_MAX_ORDER
+#define SLAB_OBJ_MAX        ((pg_size << SLAB_MAX_ORDER) - SLAB_HDR_SIZE)
+// Free slots hold the address of the next free slot
+#define OBJ_NEXT(obj)       (*(void**)(obj))
 
 /*
- * Create a new slab for an object allocator. The slab should fit at least
- * MIN_OBJS_PER_SLAB objects.
+ * Choose the slab size, number of objects and colors of an allocator. The
+ * object must be at most SLAB_OBJ_MAX bytes.
+ */
+static void slab_layout(struct kmem_cache *kmem_cache);
+
+/*
+ * Create a new slab for an object allocator.
  */
-#define MIN_OBJS_PER_SLAB 128
 static struct slab *slab_create(struct kmem_cache *kmem_cache);
 
 /*
@@ -51,42 +132,123 @@ static struct slab *slab_create(struct kmem_cache *kmem_cache);
 static void slab_destroy(struct slab *slab);
 
 /*
- * Return the free index array of a slab.
+ * Destroy all slabs in the linked list. Return the number of pages freed.
+ */
+static size_t slab_list_destroy(List *list);
+
+/*
+ * Move the objects in the depot's full magazines back to the slabs and free
+ * the magazines, then free the allocator's empty slabs. Return the number of
+ * pages freed.
+ */
+static size_t kmem_cache_reap(struct kmem_cache *kmem_cache);
+
+/*
+ * Allocate n objects from, and free n objects to, the allocator's slabs,
+ * taking its lock once. Return the number of objects allocated.
+ */
+static size_t slab_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+static void slab_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+
+/*
+ * Initialize a static allocator without magazines.
  */
-#define SLAB_FREEARR(s) ((int*)(s + 1))
+static void kmem_cache_init_static(struct kmem_cache *kmem_cache, size_t size);
 
 /*
- * Destroy all slabs in the linked list.
+ * Count allocations and frees of a size class, and the bytes they waste.
  */
-static void slab_list_destroy(List *list);
+static void kmalloc_count(int class, size_t allocs, size_t frees, size_t wasted);
+
+/*
+ * Allocate a run of pages for an allocation larger than KMALLOC_MAX_SIZE.
+ */
+static void *kmalloc_large(size_t size);
+
+/*
+ * Give an allocator per-cpu magazines.
+ */
+static err_t magazine_enable(struct kmem_cache *kmem_cache);
+
+/*
+ * Pop up to n objects from the current cpu's magazines, fewer if they and the
+ * depot run out of objects. Return the number popped.
+ */
+static size_t magazine_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+
+/*
+ * Push up to n objects onto the current cpu's magazines, fewer if no empty
+ * magazine can be found or allocated. Return the number pushed.
+ */
+static size_t magazine_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n);
+
+/*
+ * Trade an empty magazine (or NULL) for a full one from the depot. Return
+ * NULL, keeping empty, if the depot has no full magazine.
+ */
+static struct kmem_magazine *depot_get_full(struct kmem_cache *kmem_cache, struct kmem_magazine *empty);
+
+/*
+ * Trade a full magazine (or NULL) for an empty one from the depot, allocating
+ * one if the depot has none. If the depot is at DEPOT_FULL_MAX, full is
+ * emptied into the slabs and returned instead. Return NULL, keeping full, if
+ * no magazine could be allocated.
+ */
+static struct kmem_magazine *depot_get_empty(struct kmem_cache *kmem_cache, struct kmem_magazine *full);
+
+/*
+ * Free a list of magazines linked by next, dropping the objects in them.
+ */
+static void magazine_list_free(struct kmem_magazine *mag);
+
+static void
+slab_layout(struct kmem_cache *kmem_cache)
+{
+    size_t order, slab_size, waste;
+
+    // free slots must fit the next pointer, and keep it aligned
+    kmem_cache->obj_size = ROUND_UP(max(kmem_cache->obj_size, sizeof(void*)), sizeof(void*));
+    kassert(kmem_cache->obj_size <= SLAB_OBJ_MAX);
+    for (order = 0;; order++) {
+        slab_size = pg_size << order;
+        // the object fits the largest slab, checked above
+        if (slab_size < SLAB_HDR_SIZE + kmem_cache->obj_size && order < SLAB_MAX_ORDER) {
+            continue;
+        }
+        waste = (slab_size - SLAB_HDR_SIZE) % kmem_cache->obj_size;
+        if (waste * SLAB_WASTE_FRACTION <= slab_size || order >= SLAB_MAX_ORDER) {
+            break;
+        }
+    }
+    kmem_cache->slab_pages = (size_t)1 << order;
+    kmem_cache->slab_objs = (slab_size - SLAB_HDR_SIZE) / kmem_cache->obj_size;
+    kmem_cache->n_colors = waste / CACHELINE_SIZE + 1;
+    kmem_cache->color_next = 0;
+}
 
 static struct slab*
 slab_create(struct kmem_cache *kmem_cache)
 {
     paddr_t paddr;
-    size_t n_pages, n_objs, i;
+    size_t n_pages, i;
     struct slab *slab;
     struct page *page;
+    void *obj;
 
     kassert(kmem_cache);
     kassert(kmem_cache->obj_size > 0);
 
-    // We store at least MIN_OBJS_PER_SLAB objects, the slab structure, and the
-    // free list (MIN_OBJS_PER_SLAB indices) in the slab
-    n_pages = pg_round_up(sizeof(struct slab) + (kmem_cache->obj_size + sizeof(int)) * MIN_OBJS_PER_SLAB) / pg_size;
+    n_pages = kmem_cache->slab_pages;
     if (pmem_nalloc(&paddr, n_pages) != ERR_OK) {
         return NULL;
     }
 
-    // The actual number of objects that can be stored may be greater than
-    // MIN_OBJS_PER_SLAB
-    n_objs = (n_pages * pg_size - sizeof(struct slab)) / (kmem_cache->obj_size + sizeof(int));
-    kassert(n_objs >= MIN_OBJS_PER_SLAB);
-
     slab = (struct slab*)kmap_p2v(paddr);
     kassert(slab);
-    slab->objs = &SLAB_FREEARR(slab)[n_objs]; // objects placed after free index array
-    slab->free = 0;
+    // offset the objects by this slab's color
+    slab->objs = (void*)((vaddr_t)slab + SLAB_HDR_SIZE + kmem_cache->color_next * CACHELINE_SIZE);
+    kmem_cache->color_next = (kmem_cache->color_next + 1) % kmem_cache->n_colors;
+    slab->inuse = 0;
     slab->n_pages = n_pages;
 
     // Link allocator and slab into each allocated page's page structure. The
@@ -98,14 +260,15 @@ slab_create(struct kmem_cache *kmem_cache)
         page->slab = slab;
     }
 
-    // Initialize the free index array
-    for (i = 0; i < n_objs - 1; i++) {
-        SLAB_FREEARR(slab)[i] = i + 1;
+    // Link all slots into the free list, in address order
+    slab->freelist = slab->objs;
+    for (i = 0, obj = slab->objs; i < kmem_cache->slab_objs - 1; i++, obj += kmem_cache->obj_size) {
+        OBJ_NEXT(obj) = obj + kmem_cache->obj_size;
     }
-    SLAB_FREEARR(slab)[n_objs - 1] = -1; // end marker
+    OBJ_NEXT(obj) = NULL;
 
     // Add slab to the allocator
-    list_append(&kmem_cache->free, &slab->node);
+    list_append(&kmem_cache->empty, &slab->node);
 
     return slab;
 }
@@ -117,18 +280,21 @@ slab_destroy(struct slab *slab)
     pmem_nfree(kmap_v2p((vaddr_t)slab), slab->n_pages);
 }
 
-static void
+static size_t
 slab_list_destroy(List *list)
 {
     Node *curr, *next;
+    size_t n_pages = 0;
 
     kassert(list);
     curr = list_begin(list);
     while (curr != list_end(list)) {
         next = list_remove(curr);
+        n_pages += list_entry(curr, struct slab, node)->n_pages;
         slab_destroy(list_entry(curr, struct slab, node));
         curr = next;
     }
+    return n_pages;
 }
 
 void
@@ -137,10 +303,11 @@ kmalloc_init(void)
     struct kmalloc_allocator *ka;
 
     // Initialize allocator cache
-    list_init(&allocator_cache.full);
-    list_init(&allocator_cache.free);
-    spinlock_init(&allocator_cache.lock);
-    allocator_cache.obj_size = sizeof(struct kmem_cache);
+    kmem_cache_init_static(&allocator_cache, sizeof(struct kmem_cache));
+    kmem_cache_init_static(&magazine_cache, sizeof(struct kmem_magazine));
+    spinlock_init(&cache_list_lock);
+    list_init(&cache_list);
+    magazines_enabled = False;
 
     // Initialize kmalloc allocators
     for (ka = kmalloc_allocators; ka < &kmalloc_allocators[N_ELEM(kmalloc_allocators)]; ka++) {
@@ -150,19 +317,78 @@ kmalloc_init(void)
     }
 }
 
+void
+kmalloc_magazine_init(void)
+{
+    spinlock_acquire(&cache_list_lock);
+    magazines_enabled = True;
+    spinlock_release(&cache_list_lock);
+    // allocators created so far, the only cpu running is this one
+    for (Node *n = list_begin(&cache_list); n != list_end(&cache_list); n = list_next(n)) {
+        if (magazine_enable(list_entry(n, struct kmem_cache, cache_node)) != ERR_OK) {
+            panic("Failed to allocate kmem_cache magazines");
+        }
+    }
+}
+
+static void
+kmem_cache_init_static(struct kmem_cache *kmem_cache, size_t size)
+{
+    list_init(&kmem_cache->full);
+    list_init(&kmem_cache->free);
+    list_init(&kmem_cache->empty);
+    spinlock_init(&kmem_cache->lock);
+    kmem_cache->obj_size = size;
+    slab_layout(kmem_cache);
+    kmem_cache->cpu_caches = NULL;
+    spinlock_init(&kmem_cache->depot_lock);
+    kmem_cache->depot_full = NULL;
+    kmem_cache->depot_empty = NULL;
+    kmem_cache->depot_nfull = 0;
+    kmem_cache->reap_pins = 0;
+}
+
+static err_t
+magazine_enable(struct kmem_cache *kmem_cache)
+{
+    struct kmem_cpu_cache *cpu_caches;
+
+    if ((cpu_caches = kmalloc(ncpu * sizeof(struct kmem_cpu_cache))) == NULL) {
+        return ERR_NOMEM;
+    }
+    for (int i = 0; i < ncpu; i++) {
+        cpu_caches[i].loaded = NULL;
+        cpu_caches[i].prev = NULL;
+    }
+    kmem_cache->cpu_caches = cpu_caches;
+    return ERR_OK;
+}
+
 struct kmem_cache*
 kmem_cache_create(size_t size)
 {
     struct kmem_cache *kmem_cache;
 
+    // larger objects don't fit a slab
+    if (size > SLAB_OBJ_MAX) {
+        return NULL;
+    }
     if ((kmem_cache = kmem_cache_alloc(&allocator_cache)) == NULL) {
         return NULL;
     }
 
-    list_init(&kmem_cache->full);
-    list_init(&kmem_cache->free);
-    spinlock_init(&kmem_cache->lock);
-    kmem_cache->obj_size = size;
+    kmem_cache_init_static(kmem_cache, size);
+    spinlock_acquire(&cache_list_lock);
+    if (magazines_enabled) {
+        spinlock_release(&cache_list_lock);
+        if (magazine_enable(kmem_cache) != ERR_OK) {
+            kmem_cache_free(&allocator_cache, kmem_cache);
+            return NULL;
+        }
+        spinlock_acquire(&cache_list_lock);
+    }
+    list_append(&cache_list, &kmem_cache->cache_node);
+    spinlock_release(&cache_list_lock);
 
     return kmem_cache;
 }
@@ -172,105 +398,436 @@ kmem_cache_destroy(struct kmem_cache *kmem_cache)
 {
     kassert(kmem_cache);
 
+    spinlock_acquire(&cache_list_lock);
+    // a reaper needs the allocator, and its place in the list, until it unpins
+    while (kmem_cache->reap_pins > 0) {
+        spinlock_release(&cache_list_lock);
+        pause();
+        spinlock_acquire(&cache_list_lock);
+    }
+    list_remove(&kmem_cache->cache_node);
+    spinlock_release(&cache_list_lock);
+
+    // Objects in magazines live in the slabs, which go away below
+    if (kmem_cache->cpu_caches != NULL) {
+        for (int i = 0; i < ncpu; i++) {
+            if (kmem_cache->cpu_caches[i].loaded != NULL) {
+                kmem_cache_free(&magazine_cache, kmem_cache->cpu_caches[i].loaded);
+            }
+            if (kmem_cache->cpu_caches[i].prev != NULL) {
+                kmem_cache_free(&magazine_cache, kmem_cache->cpu_caches[i].prev);
+            }
+        }
+        kfree(kmem_cache->cpu_caches);
+    }
+    magazine_list_free(kmem_cache->depot_full);
+    magazine_list_free(kmem_cache->depot_empty);
+
     // Destroy all slabs
     slab_list_destroy(&kmem_cache->free);
     slab_list_destroy(&kmem_cache->full);
+    slab_list_destroy(&kmem_cache->empty);
 
     // Free the object allocator
     kmem_cache_free(&allocator_cache, kmem_cache);
 }
 
-void*
-kmem_cache_alloc(struct kmem_cache *kmem_cache)
+static size_t
+slab_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
 {
     struct slab *slab;
-    void *obj;
+    size_t i;
 
-    kassert(kmem_cache);
+    spinlock_acquire(&kmem_cache->lock);
+    for (i = 0; i < n; i++) {
+        // Find a slab that still have free slots, filling partly used slabs
+        // first so that empty ones can be reaped. Allocate a new slab if no
+        // free slab is found.
+        if (!list_empty(&kmem_cache->free)) {
+            slab = list_entry(list_begin(&kmem_cache->free), struct slab, node);
+        } else if (!list_empty(&kmem_cache->empty)) {
+            slab = list_entry(list_begin(&kmem_cache->empty), struct slab, node);
+        } else if ((slab = slab_create(kmem_cache)) == NULL) {
+            break;
+        }
+
+        // Allocate an object from the slab.
+        kassert(slab);
+        kassert(slab->freelist != NULL);
+        objs[i] = slab->freelist;
+        slab->freelist = OBJ_NEXT(objs[i]);
+
+        if (slab->freelist == NULL) {
+            // slab is full
+            list_remove(&slab->node);
+            list_append(&kmem_cache->full, &slab->node);
+        } else if (slab->inuse == 0) {
+            list_remove(&slab->node);
+            list_append(&kmem_cache->free, &slab->node);
+        }
+        slab->inuse++;
+    }
+    spinlock_release(&kmem_cache->lock);
+    return i;
+}
+
+static void
+slab_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
+{
+    struct slab *slab;
+    struct page *page;
+    paddr_t paddr;
 
     spinlock_acquire(&kmem_cache->lock);
-    // Find a slab that still have free slots. Allocate a new slab if no free
-    // slab is found.
-    if (list_empty(&kmem_cache->free)) {
-        if ((slab = slab_create(kmem_cache)) == NULL) {
-            goto fail;
+    for (size_t i = 0; i < n; i++) {
+        // Find the slab the object belongs to
+        paddr = kmap_v2p((vaddr_t)objs[i]);
+        page = paddr_to_page(paddr);
+        kassert(page);
+        slab = page->slab;
+        kassert(slab);
+        kassert(slab->inuse > 0);
+
+        // If slab was full or is now empty, move it to the matching list
+        if (--slab->inuse == 0) {
+            list_remove(&slab->node);
+            list_append(&kmem_cache->empty, &slab->node);
+        } else if (slab->freelist == NULL) {
+            list_remove(&slab->node);
+            list_append(&kmem_cache->free, &slab->node);
         }
+
+        // Add object to the free list
+        OBJ_NEXT(objs[i]) = slab->freelist;
+        slab->freelist = objs[i];
+    }
+    spinlock_release(&kmem_cache->lock);
+}
+
+static size_t
+magazine_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
+{
+    struct kmem_cpu_cache *cc;
+    struct kmem_magazine *mag;
+    size_t i = 0;
+
+    if (kmem_cache->cpu_caches == NULL) {
+        return 0;
+    }
+    intr_set_level(INTR_OFF);
+    cc = &kmem_cache->cpu_caches[cpu_index(mycpu())];
+    while (i < n) {
+        if (cc->loaded == NULL || cc->loaded->rounds == 0) {
+            if (cc->prev != NULL && cc->prev->rounds > 0) {
+                mag = cc->prev;
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            } else if ((mag = depot_get_full(kmem_cache, cc->prev)) != NULL) {
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            } else {
+                break;
+            }
+        }
+        for (; i < n && cc->loaded->rounds > 0; i++) {
+            objs[i] = cc->loaded->objs[--cc->loaded->rounds];
+        }
+    }
+    intr_set_level(INTR_ON);
+    return i;
+}
+
+static size_t
+magazine_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
+{
+    struct kmem_cpu_cache *cc;
+    struct kmem_magazine *mag;
+    size_t i = 0;
+
+    if (kmem_cache->cpu_caches == NULL) {
+        return 0;
+    }
+    intr_set_level(INTR_OFF);
+    cc = &kmem_cache->cpu_caches[cpu_index(mycpu())];
+    while (i < n) {
+        if (cc->loaded == NULL || cc->loaded->rounds == MAG_ROUNDS) {
+            if (cc->prev != NULL && cc->prev->rounds < MAG_ROUNDS) {
+                mag = cc->prev;
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            } else if ((mag = depot_get_empty(kmem_cache, cc->prev)) != NULL) {
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            } else {
+                break;
+            }
+        }
+        for (; i < n && cc->loaded->rounds < MAG_ROUNDS; i++) {
+            cc->loaded->objs[cc->loaded->rounds++] = objs[i];
+        }
+    }
+    intr_set_level(INTR_ON);
+    return i;
+}
+
+static struct kmem_magazine*
+depot_get_full(struct kmem_cache *kmem_cache, struct kmem_magazine *empty)
+{
+    struct kmem_magazine *mag;
+
+    spinlock_acquire(&kmem_cache->depot_lock);
+    if ((mag = kmem_cache->depot_full) != NULL) {
+        kmem_cache->depot_full = mag->next;
+        kmem_cache->depot_nfull--;
+        if (empty != NULL) {
+            empty->next = kmem_cache->depot_empty;
+            kmem_cache->depot_empty = empty;
+        }
+    }
+    spinlock_release(&kmem_cache->depot_lock);
+    return mag;
+}
+
+static struct kmem_magazine*
+depot_get_empty(struct kmem_cache *kmem_cache, struct kmem_magazine *full)
+{
+    struct kmem_magazine *mag;
+
+    spinlock_acquire(&kmem_cache->depot_lock);
+    if (full != NULL && kmem_cache->depot_nfull >= DEPOT_FULL_MAX) {
+        spinlock_release(&kmem_cache->depot_lock);
+        slab_free_bulk(kmem_cache, full->objs, full->rounds);
+        full->rounds = 0;
+        return full;
+    }
+    if ((mag = kmem_cache->depot_empty) != NULL) {
+        kmem_cache->depot_empty = mag->next;
     } else {
-        slab = list_entry(list_begin(&kmem_cache->free), struct slab, node);
+        spinlock_release(&kmem_cache->depot_lock);
+        if ((mag = kmem_cache_alloc(&magazine_cache)) == NULL) {
+            return NULL;
+        }
+        mag->rounds = 0;
+        spinlock_acquire(&kmem_cache->depot_lock);
+    }
+    if (full != NULL) {
+        full->next = kmem_cache->depot_full;
+        kmem_cache->depot_full = full;
+        kmem_cache->depot_nfull++;
     }
+    spinlock_release(&kmem_cache->depot_lock);
+    return mag;
+}
 
-    // Allocate an object from the slab.
-    kassert(slab);
-    kassert(slab->free != -1);
-    obj = (void*)((vaddr_t)slab->objs + kmem_cache->obj_size * slab->free);
-    slab->free = SLAB_FREEARR(slab)[slab->free];
+static size_t
+kmem_cache_reap(struct kmem_cache *kmem_cache)
+{
+    struct kmem_magazine *mags;
+    Node *n, *next;
+    List empty;
+
+    spinlock_acquire(&kmem_cache->depot_lock);
+    mags = kmem_cache->depot_full;
+    kmem_cache->depot_full = NULL;
+    kmem_cache->depot_nfull = 0;
+    spinlock_release(&kmem_cache->depot_lock);
+    for (struct kmem_magazine *mag = mags; mag != NULL; mag = mag->next) {
+        slab_free_bulk(kmem_cache, mag->objs, mag->rounds);
+        mag->rounds = 0;
+    }
+    magazine_list_free(mags);
 
-    if (slab->free == -1) {
-        // slab is full
-        list_remove(&slab->node);
-        list_append(&kmem_cache->full, &slab->node);
+    // take the empty slabs past the reserve off the allocator, they're freed
+    // without its lock
+    list_init(&empty);
+    spinlock_acquire(&kmem_cache->lock);
+    n = list_begin(&kmem_cache->empty);
+    for (int i = 0; i < SLAB_EMPTY_RESERVE && n != list_end(&kmem_cache->empty); i++) {
+        n = list_next(n);
+    }
+    while (n != list_end(&kmem_cache->empty)) {
+        next = list_next(n);
+        list_remove(n);
+        list_append(&empty, n);
+        n = next;
     }
     spinlock_release(&kmem_cache->lock);
+    return slab_list_destroy(&empty);
+}
+
+size_t
+kmalloc_reap(void)
+{
+    struct kmem_cache *kmem_cache;
+    size_t freed = 0;
+
+    spinlock_acquire(&cache_list_lock);
+    for (Node *n = list_begin(&cache_list); n != list_end(&cache_list); n = list_next(n)) {
+        // reap without the list lock, the pin keeps the allocator and its
+        // node in the list from being destroyed meanwhile
+        kmem_cache = list_entry(n, struct kmem_cache, cache_node);
+        kmem_cache->reap_pins++;
+        spinlock_release(&cache_list_lock);
+        freed += kmem_cache_reap(kmem_cache);
+        spinlock_acquire(&cache_list_lock);
+        kmem_cache->reap_pins--;
+    }
+    spinlock_release(&cache_list_lock);
+    // last, the magazines freed above may have emptied magazine slabs
+    freed += kmem_cache_reap(&allocator_cache);
+    freed += kmem_cache_reap(&magazine_cache);
+    return freed;
+}
+
+static void
+magazine_list_free(struct kmem_magazine *mag)
+{
+    struct kmem_magazine *next;
+
+    for (; mag != NULL; mag = next) {
+        next = mag->next;
+        kmem_cache_free(&magazine_cache, mag);
+    }
+}
+
+void*
+kmem_cache_alloc(struct kmem_cache *kmem_cache)
+{
+    void *obj;
+
+    kassert(kmem_cache);
+
+    if (magazine_alloc_bulk(kmem_cache, &obj, 1) == 0 && slab_alloc_bulk(kmem_cache, &obj, 1) == 0) {
+        return NULL;
+    }
     memset(obj, 0x2b, kmem_cache->obj_size);
     return obj;
-
-fail:
-    spinlock_release(&kmem_cache->lock);
-    return NULL;
 }
 
 void
 kmem_cache_free(struct kmem_cache *kmem_cache, void *obj)
 {
-    struct slab *slab;
-    struct page *page;
-    paddr_t paddr;
-    int index, full;
-
     kassert(kmem_cache);
 
-    spinlock_acquire(&kmem_cache->lock);
     // memset freed object to 0x2b to detect uses of freed memory
     memset(obj, 0x2b, kmem_cache->obj_size);
-    // Find the slab the object belongs to
-    paddr = kmap_v2p((vaddr_t)obj);
-    page = paddr_to_page(paddr);
-    kassert(page);
-    slab = page->slab;
-    kassert(slab);
-    full = slab->free == -1;
+    if (magazine_free_bulk(kmem_cache, &obj, 1) == 0) {
+        slab_free_bulk(kmem_cache, &obj, 1);
+    }
+}
+
+err_t
+kmem_cache_alloc_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
+{
+    size_t i;
 
-    // Add object to the free list
-    index = ((vaddr_t)obj - (vaddr_t)slab->objs) / kmem_cache->obj_size;
-    SLAB_FREEARR(slab)[index] = slab->free;
-    slab->free = index;
+    kassert(kmem_cache && objs);
 
-    // If slab was full, move it to the free slabs list
-    if (full) {
-        list_remove(&slab->node);
-        list_append(&kmem_cache->free, &slab->node);
+    i = magazine_alloc_bulk(kmem_cache, objs, n);
+    if (i < n && (i += slab_alloc_bulk(kmem_cache, objs + i, n - i)) < n) {
+        kmem_cache_free_bulk(kmem_cache, objs, i);
+        return ERR_NOMEM;
+    }
+    for (i = 0; i < n; i++) {
+        memset(objs[i], 0x2b, kmem_cache->obj_size);
+    }
+    return ERR_OK;
+}
+
+void
+kmem_cache_free_bulk(struct kmem_cache *kmem_cache, void **objs, size_t n)
+{
+    size_t i;
+
+    kassert(kmem_cache && objs);
+
+    for (i = 0; i < n; i++) {
+        memset(objs[i], 0x2b, kmem_cache->obj_size);
+    }
+    // whatever doesn't fit in the magazines goes back to the slabs
+    if ((i = magazine_free_bulk(kmem_cache, objs, n)) < n) {
+        slab_free_bulk(kmem_cache, objs + i, n - i);
     }
-    spinlock_release(&kmem_cache->lock);
+}
+
+static void
+kmalloc_count(int class, size_t allocs, size_t frees, size_t wasted)
+{
+    struct kmalloc_counters *counters;
+
+    if (!magazines_enabled) {
+        counters = &boot_stats;
+    } else {
+        intr_set_level(INTR_OFF);
+        counters = this_cpu_ptr(kmalloc_counters);
+    }
+    counters->class[class].allocs += allocs;
+    counters->class[class].frees += frees;
+    counters->class[class].wasted += wasted;
+    if (magazines_enabled) {
+        intr_set_level(INTR_ON);
+    }
+}
+
+int
+kmalloc_stats(struct kmalloc_class_stat *stats, int n)
+{
+    struct kmalloc_counters *counters;
+    int class;
+
+    kassert(stats);
+    for (class = 0; class <= LARGE_CLASS && class < n; class++) {
+        stats[class].size = class == LARGE_CLASS ? 0 : kmalloc_allocators[class].size;
+        stats[class].allocs = boot_stats.class[class].allocs;
+        stats[class].frees = boot_stats.class[class].frees;
+        stats[class].wasted = boot_stats.class[class].wasted;
+        // other cpus' counters are read racily, good enough for statistics
+        for (int cpu = 0; magazines_enabled && cpu < ncpu; cpu++) {
+            counters = per_cpu_ptr(kmalloc_counters, cpu);
+            stats[class].allocs += counters->class[class].allocs;
+            stats[class].frees += counters->class[class].frees;
+            stats[class].wasted += counters->class[class].wasted;
+        }
+    }
+    return class;
+}
+
+static void*
+kmalloc_large(size_t size)
+{
+    size_t n_pages = pg_round_up(size) / pg_size;
+    paddr_t paddr;
+
+    // not pmem_nalloc, which would round n_pages up to a power of two
+    if (pmem_nalloc_exact(&paddr, n_pages) != ERR_OK) {
+        return NULL;
+    }
+    paddr_to_page(paddr)->kmalloc_pages = n_pages;
+    kmalloc_count(LARGE_CLASS, 1, 0, n_pages * pg_size - size);
+    return (void*)kmap_p2v(paddr);
 }
 
 void*
 kmalloc(size_t size)
 {
     struct kmalloc_allocator *alloc;
+    void *obj;
 
     if (size == 0) {
         return NULL;
     }
 
-    if (size > kmalloc_allocators[N_ELEM(kmalloc_allocators) - 1].size) {
-        // We don't have an allocator capable of allocating ``size`` bytes
-        return NULL;
+    if (size > KMALLOC_MAX_SIZE) {
+        return kmalloc_large(size);
     }
 
     // Find kmalloc allocator with a big enough size
     for (alloc = kmalloc_allocators; alloc < &kmalloc_allocators[N_ELEM(kmalloc_allocators)]; alloc++) {
         if (alloc->size >= size) {
-            return kmem_cache_alloc(alloc->kmem_cache);
+            if ((obj = kmem_cache_alloc(alloc->kmem_cache)) != NULL) {
+                kmalloc_count(alloc - kmalloc_allocators, 1, 0, alloc->size - size);
+            }
+            return obj;
         }
     }
 
@@ -280,16 +837,32 @@ kmalloc(size_t size)
 void
 kfree(void *ptr)
 {
+    struct kmalloc_allocator *alloc;
     struct kmem_cache *kmem_cache;
     struct page *page;
     paddr_t paddr;
+    size_t n_pages;
 
     // Find the kmalloc allocator the memory belongs to
     paddr = kmap_v2p((vaddr_t)ptr);
     page = paddr_to_page(paddr);
     kassert(page);
     kmem_cache = page->kmem_cache;
-    kassert(kmem_cache);
+    if (kmem_cache == NULL) {
+        // a large allocation, ptr is the start of its page run
+        kassert(page->kmalloc_pages > 0);
+        n_pages = page->kmalloc_pages;
+        page->kmalloc_pages = 0;
+        pmem_nfree_exact(paddr, n_pages);
+        kmalloc_count(LARGE_CLASS, 0, 1, 0);
+        return;
+    }
 
+    for (alloc = kmalloc_allocators; alloc < &kmalloc_allocators[N_ELEM(kmalloc_allocators)]; alloc++) {
+        if (alloc->kmem_cache == kmem_cache) {
+            kmalloc_count(alloc - kmalloc_allocators, 0, 1, 0);
+            break;
+        }
+    }
     kmem_cache_free(kmem_cache, ptr);
 }
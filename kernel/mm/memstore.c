@@ -1,5 +1,7 @@
 #include <kernel/memstore.h>
 #include <kernel/kmalloc.h>
+#include <kernel/pmem.h>
+#include <kernel/reclaim.h>
 #include <kernel/console.h>
 #include <lib/string.h>
 #include <lib/stddef.h>
@@ -20,6 +22,9 @@ memstore_alloc(void)
         rmap_construct(&store->rmap);
         sleeplock_init(&store->pgcache_lock);
         radix_tree_construct(&store->cached_pages);
+        store->get = NULL;
+        store->put = NULL;
+        store->reclaimable = False;
     }
     return store;
 }
@@ -29,7 +34,20 @@ memstore_alloc(void)
 void
 memstore_free(struct memstore *store)
 {
+    struct page *page;
+    int index = 0;
+
     kassert(store);
+    // the lock keeps reclaim, which may have picked one of our pages, away
+    // until every page is off its lists
+    sleeplock_acquire(&store->pgcache_lock);
+    // pages still mapped by a process stay alive through their own references
+    while ((page = radix_tree_next(&store->cached_pages, &index)) != NULL) {
+        reclaim_remove_page(page);
+        radix_tree_remove(&store->cached_pages, index);
+        pmem_dec_refcnt(page_to_paddr(page));
+    }
+    sleeplock_release(&store->pgcache_lock);
     rmap_destroy(&store->rmap);
     kmem_cache_free(memstore_allocator, store);
 }
@@ -5,7 +5,10 @@
 #include <kernel/radix_tree.h>
 #include <kernel/memstore.h>
 #include <kernel/pmem.h>
+#include <kernel/vpmap.h>
+#include <kernel/reclaim.h>
 #include <lib/errcode.h>
+#include <lib/string.h>
 
 struct page*
 pgcache_get_page(struct memstore *store, offset_t ofs)
@@ -34,14 +37,56 @@ pgcache_get_page(struct memstore *store, offset_t ofs)
             case ERR_RADIX_TREE_NODE_EXIST:
                 panic("node should not exist");
         }
+        page->store = store;
+        page->ofs = pg_round_down(ofs);
+        if (store->reclaimable) {
+            reclaim_add_page(page);
+        }
+    } else if (store->reclaimable) {
+        reclaim_mark_accessed(page);
     }
 
     return page;
 }
 
+struct page*
+pgcache_lookup_page(struct memstore *store, offset_t ofs)
+{
+    kassert(store);
+    return radix_tree_lookup(&store->cached_pages, ofs / pg_size);
+}
+
 void
 pgcache_remove_page(struct memstore *store, offset_t ofs)
 {
+    struct page *page;
+
     kassert(store);
-    radix_tree_remove(&store->cached_pages, ofs / pg_size);
+    if ((page = radix_tree_remove(&store->cached_pages, ofs / pg_size)) != NULL) {
+        reclaim_remove_page(page);
+    }
+}
+
+void
+pgcache_update(struct memstore *store, offset_t ofs, const void *buf, size_t len)
+{
+    struct page *page;
+    offset_t pos, end = ofs + len;
+    size_t n;
+
+    kassert(store);
+    for (pos = ofs; pos < end; pos += n) {
+        n = min(end - pos, pg_size - pos % pg_size);
+        sleeplock_acquire(&store->pgcache_lock);
+        if ((page = pgcache_lookup_page(store, pos)) != NULL) {
+            pmem_inc_refcnt(page_to_paddr(page), 1);
+        }
+        sleeplock_release(&store->pgcache_lock);
+        if (page == NULL) {
+            continue;
+        }
+        // copy outside the lock, the reference keeps the page around
+        memcpy((void*)kmap_p2v(page_to_paddr(page)) + pos % pg_size, (char*)buf + (pos - ofs), n);
+        pmem_dec_refcnt(page_to_paddr(page));
+    }
 }
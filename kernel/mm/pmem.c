@@ -2,10 +2,15 @@
 #include <kernel/vm.h>
 #include <kernel/console.h>
 #include <kernel/vpmap.h>
+#include <kernel/trap.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/reclaim.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
 #include <lib/stddef.h>
 #include <lib/bits.h>
+#include <arch/percpu.h>
 
 /*
  * pmem contains two memory allocators:
@@ -23,13 +28,15 @@
  * them in the current free list and returns the other one. The two blocks are
  * called "buddies". When two buddy blocks are both freed, they merge into a
  * bigger block and is moved to the next free list.
+ *
+ * Single pages make up most allocations, so each cpu keeps a small cache of
+ * free order-0 pages in front of the buddy allocator. The cache is refilled
+ * from and drained to the buddy lists in batches, so pmem_lock is only taken
+ * once every PCP_BATCH single page allocations or frees.
  */
 
 struct pmemconfig pmemconfig;
 
-// Page state bits
-#define PAGE_DIRTY_BIT 0
-
 // Lock protecting page allocation and deallocation
 static struct spinlock pmem_lock;
 
@@ -55,6 +62,49 @@ static bool pagemap_initialized;
  */
 #define MAX_ORDER 10
 static List freeblocks[MAX_ORDER+1];
+// number of pages in freeblocks, protected by pmem_lock
+static size_t nr_free;
+
+/*
+ * The low watermark is 1/WMARK_DIV of physical memory but at least WMARK_MIN
+ * pages, the high watermark twice that.
+ */
+#define WMARK_DIV   32
+#define WMARK_MIN   16
+size_t pmem_wmark_low;
+size_t pmem_wmark_high;
+
+/*
+ * Per-cpu cache of free order-0 pages. An empty cache is refilled with
+ * PCP_BATCH pages, a cache above PCP_HIGH is drained down to PCP_LOW.
+ * Normally only touched by its own cpu; the lock is there so that an
+ * allocation about to fail can drain every cpu's cache, and is otherwise
+ * uncontended. Lock order: pcp->lock, then pmem_lock.
+ */
+#define PCP_BATCH   16
+#define PCP_LOW     32
+#define PCP_HIGH    64
+struct pcp {
+    struct spinlock lock;
+    List pages;
+    int count;
+};
+static DEFINE_PER_CPU(struct pcp, pcp_lists);
+// per-cpu data is set up after the buddy allocator, until then bypass the caches
+static bool pcp_enabled;
+
+/*
+ * Pool of allocated pages known to be zero. The "zero thread" runs at the
+ * lowest priority, so it mostly runs on otherwise idle cpus, and keeps the
+ * pool between ZERO_POOL_LOW and ZERO_POOL_HIGH pages. Allocations fall back
+ * to the pool under memory pressure.
+ */
+#define ZERO_POOL_LOW   128
+#define ZERO_POOL_HIGH  256
+static struct spinlock zero_lock;
+static List zero_pool;
+static int zero_pool_count;
+static struct condvar zero_cv;
 
 /*
  * Initialize bitmap for the boot memory allocator.
@@ -210,6 +260,47 @@ static err_t pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock);
  */
 static void pmem_nfree_internal(paddr_t paddr, size_t n, bool lock);
 
+/*
+ * Prepare a block fresh out of the free lists for its new owner.
+ */
+static void page_init_alloc(struct page *page);
+
+/*
+ * Move up to n pages from the buddy lists into a cpu's cache, return the
+ * number moved. Caller must hold pcp->lock.
+ */
+static int pcp_refill(struct pcp *pcp, int n);
+
+/*
+ * Move n pages from a cpu's cache back to the buddy lists.
+ * Caller must hold pcp->lock.
+ */
+static void pcp_drain(struct pcp *pcp, int n);
+
+/*
+ * Drain every cpu's cache into the buddy lists, so that pages cached by
+ * other cpus can satisfy an allocation that would otherwise fail.
+ */
+static void pcp_drain_all(void);
+
+/*
+ * Allocate up to n single pages, and free n single pages, through the current
+ * cpu's cache, refilling or draining it at most once. Return the number of
+ * pages allocated.
+ */
+static size_t pcp_alloc_bulk(paddr_t *paddrs, size_t n);
+static void pcp_free_bulk(paddr_t *paddrs, size_t n);
+
+/*
+ * Take a page out of the zero pool, return ERR_NOMEM if it is empty.
+ */
+static err_t zero_pool_get(paddr_t *paddr);
+
+/*
+ * Fill the zero pool up to ZERO_POOL_HIGH whenever it runs low.
+ */
+static int zero_thread(void *aux);
+
 static void
 bitmap_init(void)
 {
@@ -487,7 +578,8 @@ merge_block(struct page *page)
     // exist smaller allocated block within the buddy block.
     //
     // Once we merge the two blocks, recursively merge the next level blocks
-    if (buddy && buddy->refcnt == 0 && buddy->order == page->order) {
+    if (buddy && buddy->refcnt == 0 && buddy->order == page->order &&
+        !get_state_bit(buddy->state, PAGE_PCP_BIT)) {
         freeblocks_remove(buddy);
         if (page < buddy) {
             page->order += 1;
@@ -510,6 +602,7 @@ freeblocks_insert(struct page *page)
 
     page->refcnt = 0;
     list_append(&freeblocks[page->order], &page->node);
+    nr_free += 1 << page->order;
 }
 
 static void
@@ -537,6 +630,7 @@ freeblocks_remove(struct page *page)
     kassert(page->order >= 0 && page->order <= MAX_ORDER);
 
     list_remove(&page->node);
+    nr_free -= 1 << page->order;
 }
 
 static err_t
@@ -562,14 +656,7 @@ pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock)
         if ((page = find_freeblock(order, False)) == NULL) {
             goto fail;
         }
-        sleeplock_init(&page->lock);
-        page->kmem_cache = NULL;
-        page->slab = NULL;
-        page->rmap = NULL;
-        pmem_set_page_dirty(page, False);
-        kassert(page->refcnt == 0);
-        page->refcnt = 1;
-        list_init(&page->blk_headers);
+        page_init_alloc(page);
         *paddr = page_to_paddr(page);
         kassert(*paddr != NULL);
     }
@@ -616,6 +703,185 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
     }
 }
 
+static void
+page_init_alloc(struct page *page)
+{
+    mutex_init(&page->lock);
+    page->kmem_cache = NULL;
+    page->slab = NULL;
+    page->rmap = NULL;
+    page->store = NULL;
+    page->state = 0;
+    page->kmalloc_pages = 0;
+    kassert(page->refcnt == 0);
+    page->refcnt = 1;
+    list_init(&page->blk_headers);
+}
+
+static int
+pcp_refill(struct pcp *pcp, int n)
+{
+    struct page *page;
+    int i;
+
+    spinlock_acquire(&pmem_lock);
+    for (i = 0; i < n && (page = find_freeblock(0, False)) != NULL; i++) {
+        page->state = set_state_bit(page->state, PAGE_PCP_BIT, True);
+        list_append(&pcp->pages, &page->node);
+    }
+    spinlock_release(&pmem_lock);
+    pcp->count += i;
+    return i;
+}
+
+static void
+pcp_drain(struct pcp *pcp, int n)
+{
+    struct page *page;
+
+    spinlock_acquire(&pmem_lock);
+    // the oldest pages are the coldest, give those back
+    for (; n > 0 && pcp->count > 0; n--, pcp->count--) {
+        page = list_entry(list_begin(&pcp->pages), struct page, node);
+        list_remove(&page->node);
+        page->state = set_state_bit(page->state, PAGE_PCP_BIT, False);
+        page = merge_block(page);
+        kassert(page != NULL);
+        freeblocks_insert(page);
+    }
+    spinlock_release(&pmem_lock);
+}
+
+static size_t
+pcp_alloc_bulk(paddr_t *paddrs, size_t n)
+{
+    struct pcp *pcp;
+    struct page *page;
+    size_t i, missing;
+    bool low = False;
+
+    intr_set_level(INTR_OFF);
+    pcp = this_cpu_ptr(pcp_lists);
+    spinlock_acquire(&pcp->lock);
+    if (pcp->count < n) {
+        // one refill covers the whole batch
+        missing = n - pcp->count;
+        pcp_refill(pcp, max(missing, PCP_BATCH));
+        // Only refills take from the buddy lists, so check the watermark here
+        // and leave the fast path alone. Pages in other cpus' caches are not
+        // counted, they are at most ncpu * PCP_HIGH.
+        low = nr_free + zero_pool_count < pmem_wmark_low;
+    }
+    for (i = 0; i < n && pcp->count > 0; i++, pcp->count--) {
+        // most recently freed page is the most likely to still be in cache
+        page = list_entry(list_prev(list_end(&pcp->pages)), struct page, node);
+        list_remove(&page->node);
+        paddrs[i] = page_to_paddr(page);
+    }
+    spinlock_release(&pcp->lock);
+    intr_set_level(INTR_ON);
+
+    for (size_t j = 0; j < i; j++) {
+        page_init_alloc(paddr_to_page(paddrs[j]));
+    }
+    if (low) {
+        reclaim_wakeup();
+    }
+    return i;
+}
+
+static void
+pcp_free_bulk(paddr_t *paddrs, size_t n)
+{
+    struct pcp *pcp;
+    struct page *page;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        page = paddr_to_page(paddrs[i]);
+        kassert(page->order == 0);
+        page->refcnt = 0;
+        page->state = set_state_bit(0, PAGE_PCP_BIT, True);
+    }
+    intr_set_level(INTR_OFF);
+    pcp = this_cpu_ptr(pcp_lists);
+    spinlock_acquire(&pcp->lock);
+    for (i = 0; i < n; i++) {
+        list_append(&pcp->pages, &paddr_to_page(paddrs[i])->node);
+    }
+    pcp->count += n;
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, pcp->count - PCP_LOW);
+    }
+    spinlock_release(&pcp->lock);
+    intr_set_level(INTR_ON);
+}
+
+static void
+pcp_drain_all(void)
+{
+    struct pcp *pcp;
+
+    for (int i = 0; i < ncpu; i++) {
+        pcp = per_cpu_ptr(pcp_lists, i);
+        spinlock_acquire(&pcp->lock);
+        pcp_drain(pcp, pcp->count);
+        spinlock_release(&pcp->lock);
+    }
+}
+
+static err_t
+zero_pool_get(paddr_t *paddr)
+{
+    struct page *page = NULL;
+
+    spinlock_acquire(&zero_lock);
+    if (zero_pool_count > 0) {
+        page = list_entry(list_begin(&zero_pool), struct page, node);
+        list_remove(&page->node);
+        if (--zero_pool_count == ZERO_POOL_LOW) {
+            condvar_signal(&zero_cv);
+        }
+    }
+    spinlock_release(&zero_lock);
+    if (page == NULL) {
+        return ERR_NOMEM;
+    }
+    *paddr = page_to_paddr(page);
+    return ERR_OK;
+}
+
+static int
+zero_thread(void *aux)
+{
+    paddr_t paddr;
+
+    for (;;) {
+        spinlock_acquire(&zero_lock);
+        while (zero_pool_count >= ZERO_POOL_HIGH) {
+            condvar_wait(&zero_cv, &zero_lock);
+        }
+        spinlock_release(&zero_lock);
+
+        // zero outside the lock, one page at a time so higher priority work
+        // preempts us quickly. Take cold pages from the buddy lists, the
+        // per-cpu caches are better left to allocations that use them right away.
+        // Don't push free memory down to where reclaim has to make up for it.
+        if (pmem_nr_free() - zero_pool_count < pmem_wmark_high ||
+            pmem_nalloc_internal(&paddr, 1, True) != ERR_OK) {
+            // memory is tight, don't hold on to it, try again later
+            timer_sleep(TIMER_FREQ);
+            continue;
+        }
+        memset((void*)kmap_p2v(paddr), 0, pg_size);
+        spinlock_acquire(&zero_lock);
+        list_append(&zero_pool, &paddr_to_page(paddr)->node);
+        zero_pool_count++;
+        spinlock_release(&zero_lock);
+    }
+    return 0;
+}
+
 struct page*
 paddr_to_page(paddr_t paddr)
 {
@@ -634,6 +900,10 @@ pmem_boot_init(void)
     pmem_arch_init();
     bitmap_init();
     spinlock_init(&pmem_lock);
+    spinlock_init(&zero_lock);
+    list_init(&zero_pool);
+    zero_pool_count = 0;
+    condvar_init(&zero_cv);
     pagemap_initialized = False;
 }
 
@@ -645,18 +915,203 @@ pmem_init(void)
     freeblocks_init();
     pagemap_initialized = True;
     spinlock_release(&pmem_lock);
+
+    pmem_wmark_low = max((pmemconfig.pmem_end - pmemconfig.pmem_start) / pg_size / WMARK_DIV, WMARK_MIN);
+    pmem_wmark_high = 2 * pmem_wmark_low;
+}
+
+size_t
+pmem_nr_free(void)
+{
+    size_t n = nr_free + zero_pool_count;
+
+    if (pcp_enabled) {
+        for (int i = 0; i < ncpu; i++) {
+            n += per_cpu(pcp_lists, i).count;
+        }
+    }
+    return n;
+}
+
+void
+pmem_split(paddr_t paddr)
+{
+    struct page *head = paddr_to_page(paddr);
+    struct page *page;
+    int n;
+
+    spinlock_acquire(&pmem_lock);
+    kassert(head->refcnt > 0);
+    n = 1 << head->order;
+    head->order = 0;
+    for (page = head + 1; page < head + n; page++) {
+        // tail pages keep whatever they had when the block was last split
+        page->refcnt = 0;
+        page_init_alloc(page);
+        page->order = 0;
+        // every holder of the block now holds each page
+        page->refcnt = head->refcnt;
+    }
+    spinlock_release(&pmem_lock);
+}
+
+err_t
+pmem_nalloc_exact(paddr_t *paddr, size_t n)
+{
+    struct page *page;
+    paddr_t start, end, block_end;
+    int order;
+
+    if (n == 0 || n > (1 << MAX_ORDER)) {
+        return ERR_NOMEM;
+    }
+    if (pmem_nalloc(paddr, n) != ERR_OK) {
+        return ERR_NOMEM;
+    }
+    // the boot allocator hands out exact runs already
+    if (!pagemap_initialized || 1 << (page = paddr_to_page(*paddr))->order == n) {
+        return ERR_OK;
+    }
+    start = *paddr;
+    end = start + n * pg_size;
+    block_end = start + (1 << page->order) * pg_size;
+    spinlock_acquire(&pmem_lock);
+    // the first n pages become allocated blocks, largest first
+    for (; start < end; start += (1 << order) * pg_size) {
+        order = get_max_page_order(start, end);
+        page = paddr_to_page(start);
+        if (start != *paddr) {
+            page->refcnt = 0;
+            page_init_alloc(page);
+        }
+        page->order = order;
+    }
+    // the tail is free, its buddies are the allocated blocks
+    freeblocks_insert_range(end, block_end);
+    spinlock_release(&pmem_lock);
+    return ERR_OK;
+}
+
+void
+pmem_nfree_exact(paddr_t paddr, size_t n)
+{
+    struct page *page;
+    paddr_t end = paddr + n * pg_size;
+    int order;
+
+    if (!pagemap_initialized) {
+        pmem_nfree(paddr, n);
+        return;
+    }
+    spinlock_acquire(&pmem_lock);
+    for (; paddr < end; paddr += (1 << order) * pg_size) {
+        page = paddr_to_page(paddr);
+        order = page->order;
+        page->refcnt = 0;
+        page = merge_block(page);
+        kassert(page != NULL);
+        freeblocks_insert(page);
+    }
+    spinlock_release(&pmem_lock);
+}
+
+void
+pmem_pcp_init(void)
+{
+    for (int i = 0; i < ncpu; i++) {
+        spinlock_init(&per_cpu(pcp_lists, i).lock);
+        list_init(&per_cpu(pcp_lists, i).pages);
+        per_cpu(pcp_lists, i).count = 0;
+    }
+    pcp_enabled = True;
+}
+
+void
+pmem_zero_init(void)
+{
+    struct thread *t = thread_create("zero thread", NULL, PRI_MIN);
+    kassert(t);
+    thread_start_context(t, zero_thread, NULL);
 }
 
 err_t
 pmem_alloc(paddr_t *paddr)
 {
-    return pmem_nalloc(paddr, 1);
+    if (pmem_nalloc(paddr, 1) == ERR_OK) {
+        return ERR_OK;
+    }
+    return zero_pool_get(paddr);
+}
+
+err_t
+pmem_alloc_zeroed(paddr_t *paddr)
+{
+    if (zero_pool_get(paddr) == ERR_OK) {
+        return ERR_OK;
+    }
+    if (pmem_nalloc(paddr, 1) != ERR_OK) {
+        return ERR_NOMEM;
+    }
+    memset((void*)kmap_p2v(*paddr), 0, pg_size);
+    return ERR_OK;
 }
 
 err_t
 pmem_nalloc(paddr_t *paddr, size_t n)
 {
-    return pmem_nalloc_internal(paddr, n, True);
+    err_t err;
+
+    if (pcp_enabled && n == 1) {
+        err = pcp_alloc_bulk(paddr, 1) == 1 ? ERR_OK : ERR_NOMEM;
+    } else {
+        err = pmem_nalloc_internal(paddr, n, True);
+    }
+    if (err == ERR_NOMEM && pcp_enabled) {
+        // free pages may sit in any cpu's cache, or keep a large enough block apart
+        pcp_drain_all();
+        if (n == 1) {
+            err = pcp_alloc_bulk(paddr, 1) == 1 ? ERR_OK : ERR_NOMEM;
+        } else {
+            err = pmem_nalloc_internal(paddr, n, True);
+        }
+    }
+    // the per-cpu cache checks the watermark when it refills
+    if (!(pcp_enabled && n == 1) && pmem_nr_free() < pmem_wmark_low) {
+        reclaim_wakeup();
+    }
+    return err;
+}
+
+err_t
+pmem_alloc_bulk(paddr_t *paddrs, size_t n)
+{
+    size_t i = 0;
+
+    kassert(paddrs);
+    if (pcp_enabled) {
+        i = pcp_alloc_bulk(paddrs, n);
+    }
+    // what the cache couldn't supply comes one page at a time, zero pool included
+    for (; i < n; i++) {
+        if (pmem_alloc(&paddrs[i]) != ERR_OK) {
+            pmem_free_bulk(paddrs, i);
+            return ERR_NOMEM;
+        }
+    }
+    return ERR_OK;
+}
+
+void
+pmem_free_bulk(paddr_t *paddrs, size_t n)
+{
+    kassert(paddrs);
+    if (pcp_enabled) {
+        pcp_free_bulk(paddrs, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pmem_free(paddrs[i]);
+    }
 }
 
 void
@@ -668,6 +1123,10 @@ pmem_free(paddr_t paddr)
 void
 pmem_nfree(paddr_t paddr, size_t n)
 {
+    if (pcp_enabled && paddr_to_page(paddr)->order == 0) {
+        pcp_free_bulk(&paddr, 1);
+        return;
+    }
     pmem_nfree_internal(paddr, n, True);
 }
 
@@ -703,12 +1162,53 @@ pmem_inc_refcnt(paddr_t paddr, int n)
 
     spinlock_acquire(&pmem_lock);
     kassert(page->refcnt > 0);
-    kassert(page->order == 0);
 
     page->refcnt += n;
     spinlock_release(&pmem_lock);
 }
 
+void
+pmem_inc_refcnt_block(paddr_t paddr, size_t npages, int n)
+{
+    struct page *head = paddr_to_page(paddr);
+
+    spinlock_acquire(&pmem_lock);
+    kassert(head->refcnt > 0);
+    if (head->order != 0) {
+        head->refcnt += n;
+    } else {
+        for (size_t i = 0; i < npages; i++) {
+            head[i].refcnt += n;
+        }
+    }
+    spinlock_release(&pmem_lock);
+}
+
+void
+pmem_dec_refcnt_block(paddr_t paddr, size_t npages)
+{
+    struct page *head = paddr_to_page(paddr);
+    int order;
+
+    spinlock_acquire(&pmem_lock);
+    kassert(head->refcnt > 0);
+    if ((order = head->order) != 0) {
+        // checked under pmem_lock, a split can't slip in between
+        if (--head->refcnt == 0) {
+            spinlock_release(&pmem_lock);
+            pmem_nfree(paddr, 1 << order);
+            return;
+        }
+        spinlock_release(&pmem_lock);
+        return;
+    }
+    // a split block stays split while this holder has its references
+    spinlock_release(&pmem_lock);
+    for (size_t i = 0; i < npages; i++) {
+        pmem_dec_refcnt(paddr + i * pg_size);
+    }
+}
+
 void
 pmem_dec_refcnt(paddr_t paddr)
 {
@@ -719,11 +1219,12 @@ pmem_dec_refcnt(paddr_t paddr)
 
     spinlock_acquire(&pmem_lock);
     kassert(page->refcnt > 0);
-    kassert(page->order == 0);
 
     page->refcnt--;
     if (page->refcnt == 0) {
-        pmem_nfree_internal(paddr, 1, False);
+        spinlock_release(&pmem_lock);
+        pmem_nfree(paddr, 1 << page->order);
+        return;
     }
     spinlock_release(&pmem_lock);
 }
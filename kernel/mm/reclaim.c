@@ -0,0 +1,349 @@
+#include <kernel/reclaim.h>
+#include <kernel/pmem.h>
+#include <kernel/memstore.h>
+#include <kernel/radix_tree.h>
+#include <kernel/rmap.h>
+#include <kernel/swap.h>
+#include <kernel/synch.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/console.h>
+#include <kernel/vm.h>
+#include <kernel/kmalloc.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/bits.h>
+
+/*
+ * Pages enter the page cache on the inactive list, so data read once is the
+ * first to go. Both lists are scanned from the oldest page like a clock hand:
+ * a referenced inactive page is promoted, an unreferenced one is unmapped and
+ * freed. The active list is kept no longer than the inactive one, its
+ * referenced pages go around again and the rest are demoted, so every page
+ * gets a second look before it is dropped.
+ */
+
+// kswapd frees pages in batches, so it rechecks the watermark between them
+#define RECLAIM_BATCH   32
+// pages a scan may look at for each page it is asked to free
+#define SCAN_RATIO      4
+// kswapd backs off this long after a round that freed nothing
+#define KSWAPD_BACKOFF  (TIMER_FREQ / 10)
+// objects a shrinker is asked to free for each page, a slab holds many
+#define SHRINK_RATIO    32
+
+// Protects both lists, their counts and the LRU state bits of their pages
+static struct spinlock lru_lock;
+static List active_list;
+static List inactive_list;
+static size_t nr_active;
+static size_t nr_inactive;
+
+static struct spinlock kswapd_lock;
+static struct condvar kswapd_cv;
+static bool kswapd_wanted;
+static bool reclaim_enabled;
+
+// Protects the shrinker list, held while shrinkers run
+static struct sleeplock shrinker_lock;
+static List shrinkers;
+
+/*
+ * Take the oldest page off list with its store's pgcache_lock held, which
+ * keeps the page in the cache and the store alive. Pages whose store is busy
+ * are rotated to the back. *count is the length of list. Return NULL if no
+ * page could be taken.
+ */
+static struct page *lru_isolate(List *list, size_t *count);
+
+/*
+ * Put an isolated page back at the young end of the active or inactive list.
+ */
+static void lru_putback(struct page *page, bool active);
+
+/*
+ * Test and clear whether page was used since the last look, through a page
+ * cache hit or an access through any of its mappings.
+ */
+static bool page_referenced(struct page *page);
+
+/*
+ * Drop an isolated page from the page cache. Return False if it is still
+ * mapped somewhere or in use.
+ */
+static bool page_evict(struct page *page);
+
+/*
+ * Age up to n pages from the active list.
+ */
+static void shrink_active(size_t n);
+
+/*
+ * Scan up to n pages from the inactive list, return the number freed. Stop
+ * once want pages are freed.
+ */
+static size_t shrink_inactive(size_t n, size_t want);
+
+/*
+ * Ask every shrinker to free objects worth n pages, then free the slabs left
+ * empty. Return the number of pages freed.
+ */
+static size_t shrink_slab(size_t n);
+
+static int kswapd(void *aux);
+
+static struct page*
+lru_isolate(List *list, size_t *count)
+{
+    struct page *page;
+    size_t tries;
+
+    spinlock_acquire(&lru_lock);
+    for (tries = *count; tries > 0; tries--) {
+        page = list_entry(list_begin(list), struct page, lru_node);
+        list_remove(&page->lru_node);
+        // the page cache lock ranks above lru_lock
+        if (sleeplock_try_acquire(&page->store->pgcache_lock) == ERR_OK) {
+            page->state = set_state_bit(page->state, PAGE_LRU_BIT, False);
+            (*count)--;
+            spinlock_release(&lru_lock);
+            return page;
+        }
+        list_append(list, &page->lru_node);
+    }
+    spinlock_release(&lru_lock);
+    return NULL;
+}
+
+static void
+lru_putback(struct page *page, bool active)
+{
+    spinlock_acquire(&lru_lock);
+    page->state = set_state_bit(page->state, PAGE_LRU_BIT, True);
+    page->state = set_state_bit(page->state, PAGE_ACTIVE_BIT, active);
+    if (active) {
+        list_append(&active_list, &page->lru_node);
+        nr_active++;
+    } else {
+        list_append(&inactive_list, &page->lru_node);
+        nr_inactive++;
+    }
+    spinlock_release(&lru_lock);
+}
+
+static bool
+page_referenced(struct page *page)
+{
+    bool referenced;
+
+    spinlock_acquire(&lru_lock);
+    referenced = get_state_bit(page->state, PAGE_REFERENCED_BIT);
+    page->state = set_state_bit(page->state, PAGE_REFERENCED_BIT, False);
+    spinlock_release(&lru_lock);
+    // always walk the mappings, their accessed bits need clearing too
+    return rmap_referenced(&page->store->rmap, page_to_paddr(page)) || referenced;
+}
+
+static bool
+page_evict(struct page *page)
+{
+    struct memstore *store = page->store;
+    paddr_t paddr = page_to_paddr(page);
+
+    // the page cache's own reference must be the last one
+    if (rmap_unmap(&store->rmap, paddr) != ERR_OK || pmem_get_refcnt(paddr) != 1) {
+        return False;
+    }
+    radix_tree_remove(&store->cached_pages, page->ofs / pg_size);
+    page->store = NULL;
+    pmem_dec_refcnt(paddr);
+    return True;
+}
+
+static void
+shrink_active(size_t n)
+{
+    struct page *page;
+    struct memstore *store;
+
+    for (; n > 0 && (page = lru_isolate(&active_list, &nr_active)) != NULL; n--) {
+        store = page->store;
+        lru_putback(page, page_referenced(page));
+        sleeplock_release(&store->pgcache_lock);
+    }
+}
+
+static size_t
+shrink_inactive(size_t n, size_t want)
+{
+    struct page *page;
+    struct memstore *store;
+    size_t freed = 0;
+
+    for (; n > 0 && freed < want && (page = lru_isolate(&inactive_list, &nr_inactive)) != NULL; n--) {
+        store = page->store;
+        if (page_referenced(page)) {
+            lru_putback(page, True);
+        } else if (page_evict(page)) {
+            freed++;
+        } else {
+            lru_putback(page, False);
+        }
+        sleeplock_release(&store->pgcache_lock);
+    }
+    return freed;
+}
+
+static size_t
+shrink_slab(size_t n)
+{
+    struct shrinker *shrinker;
+
+    // a reclaiming shrinker would wait on itself, and one busy shrinking is enough
+    if (sleeplock_try_acquire(&shrinker_lock) != ERR_OK) {
+        return kmalloc_reap();
+    }
+    for (Node *node = list_begin(&shrinkers); node != list_end(&shrinkers); node = list_next(node)) {
+        shrinker = list_entry(node, struct shrinker, node);
+        shrinker->scan(shrinker, n * SHRINK_RATIO);
+    }
+    sleeplock_release(&shrinker_lock);
+    return kmalloc_reap();
+}
+
+static int
+kswapd(void *aux)
+{
+    size_t freed;
+
+    for (;;) {
+        spinlock_acquire(&kswapd_lock);
+        while (!kswapd_wanted) {
+            condvar_wait(&kswapd_cv, &kswapd_lock);
+        }
+        kswapd_wanted = False;
+        spinlock_release(&kswapd_lock);
+
+        do {
+            freed = reclaim_pages(RECLAIM_BATCH);
+        } while (freed > 0 && pmem_nr_free() < pmem_wmark_high);
+        if (freed == 0) {
+            // nothing left to drop, don't spin on every allocation's wakeup
+            timer_sleep(KSWAPD_BACKOFF);
+        }
+    }
+    return 0;
+}
+
+void
+reclaim_init(void)
+{
+    struct thread *t;
+
+    spinlock_init(&lru_lock);
+    list_init(&active_list);
+    list_init(&inactive_list);
+    nr_active = 0;
+    nr_inactive = 0;
+    spinlock_init(&kswapd_lock);
+    condvar_init(&kswapd_cv);
+    kswapd_wanted = False;
+    sleeplock_init(&shrinker_lock);
+    list_init(&shrinkers);
+
+    t = thread_create("kswapd", NULL, DEFAULT_PRI);
+    kassert(t);
+    thread_start_context(t, kswapd, NULL);
+    reclaim_enabled = True;
+}
+
+void
+reclaim_add_page(struct page *page)
+{
+    kassert(page && page->store);
+    lru_putback(page, False);
+}
+
+void
+reclaim_remove_page(struct page *page)
+{
+    kassert(page);
+    spinlock_acquire(&lru_lock);
+    if (get_state_bit(page->state, PAGE_LRU_BIT)) {
+        list_remove(&page->lru_node);
+        if (get_state_bit(page->state, PAGE_ACTIVE_BIT)) {
+            nr_active--;
+        } else {
+            nr_inactive--;
+        }
+        page->state = set_state_bit(page->state, PAGE_LRU_BIT, False);
+    }
+    spinlock_release(&lru_lock);
+}
+
+void
+reclaim_mark_accessed(struct page *page)
+{
+    kassert(page);
+    spinlock_acquire(&lru_lock);
+    page->state = set_state_bit(page->state, PAGE_REFERENCED_BIT, True);
+    spinlock_release(&lru_lock);
+}
+
+void
+shrinker_register(struct shrinker *shrinker)
+{
+    kassert(shrinker && shrinker->scan);
+    sleeplock_acquire(&shrinker_lock);
+    list_append(&shrinkers, &shrinker->node);
+    sleeplock_release(&shrinker_lock);
+}
+
+void
+shrinker_unregister(struct shrinker *shrinker)
+{
+    kassert(shrinker);
+    sleeplock_acquire(&shrinker_lock);
+    list_remove(&shrinker->node);
+    sleeplock_release(&shrinker_lock);
+}
+
+void
+reclaim_wakeup(void)
+{
+    if (!reclaim_enabled) {
+        return;
+    }
+    spinlock_acquire(&kswapd_lock);
+    if (!kswapd_wanted) {
+        kswapd_wanted = True;
+        condvar_signal(&kswapd_cv);
+    }
+    spinlock_release(&kswapd_lock);
+}
+
+size_t
+reclaim_pages(size_t n)
+{
+    size_t freed = 0;
+
+    if (!reclaim_enabled) {
+        return 0;
+    }
+    // a second pass gets to the pages the first one demoted
+    for (int pass = 0; pass < 2 && freed < n; pass++) {
+        if (nr_active > nr_inactive) {
+            shrink_active(min(nr_active - nr_inactive, n * SCAN_RATIO));
+        }
+        freed += shrink_inactive(n * SCAN_RATIO, n - freed);
+    }
+    // kernel objects cached by subsystems are cheaper to rebuild than swap
+    if (freed < n) {
+        freed += shrink_slab(n - freed);
+    }
+    // the page cache is out of clean pages, move anonymous memory to swap
+    if (freed < n) {
+        freed += swap_out(n - freed);
+    }
+    return freed;
+}
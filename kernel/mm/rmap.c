@@ -1,11 +1,30 @@
 #include <kernel/rmap.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
 struct kmem_cache *rmap_allocator = NULL;
 
+/*
+ * Find where region maps the cached page, store the address in *va. Return
+ * False if the page is outside the part of the store the region maps.
+ */
+static bool region_page_vaddr(struct memregion *region, struct page *page, vaddr_t *va);
+
+static bool
+region_page_vaddr(struct memregion *region, struct page *page, vaddr_t *va)
+{
+    if (page->ofs < region->ofs || page->ofs - region->ofs >= region->store_size) {
+        return False;
+    }
+    *va = region->start + (page->ofs - region->ofs);
+    return True;
+}
+
 struct rmap*
 rmap_alloc(void)
 {
@@ -33,6 +52,7 @@ void
 rmap_construct(struct rmap *rmap)
 {
     kassert(rmap);
+    sleeplock_init(&rmap->lock);
     list_init(&rmap->regions);
 }
 
@@ -44,9 +64,83 @@ rmap_destroy(struct rmap *rmap)
     // nothing to do
 }
 
+void
+rmap_add_region(struct rmap *rmap, struct memregion *region)
+{
+    kassert(rmap && region);
+    sleeplock_acquire(&rmap->lock);
+    list_append(&rmap->regions, &region->rmap_node);
+    sleeplock_release(&rmap->lock);
+}
+
+void
+rmap_remove_region(struct rmap *rmap, struct memregion *region)
+{
+    kassert(rmap && region);
+    sleeplock_acquire(&rmap->lock);
+    list_remove(&region->rmap_node);
+    sleeplock_release(&rmap->lock);
+}
+
+bool
+rmap_referenced(struct rmap *rmap, paddr_t paddr)
+{
+    struct page *page = paddr_to_page(paddr);
+    struct memregion *r;
+    paddr_t mapped;
+    vaddr_t va;
+    int accessed;
+    bool referenced = False;
+
+    kassert(rmap);
+    sleeplock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        r = list_entry(n, struct memregion, rmap_node);
+        if (!region_page_vaddr(r, page, &va)) {
+            continue;
+        }
+        // we hold the page cache lock, which ranks below as_lock
+        if (rwsleeplock_try_acquire_write(&r->as->as_lock) != ERR_OK) {
+            referenced = True;
+            continue;
+        }
+        if (r->as->vpmap != NULL && vpmap_lookup_vaddr(r->as->vpmap, va, &mapped, NULL) == ERR_OK &&
+            mapped == paddr && vpmap_get_accessed(r->as->vpmap, va, &accessed) == ERR_OK && accessed) {
+            vpmap_clear_accessed(r->as->vpmap, va);
+            referenced = True;
+        }
+        rwsleeplock_release_write(&r->as->as_lock);
+    }
+    sleeplock_release(&rmap->lock);
+    return referenced;
+}
+
 err_t
 rmap_unmap(struct rmap *rmap, paddr_t paddr)
 {
-    // TODO
-    return ERR_OK;
+    struct page *page = paddr_to_page(paddr);
+    struct memregion *r;
+    vaddr_t va;
+    err_t err = ERR_OK;
+
+    kassert(rmap);
+    sleeplock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions) && err == ERR_OK; n = list_next(n)) {
+        r = list_entry(n, struct memregion, rmap_node);
+        if (!region_page_vaddr(r, page, &va)) {
+            continue;
+        }
+        if (rwsleeplock_try_acquire_write(&r->as->as_lock) != ERR_OK) {
+            err = ERR_LOCK_BUSY;
+            break;
+        }
+        // private copies made on write map a different page and stay. A clean
+        // page comes back from the cache on the next fault.
+        if (r->as->vpmap != NULL && vpmap_unmap_clean(r->as->vpmap, va, paddr) == ERR_VPMAP_DIRTY) {
+            err = ERR_RMAP_DIRTY;
+        }
+        rwsleeplock_release_write(&r->as->as_lock);
+    }
+    sleeplock_release(&rmap->lock);
+    return err;
 }
@@ -0,0 +1,208 @@
+#include <kernel/swap.h>
+#include <kernel/bdev.h>
+#include <kernel/bdevms.h>
+#include <kernel/memstore.h>
+#include <kernel/kmalloc.h>
+#include <kernel/pmem.h>
+#include <kernel/proc.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
+#include <kernel/synch.h>
+#include <kernel/console.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+/*
+ * The swap area sits on the root disk past the end of the file system, at
+ * SWAP_START_BLK set in the Makefile next to the fs.img rule that makes room
+ * for it. Slot s covers the page sized run of blocks at
+ * SWAP_START_BLK + s * SWAP_SLOT_BLKS.
+ */
+#define SWAP_NSLOTS     1024
+#define SWAP_SLOT_BLKS  (pg_size / BDEV_BLK_SIZE)
+
+// processes swap_out tries before giving up
+#define SWAP_OUT_PROCS  8
+// pages swap_out may scan in a process for each page it is asked to free
+#define SWAP_SCAN_RATIO 4
+
+#define SWAPID_SLOT(swapid) ((swapid) - 1)
+#define SLOT_SWAPID(slot) ((swapid_t)(slot) + 1)
+
+struct swap_info {
+    struct bdev *bdev;
+    blk_t start_blk;
+};
+
+static struct memstore *swap_store;
+static struct swap_info swap_info;
+
+// Protects slot reference counts and the allocation hint
+static struct spinlock swap_lock;
+static uint16_t *slot_ref;
+static size_t next_slot;
+static size_t nr_free_slots;
+
+// Where swap_out picks its next victim
+static pid_t swap_out_pid;
+
+/*
+ * Swap memstore fillpage function.
+ */
+static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
+
+/*
+ * Swap memstore write function.
+ */
+static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
+
+static err_t
+fillpage(struct memstore *store, offset_t ofs, struct page *page)
+{
+    struct swap_info *info;
+    err_t err;
+
+    kassert(store && store->info);
+    kassert(page);
+    info = (struct swap_info*)store->info;
+    err = bdevms_page_io(info->bdev, info->start_blk + ofs / BDEV_BLK_SIZE, page_to_paddr(page), BIO_READ);
+    if (err != ERR_OK) {
+        return err == ERR_NOMEM ? ERR_MEMSTORE_NOMEM : ERR_MEMSTORE_IO;
+    }
+    return ERR_OK;
+}
+
+static err_t
+write(struct memstore *store, paddr_t paddr, offset_t ofs)
+{
+    struct swap_info *info;
+    err_t err;
+
+    kassert(store && store->info);
+    info = (struct swap_info*)store->info;
+    err = bdevms_page_io(info->bdev, info->start_blk + ofs / BDEV_BLK_SIZE, paddr, BIO_WRITE);
+    if (err != ERR_OK) {
+        return err == ERR_NOMEM ? ERR_MEMSTORE_NOMEM : ERR_MEMSTORE_IO;
+    }
+    return ERR_OK;
+}
+
+void
+swap_init(struct bdev *bdev)
+{
+    kassert(bdev);
+    spinlock_init(&swap_lock);
+    if ((slot_ref = kmalloc(SWAP_NSLOTS * sizeof(*slot_ref))) == NULL) {
+        kprintf("swap: failed to allocate slot table, swap disabled\n");
+        return;
+    }
+    if ((swap_store = memstore_alloc()) == NULL) {
+        kfree(slot_ref);
+        slot_ref = NULL;
+        kprintf("swap: failed to allocate memstore, swap disabled\n");
+        return;
+    }
+    memset(slot_ref, 0, SWAP_NSLOTS * sizeof(*slot_ref));
+    swap_info.bdev = bdev;
+    swap_info.start_blk = SWAP_START_BLK;
+    // swapped pages are anonymous memory, never cached or reclaimed by store
+    swap_store->info = &swap_info;
+    swap_store->fillpage = fillpage;
+    swap_store->write = write;
+    next_slot = 0;
+    swap_out_pid = 0;
+    spinlock_acquire(&swap_lock);
+    nr_free_slots = SWAP_NSLOTS;
+    spinlock_release(&swap_lock);
+}
+
+err_t
+swap_alloc(swapid_t *swapid)
+{
+    size_t slot;
+
+    kassert(swapid);
+    spinlock_acquire(&swap_lock);
+    if (slot_ref == NULL || nr_free_slots == 0) {
+        spinlock_release(&swap_lock);
+        return ERR_NOMEM;
+    }
+    // next fit, slots freed behind the hint are found after wrapping
+    for (slot = next_slot; slot_ref[slot] != 0; slot = (slot + 1) % SWAP_NSLOTS);
+    slot_ref[slot] = 1;
+    nr_free_slots--;
+    next_slot = (slot + 1) % SWAP_NSLOTS;
+    spinlock_release(&swap_lock);
+    *swapid = SLOT_SWAPID(slot);
+    return ERR_OK;
+}
+
+void
+swap_dup(swapid_t swapid)
+{
+    kassert(swapid != SWAPID_NONE && SWAPID_SLOT(swapid) < SWAP_NSLOTS);
+    spinlock_acquire(&swap_lock);
+    kassert(slot_ref[SWAPID_SLOT(swapid)] > 0);
+    slot_ref[SWAPID_SLOT(swapid)]++;
+    spinlock_release(&swap_lock);
+}
+
+void
+swap_free(swapid_t swapid)
+{
+    kassert(swapid != SWAPID_NONE && SWAPID_SLOT(swapid) < SWAP_NSLOTS);
+    spinlock_acquire(&swap_lock);
+    kassert(slot_ref[SWAPID_SLOT(swapid)] > 0);
+    if (--slot_ref[SWAPID_SLOT(swapid)] == 0) {
+        nr_free_slots++;
+    }
+    spinlock_release(&swap_lock);
+}
+
+err_t
+swap_write(swapid_t swapid, paddr_t paddr)
+{
+    err_t err;
+
+    kassert(swapid != SWAPID_NONE && SWAPID_SLOT(swapid) < SWAP_NSLOTS);
+    err = swap_store->write(swap_store, paddr, (offset_t)SWAPID_SLOT(swapid) * pg_size);
+    if (err != ERR_OK) {
+        return err == ERR_MEMSTORE_NOMEM ? ERR_NOMEM : ERR_FAULT;
+    }
+    return ERR_OK;
+}
+
+err_t
+swap_read(swapid_t swapid, paddr_t paddr)
+{
+    err_t err;
+
+    kassert(swapid != SWAPID_NONE && SWAPID_SLOT(swapid) < SWAP_NSLOTS);
+    err = swap_store->fillpage(swap_store, (offset_t)SWAPID_SLOT(swapid) * pg_size, paddr_to_page(paddr));
+    if (err != ERR_OK) {
+        return err == ERR_MEMSTORE_NOMEM ? ERR_NOMEM : ERR_FAULT;
+    }
+    return ERR_OK;
+}
+
+size_t
+swap_out(size_t n)
+{
+    struct proc *p;
+    size_t freed = 0;
+
+    if (slot_ref == NULL) {
+        return 0;
+    }
+    // round robin over processes, each resumes its own clock hand
+    for (int i = 0; i < SWAP_OUT_PROCS && freed < n; i++) {
+        if ((p = proc_lock_next_as(swap_out_pid)) == NULL) {
+            break;
+        }
+        swap_out_pid = p->pid;
+        freed += as_swap_out(&p->as, n - freed, (n - freed) * SWAP_SCAN_RATIO);
+        rwsleeplock_release_write(&p->as.as_lock);
+    }
+    return freed;
+}
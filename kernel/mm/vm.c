@@ -6,6 +6,8 @@
 #include <kernel/thread.h>
 #include <kernel/proc.h>
 #include <kernel/memstore.h>
+#include <kernel/pgcache.h>
+#include <kernel/swap.h>
 #include <kernel/list.h>
 #include <lib/errcode.h>
 #include <arch/mmu.h>
@@ -27,19 +29,79 @@ struct vpmap *kvpmap = &_kvpmap;
 /* Initialize the kernel address space, only called once */
 static void kas_init(void);
 
-/* memregion comparator used to keep memregion in order by their addresses */
-static int memregion_comparator(const Node *a, const Node *b, void *aux);
+// Fault-around maps at most this many pages past a fault
+#define FAULT_AROUND_MAX    16
+#define FAULT_AROUND_INIT   2
+
+/* Pages mapped ahead by fault-around, and how many of them got used */
+size_t faultaround_mapped = 0;
+size_t faultaround_hits = 0;
+
+/*
+ * Fault-around for the page at va of region, see as_fault_around. Caller must
+ * hold as_lock of region->as for writing, or for reading along with pt_lock.
+ */
+static void memregion_fault_around_internal(struct memregion *region, vaddr_t va);
+
+/*
+ * Map the page at va of region ahead of a fault if that needs neither I/O nor
+ * memory the system is short of. Return ERR_OK if it was mapped.
+ */
+static err_t memregion_map_ahead_internal(struct memregion *region, vaddr_t va);
+
+/* Source of addrspace region_seq values, never handed out twice */
+static uint64_t region_seq_next;
+
+/*
+ * Each addrspace keeps its memregions in an AVL tree keyed by start address,
+ * next to the ordered list used for walking them. Every node also tracks the
+ * address range its subtree spans and the largest hole between memregions in
+ * it, so find_free_vaddr can skip subtrees with no room. A thread remembers
+ * the memregion it last found, valid while its addrspace's region_seq stays
+ * the same.
+ */
+
+/* Recompute the height and subtree fields of r from its children */
+static void region_tree_update(struct memregion *r);
+
+/* Insert r into, remove r from the tree rooted at root, return the new root */
+static struct memregion *region_tree_insert(struct memregion *root, struct memregion *r);
+static struct memregion *region_tree_remove(struct memregion *root, struct memregion *r);
+
+/* Refresh the subtree fields on the path to r after r's end changed */
+static void region_tree_refresh(struct memregion *root, struct memregion *r);
+
+/* Return the memregion of as with the highest start at or below addr */
+static struct memregion *region_tree_floor(struct addrspace *as, vaddr_t addr);
+
+/* Return a memregion of as overlapping [start, end), NULL if none */
+static struct memregion *memregion_overlap_internal(struct addrspace *as, vaddr_t start, vaddr_t end);
 
 static void memregion_unmap_internal(struct memregion *region);
 
 static struct memregion *memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size,
                                                 memperm_t perm, struct memstore *store, offset_t ofs, int shared);
 
+/*
+ * Write dirty pages of a shared, writable memregion in [start, end) back to
+ * its memstore. Lock for region->as must be held.
+ */
+static err_t memregion_sync_internal(struct memregion *region, vaddr_t start, vaddr_t end);
 static struct memregion *memregion_copy_internal(struct addrspace *as,
                                                  struct memregion *src, vaddr_t addr);
 
 static struct memregion *memregion_find_internal(struct addrspace *as, vaddr_t addr, size_t size);
 
+/* Return the first memregion of as that ends above addr, NULL if none */
+static struct memregion *memregion_next_internal(struct addrspace *as, vaddr_t addr);
+
+/*
+ * Move the page at va of a private region, mapped only there, to swap.
+ * Return ERR_NOMEM if swap is full, ERR_VM_INVALID if the page can't be
+ * swapped, ERR_FAULT on I/O errors. Lock for region->as must be held.
+ */
+static err_t memregion_swap_out_internal(struct memregion *region, vaddr_t va, paddr_t paddr);
+
 /* find free memory addresses of size ``size`` starting at *ret_addr */
 static err_t find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr);
 
@@ -53,8 +115,11 @@ static char *perm_strings[] = {
 static void
 kas_init(void)
 {
-    sleeplock_init(&kas->as_lock);
+    rwsleeplock_init(&kas->as_lock);
+    sleeplock_init(&kas->pt_lock);
     list_init(&kas->regions);
+    kas->region_tree = NULL;
+    kas->region_seq = __sync_add_and_fetch(&region_seq_next, 1);
     kas->vpmap = kvpmap;
 }
 
@@ -77,13 +142,17 @@ void vm_init(void)
 err_t as_init(struct addrspace *as)
 {
     kassert(as);
-    sleeplock_init(&as->as_lock);
+    rwsleeplock_init(&as->as_lock);
+    sleeplock_init(&as->pt_lock);
     list_init(&as->regions);
+    as->region_tree = NULL;
+    as->region_seq = __sync_add_and_fetch(&region_seq_next, 1);
     if ((as->vpmap = vpmap_create()) == NULL)
     {
         return ERR_VM_RESOURCE_UNAVAIL;
     }
     as->heap = NULL;
+    as->swap_hand = 0;
     // maybe we should copy in kvm here, every as starts implictly with kas
     // NOTE: temp hack, go through kas and copy all region
     return vpmap_copy_kernel_mapping(as->vpmap);
@@ -93,7 +162,13 @@ void as_destroy(struct addrspace *as)
 {
     kassert(as);
     kassert(as != kas); // Cannot destroy kernel address space
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_write(&as->as_lock);
+    // write back shared file mappings while their page tables still exist
+    for (Node *n = list_begin(&as->regions); n != list_end(&as->regions); n = list_next(n))
+    {
+        struct memregion *region = (struct memregion *)list_entry(n, struct memregion, as_node);
+        memregion_sync_internal(region, region->start, region->end);
+    }
     vpmap_destroy(as->vpmap);
     as->vpmap = NULL; // make sure memregion_unmap won't walk page tables
 
@@ -104,7 +179,7 @@ void as_destroy(struct addrspace *as)
         n = list_next(n);
         memregion_unmap_internal(region);
     }
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_write(&as->as_lock);
 }
 
 err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as)
@@ -114,11 +189,11 @@ err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as)
     err_t err = ERR_OK;
 
     // grab both locks before we move on
-    sleeplock_acquire(&src_as->as_lock);
-    while (sleeplock_try_acquire(&dst_as->as_lock) != ERR_OK)
+    rwsleeplock_acquire_write(&src_as->as_lock);
+    while (rwsleeplock_try_acquire_write(&dst_as->as_lock) != ERR_OK)
     {
-        sleeplock_release(&src_as->as_lock);
-        sleeplock_acquire(&src_as->as_lock);
+        rwsleeplock_release_write(&src_as->as_lock);
+        rwsleeplock_acquire_write(&src_as->as_lock);
     }
 
     // go through all src regions and copy them
@@ -137,8 +212,256 @@ err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as)
             dst_as->heap = dst_r;
         }
     }
-    sleeplock_release(&src_as->as_lock);
-    sleeplock_release(&dst_as->as_lock);
+    rwsleeplock_release_write(&src_as->as_lock);
+    rwsleeplock_release_write(&dst_as->as_lock);
+    return err;
+}
+
+err_t as_fill_page(struct addrspace *as, vaddr_t addr, int write)
+{
+    kassert(as);
+    struct memregion *r;
+    struct page *page = NULL;
+    paddr_t paddr;
+    vaddr_t va = pg_round_down(addr);
+    size_t avail = 0;
+    swapid_t swapid, cur;
+    memperm_t perm;
+    bool mapped = False;
+    err_t err = ERR_OK;
+
+    // Faults on other pages, and their I/O, go on meanwhile. The page is read
+    // first, then mapped under pt_lock if no other thread has mapped it since.
+    rwsleeplock_acquire_read(&as->as_lock);
+    if ((r = memregion_find_internal(as, addr, 1)) == NULL)
+    {
+        err = ERR_VM_INVALID;
+        goto done;
+    }
+    if (vpmap_lookup_vaddr(as->vpmap, va, NULL, &swapid) == ERR_OK)
+    {
+        // another thread filled it while we waited for the lock
+        goto done;
+    }
+    perm = r->perm;
+    if (swapid != SWAPID_NONE)
+    {
+        if (pmem_alloc(&paddr) != ERR_OK)
+        {
+            err = ERR_NOMEM;
+        }
+        else if ((err = swap_read(swapid, paddr)) != ERR_OK)
+        {
+            // the page would hold whatever the failed read left in it
+            pmem_free(paddr);
+        }
+    }
+    else if (r == as->heap)
+    {
+        err = ERR_VM_INVALID;
+    }
+    else if (r->store == NULL)
+    {
+        // private anonymous memory
+        if (pmem_alloc_zeroed(&paddr) != ERR_OK)
+        {
+            err = ERR_NOMEM;
+        }
+    }
+    else
+    {
+        if (va - r->start < r->store_size)
+        {
+            avail = min(r->store_size - (va - r->start), pg_size);
+        }
+        sleeplock_acquire(&r->store->pgcache_lock);
+        if (avail > 0 && (page = pgcache_get_page(r->store, r->ofs + (va - r->start))) == NULL)
+        {
+            err = ERR_FAULT;
+        }
+        else if (avail == pg_size && (r->shared || r->perm != MEMPERM_URW || !write))
+        {
+            // map the cached page, a private writable region copies it on
+            // write. Eviction can't take it from under the mapping, it needs
+            // as_lock for writing.
+            perm = (r->shared || r->perm != MEMPERM_URW) ? r->perm : MEMPERM_UR;
+            paddr = page_to_paddr(page);
+            pmem_inc_refcnt(paddr, 1);
+        }
+        else if (pmem_alloc_zeroed(&paddr) != ERR_OK)
+        {
+            err = ERR_NOMEM;
+        }
+        else if (avail > 0)
+        {
+            // private copy of the part backed by the store, zeros after it
+            memcpy((void *)kmap_p2v(paddr), (void *)kmap_p2v(page_to_paddr(page)), avail);
+        }
+        sleeplock_release(&r->store->pgcache_lock);
+    }
+    if (err != ERR_OK)
+    {
+        goto done;
+    }
+
+    sleeplock_acquire(&as->pt_lock);
+    // the entry must still be what it was when we looked before reading the page
+    if (vpmap_lookup_vaddr(as->vpmap, va, NULL, &cur) != ERR_OK && cur == swapid)
+    {
+        if (vpmap_map(as->vpmap, va, paddr, 1, perm) != ERR_OK)
+        {
+            err = ERR_NOMEM;
+        }
+        else if (swapid != SWAPID_NONE)
+        {
+            mapped = True;
+            swap_free(swapid);
+        }
+        else
+        {
+            mapped = True;
+            memregion_fault_around_internal(r, va);
+        }
+    }
+    sleeplock_release(&as->pt_lock);
+    if (!mapped)
+    {
+        pmem_dec_refcnt(paddr);
+    }
+done:
+    rwsleeplock_release_read(&as->as_lock);
+    return err;
+}
+
+void as_fault_around(struct addrspace *as, vaddr_t addr)
+{
+    kassert(as);
+    struct memregion *r;
+
+    rwsleeplock_acquire_read(&as->as_lock);
+    if ((r = memregion_find_internal(as, addr, 1)) != NULL)
+    {
+        sleeplock_acquire(&as->pt_lock);
+        memregion_fault_around_internal(r, pg_round_down(addr));
+        sleeplock_release(&as->pt_lock);
+    }
+    rwsleeplock_release_read(&as->as_lock);
+}
+
+err_t as_resolve_cow(struct addrspace *as, vaddr_t addr)
+{
+    kassert(as);
+    struct memregion *r;
+    err_t err = ERR_VM_INVALID;
+
+    rwsleeplock_acquire_read(&as->as_lock);
+    r = memregion_find_internal(as, addr, 1);
+    if (r != NULL && r->perm == MEMPERM_URW && !r->shared)
+    {
+        // vpmap_cow rechecks the entry, so threads faulting on the same page
+        // copy it only once
+        sleeplock_acquire(&as->pt_lock);
+        err = vpmap_cow(as->vpmap, addr, r->perm);
+        sleeplock_release(&as->pt_lock);
+        if (err == ERR_VPMAP_NOTPRESENT)
+        {
+            err = ERR_VM_INVALID;
+        }
+    }
+    rwsleeplock_release_read(&as->as_lock);
+    return err;
+}
+
+size_t as_swap_out(struct addrspace *as, size_t n, size_t scan)
+{
+    kassert(as);
+    kassert(as->as_lock.holder == thread_current());
+    struct memregion *r;
+    vaddr_t va;
+    paddr_t paddr;
+    int accessed;
+    bool wrapped = False;
+    size_t freed = 0;
+
+    while (scan > 0 && freed < n)
+    {
+        if ((r = memregion_next_internal(as, as->swap_hand)) == NULL)
+        {
+            // back to the lowest region, once
+            if (wrapped)
+            {
+                break;
+            }
+            wrapped = True;
+            as->swap_hand = 0;
+            continue;
+        }
+        if (r->shared)
+        {
+            // shared pages live in the store's page cache
+            as->swap_hand = pg_round_up(r->end);
+            continue;
+        }
+        va = max(pg_round_down(as->swap_hand), r->start);
+        as->swap_hand = va + pg_size;
+        scan--;
+        // cached file pages and pages shared since fork have other references
+        if (vpmap_lookup_vaddr(as->vpmap, va, &paddr, NULL) != ERR_OK || pmem_get_refcnt(paddr) != 1)
+        {
+            continue;
+        }
+        // clock: an accessed page gets until the next round
+        if (vpmap_get_accessed(as->vpmap, va, &accessed) == ERR_OK && accessed)
+        {
+            vpmap_clear_accessed(as->vpmap, va);
+            continue;
+        }
+        switch (memregion_swap_out_internal(r, va, paddr))
+        {
+        case ERR_OK:
+            freed++;
+            break;
+        case ERR_NOMEM:
+            return freed;
+        }
+    }
+    return freed;
+}
+
+err_t as_unmap_memregion(struct addrspace *as, vaddr_t addr, size_t size)
+{
+    kassert(as);
+    struct memregion *r;
+    err_t err = ERR_VM_INVALID;
+
+    rwsleeplock_acquire_write(&as->as_lock);
+    r = memregion_find_internal(as, addr, 1);
+    if (r != NULL && r != as->heap && r->start == addr && size > 0 &&
+        pg_round_up(size) == pg_round_up(r->end - r->start))
+    {
+        memregion_unmap_internal(r);
+        err = ERR_OK;
+    }
+    rwsleeplock_release_write(&as->as_lock);
+    return err;
+}
+
+err_t as_sync_memregion(struct addrspace *as, vaddr_t addr, size_t size)
+{
+    kassert(as);
+    struct memregion *r;
+    err_t err = ERR_VM_INVALID;
+
+    if (size == 0 || addr + size < addr)
+    {
+        return ERR_VM_INVALID;
+    }
+    rwsleeplock_acquire_write(&as->as_lock);
+    if ((r = memregion_find_internal(as, addr, size)) != NULL)
+    {
+        err = memregion_sync_internal(r, addr, addr + size);
+    }
+    rwsleeplock_release_write(&as->as_lock);
     return err;
 }
 
@@ -149,9 +472,9 @@ as_map_memregion(struct addrspace *as, vaddr_t addr, size_t size, memperm_t perm
     kassert(as);
     struct memregion *r;
 
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_write(&as->as_lock);
     r = memregion_map_internal(as, addr, size, perm, store, ofs, shared);
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_write(&as->as_lock);
     return r;
 }
 
@@ -165,9 +488,9 @@ as_find_memregion(struct addrspace *as, vaddr_t addr, size_t size)
     {
         return NULL;
     }
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_read(&as->as_lock);
     r = memregion_find_internal(as, addr, size);
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_read(&as->as_lock);
     return r;
 }
 
@@ -181,36 +504,36 @@ as_copy_memregion(struct addrspace *as, struct memregion *src, vaddr_t addr)
     kassert(pg_aligned(addr));
 
     // grab both locks before we move on
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_write(&as->as_lock);
     if (as != src->as)
     {
-        while (sleeplock_try_acquire(&src->as->as_lock) != ERR_OK)
+        while (rwsleeplock_try_acquire_write(&src->as->as_lock) != ERR_OK)
         {
-            sleeplock_release(&as->as_lock);
-            sleeplock_acquire(&as->as_lock);
+            rwsleeplock_release_write(&as->as_lock);
+            rwsleeplock_acquire_write(&as->as_lock);
         }
     }
 
     dst = memregion_copy_internal(as, src, addr);
 
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_write(&as->as_lock);
     if (as != src->as)
     {
-        sleeplock_release(&src->as->as_lock);
+        rwsleeplock_release_write(&src->as->as_lock);
     }
     return dst;
 }
 
 void as_meminfo(struct addrspace *as)
 {
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_read(&as->as_lock);
     List *list = &as->regions;
     for (Node *n = list_begin(list); n != list_end(list); n = list_next(n))
     {
         struct memregion *r = (struct memregion *)list_entry(n, struct memregion, as_node);
         kprintf("[%p - %p] %s | shared: %d \n", r->start, r->end, perm_strings[r->perm], r->shared);
     }
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_read(&as->as_lock);
 }
 
 static inline int isprint(int c) { return c >= 32 && c < 127; }
@@ -221,7 +544,7 @@ void as_dump(struct addrspace *as, vaddr_t vaddr)
     size_t *data;
     struct memregion *region;
 
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_read(&as->as_lock);
     List *list = &as->regions;
     for (Node *n = list_begin(list); n != list_end(list); n = list_next(n))
     {
@@ -231,7 +554,7 @@ void as_dump(struct addrspace *as, vaddr_t vaddr)
             goto found;
         }
     }
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_read(&as->as_lock);
     kprintf("memregion containing addr %p is not found\n", vaddr);
     return;
 found:
@@ -241,7 +564,7 @@ found:
         // dumped memregion must be mapped
         if (vpmap_lookup_vaddr(as->vpmap, vaddr, &paddr, NULL) != ERR_OK)
         {
-            sleeplock_release(&as->as_lock);
+            rwsleeplock_release_read(&as->as_lock);
             kprintf("stoping at %p because address not currently mapped in memory\n", vaddr);
             return;
         }
@@ -262,7 +585,7 @@ found:
             vaddr += sizeof(*data);
         }
     }
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_read(&as->as_lock);
 }
 
 err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_bound)
@@ -274,7 +597,9 @@ err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_boun
         return ERR_OK;
     }
 
+    struct addrspace *as = region->as;
     vaddr_t new_end = region->end + size;
+    Node *next;
 
     // Check for negative-sized regions after extension.
     if (region->end + size < region->start)
@@ -283,38 +608,29 @@ err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_boun
         return ERR_VM_INVALID;
     }
 
-    struct proc *current_process = proc_current();
-    kassert(current_process);
-
-    // Go through all regions
-    for (Node *n = list_begin(&current_process->as.regions); n != list_end(&current_process->as.regions); n = list_next(n))
+    rwsleeplock_acquire_write(&as->as_lock);
+    // Regions are ordered, only the next one can be in the way
+    next = list_next(&region->as_node);
+    if (next != list_end(&as->regions) && list_entry(next, struct memregion, as_node)->start < new_end)
     {
-        // kprintf("In the loop\n");
-        struct memregion *current_region = list_entry(n, struct memregion, as_node);
-
-        // Skip the region being checked
-        if (current_region == region)
-            continue;
-
-        // Check for overlap
-        if ((current_region->start < new_end && current_region->start >= region->start) ||
-            (region->start < current_region->end && region->start >= current_region->start))
-        {
-            // spinlock_release(&current_process->as.as_lock);
-            return ERR_VM_BOUND;
-        }
+        rwsleeplock_release_write(&as->as_lock);
+        return ERR_VM_BOUND;
     }
 
     // Save old_bound
     *old_bound = region->end;
     // Adjust the region size
-    region->end += size;      
+    region->end += size;
+    region_tree_refresh(as->region_tree, region);
+    rwsleeplock_release_write(&as->as_lock);
 
     return ERR_OK;
 }
 
 err_t memregion_set_perm(struct memregion *region, memperm_t perm)
 {
+    err_t err;
+
     kassert(region);
     // User address space cannot have kernel permissions
     if (is_kern_memperm(perm) && region->as != kas)
@@ -322,30 +638,249 @@ err_t memregion_set_perm(struct memregion *region, memperm_t perm)
         return ERR_VM_INVALID;
     }
 
-    sleeplock_acquire(&region->as->as_lock);
+    rwsleeplock_acquire_write(&region->as->as_lock);
     // Update memory mappings
-    vpmap_set_perm(region->as->vpmap, region->start, pg_round_up(region->end - region->start) / pg_size, perm);
+    size_t npages = pg_round_up(region->end - region->start) / pg_size;
+    if ((err = vpmap_set_perm(region->as->vpmap, region->start, npages, perm)) != ERR_OK)
+    {
+        // put back the pages changed before the failure, it stops at the same spot
+        vpmap_set_perm(region->as->vpmap, region->start, npages, region->perm);
+        rwsleeplock_release_write(&region->as->as_lock);
+        return err;
+    }
     region->perm = perm;
-    vpmap_flush_tlb();
-    sleeplock_release(&region->as->as_lock);
+    rwsleeplock_release_write(&region->as->as_lock);
     return ERR_OK;
 }
 
 void memregion_unmap(struct memregion *region)
 {
     struct addrspace *as = region->as;
-    sleeplock_acquire(&as->as_lock);
+    rwsleeplock_acquire_write(&as->as_lock);
     memregion_unmap_internal(region);
-    sleeplock_release(&as->as_lock);
+    rwsleeplock_release_write(&as->as_lock);
+}
+
+/* End of the range r occupies, an empty memregion still claims its start */
+static inline vaddr_t
+region_limit(struct memregion *r)
+{
+    return r->end > r->start ? pg_round_up(r->end) : r->start + 1;
+}
+
+static inline int
+region_height(struct memregion *r)
+{
+    return r ? r->height : 0;
+}
+
+static void
+region_tree_update(struct memregion *r)
+{
+    struct memregion *left = r->left, *right = r->right;
+    size_t gap = 0;
+
+    r->height = 1 + max(region_height(left), region_height(right));
+    r->subtree_start = left ? left->subtree_start : r->start;
+    r->subtree_end = right ? right->subtree_end : region_limit(r);
+    if (left)
+    {
+        gap = max(left->subtree_gap, r->start - left->subtree_end);
+    }
+    if (right)
+    {
+        gap = max(gap, right->subtree_gap);
+        gap = max(gap, right->subtree_start - region_limit(r));
+    }
+    r->subtree_gap = gap;
+}
+
+static struct memregion *
+region_rotate_left(struct memregion *r)
+{
+    struct memregion *right = r->right;
+
+    r->right = right->left;
+    right->left = r;
+    region_tree_update(r);
+    region_tree_update(right);
+    return right;
+}
+
+static struct memregion *
+region_rotate_right(struct memregion *r)
+{
+    struct memregion *left = r->left;
+
+    r->left = left->right;
+    left->right = r;
+    region_tree_update(r);
+    region_tree_update(left);
+    return left;
+}
+
+/* Restore the AVL property at r once its subtrees are balanced */
+static struct memregion *
+region_tree_balance(struct memregion *r)
+{
+    int balance;
+
+    region_tree_update(r);
+    balance = region_height(r->left) - region_height(r->right);
+    if (balance > 1)
+    {
+        if (region_height(r->left->left) < region_height(r->left->right))
+        {
+            r->left = region_rotate_left(r->left);
+        }
+        return region_rotate_right(r);
+    }
+    if (balance < -1)
+    {
+        if (region_height(r->right->right) < region_height(r->right->left))
+        {
+            r->right = region_rotate_right(r->right);
+        }
+        return region_rotate_left(r);
+    }
+    return r;
 }
 
-static int
-memregion_comparator(const Node *a, const Node *b, void *aux)
+static struct memregion *
+region_tree_insert(struct memregion *root, struct memregion *r)
 {
-    struct memregion *mr_a = list_entry(a, struct memregion, as_node);
-    struct memregion *mr_b = list_entry(b, struct memregion, as_node);
-    // if a and b's memregion is consecutive, we want a after b in the list, +1 bumps 0 to postivie
-    return mr_a->start >= mr_b->end;
+    if (root == NULL)
+    {
+        r->left = r->right = NULL;
+        region_tree_update(r);
+        return r;
+    }
+    if (r->start < root->start)
+    {
+        root->left = region_tree_insert(root->left, r);
+    }
+    else
+    {
+        root->right = region_tree_insert(root->right, r);
+    }
+    return region_tree_balance(root);
+}
+
+/* Detach the lowest memregion of root into *min, return the new root */
+static struct memregion *
+region_tree_remove_min(struct memregion *root, struct memregion **min)
+{
+    if (root->left == NULL)
+    {
+        *min = root;
+        return root->right;
+    }
+    root->left = region_tree_remove_min(root->left, min);
+    return region_tree_balance(root);
+}
+
+static struct memregion *
+region_tree_remove(struct memregion *root, struct memregion *r)
+{
+    struct memregion *min, *right;
+
+    kassert(root);
+    if (r->start < root->start)
+    {
+        root->left = region_tree_remove(root->left, r);
+    }
+    else if (r->start > root->start)
+    {
+        root->right = region_tree_remove(root->right, r);
+    }
+    else
+    {
+        kassert(root == r);
+        if (r->right == NULL)
+        {
+            return r->left;
+        }
+        // the next memregion takes r's place
+        right = region_tree_remove_min(r->right, &min);
+        min->right = right;
+        min->left = r->left;
+        return region_tree_balance(min);
+    }
+    return region_tree_balance(root);
+}
+
+static void
+region_tree_refresh(struct memregion *root, struct memregion *r)
+{
+    kassert(root);
+    if (r->start < root->start)
+    {
+        region_tree_refresh(root->left, r);
+    }
+    else if (r->start > root->start)
+    {
+        region_tree_refresh(root->right, r);
+    }
+    region_tree_update(root);
+}
+
+static struct memregion *
+region_tree_floor(struct addrspace *as, vaddr_t addr)
+{
+    struct memregion *n = as->region_tree, *found = NULL;
+
+    while (n != NULL)
+    {
+        if (n->start <= addr)
+        {
+            found = n;
+            n = n->right;
+        }
+        else
+        {
+            n = n->left;
+        }
+    }
+    return found;
+}
+
+/*
+ * If the hole [lo, hi) clipped at top has room for size bytes, store the
+ * highest address that fits in *ret_addr and return True.
+ */
+static bool
+gap_fit(vaddr_t lo, vaddr_t hi, vaddr_t top, size_t size, vaddr_t *ret_addr)
+{
+    hi = min(hi, top);
+    if (hi > lo && hi - lo >= size)
+    {
+        *ret_addr = hi - size;
+        return True;
+    }
+    return False;
+}
+
+/* Find the highest hole between memregions of the subtree r that fits */
+static bool
+gap_search(struct memregion *r, vaddr_t top, size_t size, vaddr_t *ret_addr)
+{
+    if (r == NULL || r->subtree_gap < size || r->subtree_start >= top)
+    {
+        return False;
+    }
+    if (gap_search(r->right, top, size, ret_addr))
+    {
+        return True;
+    }
+    if (r->right && gap_fit(region_limit(r), r->right->subtree_start, top, size, ret_addr))
+    {
+        return True;
+    }
+    if (r->left && gap_fit(r->left->subtree_end, r->start, top, size, ret_addr))
+    {
+        return True;
+    }
+    return gap_search(r->left, top, size, ret_addr);
 }
 
 static err_t
@@ -355,29 +890,20 @@ find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr)
     kassert(ret_addr);
     kassert(as->as_lock.holder == thread_current());
 
-    List *list = &as->regions;
-    // start looking at first memregion address if exists
-    vaddr_t addr = 0;
-    if (!list_empty(list))
-    {
-        addr = ((struct memregion *)list_entry(list_begin(list), struct memregion, as_node))->end;
-    }
+    struct memregion *root = as->region_tree;
+    vaddr_t top = USTACK_UPPERBOUND;
+    size = pg_round_up(size);
 
-    // memregion address goes up, only need to check if end is smaller than the start
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n))
+    // allocate from the top of the user address space down, so the space
+    // above the heap stays free for it to grow into
+    if (root == NULL)
     {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
-        if (pg_round_up(addr + size) < r->start)
-        {
-            *ret_addr = addr;
-            return ERR_OK;
-        }
-        addr = pg_round_up(r->end);
+        return gap_fit(0, top, top, size, ret_addr) ? ERR_OK : !ERR_OK;
     }
-    // check address space after the last memregion allocated
-    if (pg_round_up(addr + size) < USTACK_LOWERBOUND - size)
+    if (gap_fit(root->subtree_end, top, top, size, ret_addr) ||
+        gap_search(root, top, size, ret_addr) ||
+        gap_fit(0, root->subtree_start, top, size, ret_addr))
     {
-        *ret_addr = addr;
         return ERR_OK;
     }
 
@@ -390,12 +916,24 @@ memregion_unmap_internal(struct memregion *region)
     kassert(region);
     kassert(region->as->as_lock.holder == thread_current());
 
+    // Writes to a shared file mapping must not be lost
+    memregion_sync_internal(region, region->start, region->end);
     // Remove all memory mappings
     vpmap_unmap(region->as->vpmap, region->start,
                 pg_round_up(region->end - region->start) / pg_size, 1);
-    // Detach from address space
+    // Detach from address space and memstore's reverse mapping
     list_remove(&region->as_node);
-    vpmap_flush_tlb();
+    region->as->region_tree = region_tree_remove(region->as->region_tree, region);
+    // forget it in every thread's region cache
+    region->as->region_seq = __sync_add_and_fetch(&region_seq_next, 1);
+    if (region->store)
+    {
+        rmap_remove_region(&region->store->rmap, region);
+        if (region->store->put)
+        {
+            region->store->put(region->store);
+        }
+    }
     kmem_cache_free(memregion_allocator, region);
 }
 
@@ -406,7 +944,7 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
     kassert(as);
     kassert(as->as_lock.holder == thread_current());
 
-    struct memregion *r;
+    struct memregion *r, *next;
     if (addr == ADDR_ANYWHERE && find_free_vaddr(as, size, &addr) != ERR_OK)
     {
         return NULL;
@@ -420,7 +958,7 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
         return NULL;
     }
     // Fail if any address in the range overlaps with an existing region
-    if (memregion_find_internal(as, addr, addr + size))
+    if (memregion_overlap_internal(as, addr, max(pg_round_up(addr + size), addr + 1)))
     {
         return NULL;
     }
@@ -430,9 +968,6 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
         return NULL;
     }
 
-    // Link into address space's region list and memstore's reverse mapping
-    list_append_ordered(&as->regions, &r->as_node, memregion_comparator, NULL);
-
     r->as = as;
     r->start = addr;
     r->end = addr + size;
@@ -440,6 +975,22 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
     r->shared = shared;
     r->store = store;
     r->ofs = ofs;
+    r->store_size = size;
+    r->fa_window = FAULT_AROUND_INIT;
+    r->fa_start = r->fa_end = 0;
+    // Link into address space's region list and tree, and memstore's reverse
+    // mapping. The list stays ordered by going in front of the next region.
+    next = memregion_next_internal(as, addr);
+    list_insert(next ? &next->as_node : list_end(&as->regions), &r->as_node);
+    as->region_tree = region_tree_insert(as->region_tree, r);
+    if (store)
+    {
+        if (store->get)
+        {
+            store->get(store);
+        }
+        rmap_add_region(&store->rmap, r);
+    }
     return r;
 }
 
@@ -452,8 +1003,10 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
     if ((dst = memregion_map_internal(as, addr, src->end - src->start,
                                       src->perm, src->store, src->ofs, src->shared)) != NULL)
     {
-        // hard copy over everything
-        if (vpmap_copy(src->as->vpmap, as->vpmap, src->start, addr,
+        dst->store_size = src->store_size;
+        // shared regions fault their pages in from the common store, the rest
+        // is shared copy-on-write
+        if (!src->shared && vpmap_copy(src->as->vpmap, as->vpmap, src->start, addr,
                        pg_round_up(src->end - src->start) / pg_size, src->perm) != ERR_OK)
         {
             memregion_unmap_internal(dst);
@@ -463,17 +1016,221 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
     return dst;
 }
 
+static err_t
+memregion_sync_internal(struct memregion *region, vaddr_t start, vaddr_t end)
+{
+    struct vpmap *vpmap = region->as->vpmap;
+    paddr_t paddr;
+    int dirty;
+    err_t err = ERR_OK;
+
+    if (vpmap == NULL || !region->shared || region->store == NULL || region->perm != MEMPERM_URW)
+    {
+        return ERR_OK;
+    }
+    for (vaddr_t va = pg_round_down(start); va < end && va - region->start < region->store_size; va += pg_size)
+    {
+        if (vpmap_get_dirty(vpmap, va, &dirty) != ERR_OK || !dirty ||
+            vpmap_lookup_vaddr(vpmap, va, &paddr, NULL) != ERR_OK)
+        {
+            continue;
+        }
+        if (region->store->write(region->store, paddr, region->ofs + (va - region->start)) != ERR_OK)
+        {
+            err = ERR_FAULT;
+            continue;
+        }
+        vpmap_clear_dirty(vpmap, va);
+    }
+    return err;
+}
+
 static struct memregion *
 memregion_find_internal(struct addrspace *as, vaddr_t addr, size_t size)
 {
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n))
+    struct thread *t = thread_current();
+    struct memregion *r;
+
+    // syscalls and faults tend to hit the same region again
+    if (as != kas && t->region_cache_seq == as->region_seq)
     {
-        struct memregion *r = (struct memregion *)list_entry(n, struct memregion, as_node);
+        r = t->region_cache;
         if (addr >= r->start && addr + size <= pg_round_up(r->end))
         {
             return r;
         }
     }
+    if ((r = region_tree_floor(as, addr)) == NULL || addr + size > pg_round_up(r->end))
+    {
+        return NULL;
+    }
+    if (as != kas)
+    {
+        t->region_cache = r;
+        t->region_cache_seq = as->region_seq;
+    }
+    return r;
+}
+
+static struct memregion *
+memregion_next_internal(struct addrspace *as, vaddr_t addr)
+{
+    struct memregion *n = as->region_tree, *found = NULL;
+
+    // ends grow with starts, so this is the lowest region ending above addr
+    while (n != NULL)
+    {
+        if (pg_round_up(n->end) > addr)
+        {
+            found = n;
+            n = n->left;
+        }
+        else
+        {
+            n = n->right;
+        }
+    }
+    return found;
+}
+
+static struct memregion *
+memregion_overlap_internal(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    struct memregion *r;
+
+    // only the last region starting below end can reach into the range
+    if (end > start && (r = region_tree_floor(as, end - 1)) != NULL && region_limit(r) > start)
+    {
+        return r;
+    }
     return NULL;
 }
+
+static err_t
+memregion_swap_out_internal(struct memregion *region, vaddr_t va, paddr_t paddr)
+{
+    struct vpmap *vpmap = region->as->vpmap;
+    swapid_t swapid;
+
+    if (swap_alloc(&swapid) != ERR_OK)
+    {
+        return ERR_NOMEM;
+    }
+    // unmap before writing so the page can't change underneath the write, a
+    // fault on it waits for as_lock and then reads it back
+    if (vpmap_put_swapid(vpmap, va, swapid) != ERR_OK)
+    {
+        swap_free(swapid);
+        return ERR_VM_INVALID;
+    }
+    if (swap_write(swapid, paddr) != ERR_OK)
+    {
+        // the page table is still there, mapping it back can't fail
+        kassert(vpmap_map(vpmap, va, paddr, 1, region->perm) == ERR_OK);
+        swap_free(swapid);
+        return ERR_FAULT;
+    }
+    pmem_dec_refcnt(paddr);
+    return ERR_OK;
+}
+
+static void
+memregion_fault_around_internal(struct memregion *region, vaddr_t va)
+{
+    struct vpmap *vpmap = region->as->vpmap;
+    vaddr_t end = pg_round_up(region->end);
+    vaddr_t v;
+    int accessed;
+    size_t hits = 0;
+
+    // credit the pages the last round mapped that were used since
+    for (v = region->fa_start; v < region->fa_end; v += pg_size)
+    {
+        if (vpmap_get_accessed(vpmap, v, &accessed) == ERR_OK && accessed)
+        {
+            hits++;
+        }
+    }
+    __sync_add_and_fetch(&faultaround_hits, hits);
+
+    // a fault right past the last window means the access is sequential
+    if (va == region->fa_end)
+    {
+        region->fa_window = min(max(region->fa_window * 2, 1), FAULT_AROUND_MAX);
+    }
+    else
+    {
+        region->fa_window /= 2;
+    }
+    region->fa_start = va + pg_size;
+    // A page table past the next 2 MiB boundary of the heap would keep the
+    // fault there from mapping a huge page, leave that range to the fault.
+    if (region == region->as->heap)
+    {
+        v = (va + HUGE_PG_SIZE) & ~(HUGE_PG_SIZE - 1);
+        end = min(end, v);
+    }
+    for (v = region->fa_start; v < end && v < region->fa_start + region->fa_window * pg_size; v += pg_size)
+    {
+        if (memregion_map_ahead_internal(region, v) != ERR_OK)
+        {
+            break;
+        }
+    }
+    region->fa_end = v;
+    __sync_add_and_fetch(&faultaround_mapped, (region->fa_end - region->fa_start) / pg_size);
+}
+
+static err_t
+memregion_map_ahead_internal(struct memregion *region, vaddr_t va)
+{
+    struct vpmap *vpmap = region->as->vpmap;
+    struct page *page;
+    paddr_t paddr;
+    swapid_t swapid;
+    memperm_t perm;
+    err_t err = ERR_OK;
+
+    // stop at pages already there or waiting in swap
+    if (vpmap_lookup_vaddr(vpmap, va, NULL, &swapid) == ERR_OK || swapid != SWAPID_NONE)
+    {
+        return ERR_VM_INVALID;
+    }
+    if (region->store == NULL || va - region->start >= region->store_size)
+    {
+        // zeroed pages cost memory, leave them to real faults when it is short
+        if (pmem_nr_free() < pmem_wmark_high || pmem_alloc_zeroed(&paddr) != ERR_OK)
+        {
+            return ERR_NOMEM;
+        }
+        if (vpmap_map(vpmap, va, paddr, 1, region->perm) != ERR_OK)
+        {
+            pmem_free(paddr);
+            return ERR_NOMEM;
+        }
+        return ERR_OK;
+    }
+    // only whole pages already in the page cache, same mapping as a read fault
+    if (region->store_size - (va - region->start) < pg_size)
+    {
+        return ERR_VM_INVALID;
+    }
+    sleeplock_acquire(&region->store->pgcache_lock);
+    if ((page = pgcache_lookup_page(region->store, region->ofs + (va - region->start))) == NULL)
+    {
+        err = ERR_VM_INVALID;
+    }
+    else
+    {
+        perm = (region->shared || region->perm != MEMPERM_URW) ? region->perm : MEMPERM_UR;
+        paddr = page_to_paddr(page);
+        pmem_inc_refcnt(paddr, 1);
+        if (vpmap_map(vpmap, va, paddr, 1, perm) != ERR_OK)
+        {
+            pmem_dec_refcnt(paddr);
+            err = ERR_NOMEM;
+        }
+    }
+    sleeplock_release(&region->store->pgcache_lock);
+    return err;
+}
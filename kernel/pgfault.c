@@ -4,73 +4,219 @@
 #include <arch/mmu.h>
 #include <lib/errcode.h>
 #include <kernel/vpmap.h>
+#include <kernel/reclaim.h>
 #include <string.h>
 
 size_t user_pgfault = 0;
 
-void handle_page_fault(vaddr_t fault_addr, int present, int write, int user)
+// pages to reclaim before retrying a fault that ran out of memory
+#define FAULT_RECLAIM_PAGES 8
+
+/*
+ * Back the whole huge page around fault_addr with one huge page if it lies
+ * within the heap and nothing in it is mapped yet.
+ */
+static err_t heap_fault_huge(struct addrspace *as, vaddr_t fault_addr);
+
+/*
+ * Return True if the huge page at start lies within the heap and nothing in it
+ * is mapped yet. Caller must hold as_lock.
+ */
+static bool heap_huge_fits(struct addrspace *as, vaddr_t start);
+
+/*
+ * Map a zeroed page at va for a stack or heap fault, unless another thread
+ * mapped one first or va is past the end of region r (NULL for the stack).
+ * Return ERR_OK or ERR_NOMEM.
+ */
+static err_t map_zero_page(struct addrspace *as, struct memregion *r, vaddr_t va);
+
+/*
+ * The fault could not get memory. Free some and return, which retries the
+ * faulting access, or kill the process if nothing could be freed.
+ */
+static void fault_oom(void);
+
+/*
+ * Map a page for a fault at fault_addr in p. Return ERR_OK if the access can
+ * be retried, ERR_NOMEM if out of memory, ERR_VM_INVALID if fault_addr is not
+ * a valid access, or the error of a page that could not be read in.
+ */
+static err_t resolve_fault(struct proc *p, vaddr_t fault_addr, int present, int write, int user);
+
+static void
+fault_oom(void)
 {
-    if (user)
+    if (reclaim_pages(FAULT_RECLAIM_PAGES) > 0)
     {
-        __sync_add_and_fetch(&user_pgfault, 1);
+        return;
     }
-    // turn on interrupt now that we have the fault address
-    intr_set_level(INTR_ON);
+    proc_exit(-1);
+}
 
-    struct proc *curproc = proc_current();
-    kassert(curproc);
+static bool
+heap_huge_fits(struct addrspace *as, vaddr_t start)
+{
+    if (start < as->heap->start || start + HUGE_PG_SIZE > pg_round_up(as->heap->end) ||
+        start + HUGE_PG_SIZE < start)
+    {
+        return False;
+    }
+    return vpmap_huge_unmapped(as->vpmap, start);
+}
 
-    // Check valid access within the stack region
-    vaddr_t stack_lower_bound = USTACK_UPPERBOUND - (pg_size * USTACK_PAGES);
-    if (user && fault_addr >= stack_lower_bound && fault_addr < USTACK_UPPERBOUND)
+static err_t
+heap_fault_huge(struct addrspace *as, vaddr_t fault_addr)
+{
+    vaddr_t start = fault_addr & ~(HUGE_PG_SIZE - 1);
+    paddr_t paddr;
+    bool fits;
+    err_t err = ERR_OK;
+
+    // only allocate and zero a huge page that has a chance of being mapped
+    rwsleeplock_acquire_read(&as->as_lock);
+    fits = heap_huge_fits(as, start);
+    rwsleeplock_release_read(&as->as_lock);
+    if (!fits)
+    {
+        return ERR_VM_BOUND;
+    }
+    if (pmem_nalloc(&paddr, HUGE_PG_PAGES) != ERR_OK)
     {
-        // Allocate and map a new page for stack growth
-        paddr_t paddr;
-        if (pmem_alloc(&paddr) != ERR_OK)
+        return ERR_NOMEM;
+    }
+    // the zero pool only has single pages, so zero it here, outside as_lock
+    memset((void *)kmap_p2v(paddr), 0, HUGE_PG_SIZE);
+
+    rwsleeplock_acquire_read(&as->as_lock);
+    sleeplock_acquire(&as->pt_lock);
+    // another thread may have mapped part of the range or shrunk the heap
+    if (!heap_huge_fits(as, start) || vpmap_map_huge(as->vpmap, start, paddr, MEMPERM_URW) != ERR_OK)
+    {
+        err = ERR_VPMAP_MAP;
+    }
+    sleeplock_release(&as->pt_lock);
+    rwsleeplock_release_read(&as->as_lock);
+    if (err != ERR_OK)
+    {
+        pmem_nfree(paddr, HUGE_PG_PAGES);
+    }
+    return err;
+}
+
+static err_t
+map_zero_page(struct addrspace *as, struct memregion *r, vaddr_t va)
+{
+    paddr_t paddr;
+    bool used = False;
+    err_t err = ERR_OK;
+
+    // allocate before taking as_lock, the zero pool usually has a page ready
+    if (pmem_alloc_zeroed(&paddr) != ERR_OK)
+    {
+        return ERR_NOMEM;
+    }
+    rwsleeplock_acquire_read(&as->as_lock);
+    sleeplock_acquire(&as->pt_lock);
+    if ((r == NULL || va < r->end) && vpmap_lookup_vaddr(as->vpmap, va, NULL, NULL) != ERR_OK)
+    {
+        if (vpmap_map(as->vpmap, va, paddr, 1, MEMPERM_URW) == ERR_OK)
+        {
+            used = True;
+        }
+        else
         {
-            proc_exit(-1);
-            return;
+            err = ERR_NOMEM;
         }
+    }
+    sleeplock_release(&as->pt_lock);
+    rwsleeplock_release_read(&as->as_lock);
+    if (!used)
+    {
+        pmem_free(paddr);
+    }
+    return err;
+}
 
-        // Zero the page
-        memset((void *)kmap_p2v(paddr), 0, pg_size);
+static err_t
+resolve_fault(struct proc *p, vaddr_t fault_addr, int present, int write, int user)
+{
+    err_t err;
+    vaddr_t aligned_fault_addr = fault_addr & ~(pg_size - 1);
 
-        // Set the offset bit to 0s
-        vaddr_t aligned_fault_addr = fault_addr & ~(pg_size - 1);
-        if (vpmap_map(curproc->as.vpmap, aligned_fault_addr, paddr, 1, MEMPERM_URW) != ERR_OK)
+    // A write to a present page of a writable region means the page is shared
+    // copy-on-write since fork. The kernel takes these too when a syscall
+    // writes to a user buffer.
+    if (present && write && (user || fault_addr < USTACK_UPPERBOUND))
+    {
+        err = as_resolve_cow(&p->as, fault_addr);
+        if (err == ERR_OK || err == ERR_NOMEM)
         {
-            pmem_free(paddr);
-            proc_exit(-1);
-            return;
+            return err;
         }
-        return;
     }
-    else if (user && fault_addr >= curproc->as.heap->start && fault_addr < curproc->as.heap->end)
+
+    // Pages of file-backed regions, such as the program's code and data, are
+    // read in on first touch, and swapped out pages are read back.
+    if (!present && (user || fault_addr < USTACK_UPPERBOUND))
     {
-        // The fault address is within the heap region.
-        // if (!present)
-        // {
-        paddr_t paddr;
-        if (pmem_alloc(&paddr) != ERR_OK)
+        err = as_fill_page(&p->as, fault_addr, write);
+        if (err != ERR_VM_INVALID)
         {
-            proc_exit(-1);
-            return;
+            return err;
         }
+    }
 
-        memset((void *)kmap_p2v(paddr), 0, pg_size);
-
-        // Set the offset bit to 0s
-        vaddr_t aligned_fault_addr = fault_addr & ~(pg_size - 1);
-        if (vpmap_map(curproc->as.vpmap, aligned_fault_addr, paddr, 1, MEMPERM_URW) != ERR_OK)
+    // Check valid access within the stack region
+    vaddr_t stack_lower_bound = USTACK_UPPERBOUND - (pg_size * USTACK_PAGES);
+    if (user && fault_addr >= stack_lower_bound && fault_addr < USTACK_UPPERBOUND)
+    {
+        // Allocate and map a new page for stack growth. The stack has no
+        // memregion to keep a fault-around window in, it grows a page a fault.
+        return map_zero_page(&p->as, NULL, aligned_fault_addr);
+    }
+    else if (user && fault_addr >= p->as.heap->start && fault_addr < p->as.heap->end)
+    {
+        // The fault address is within the heap region.
+        if (heap_fault_huge(&p->as, fault_addr) == ERR_OK)
         {
-            pmem_free(paddr);
-            proc_exit(-1);
-            return;
+            return ERR_OK;
         }
-        return;
+        if ((err = map_zero_page(&p->as, p->as.heap, aligned_fault_addr)) != ERR_OK)
+        {
+            return err;
+        }
+        // map the next few heap pages too if the heap is filled sequentially
+        as_fault_around(&p->as, aligned_fault_addr);
+        return ERR_OK;
     }
+    return ERR_VM_INVALID;
+}
 
+void handle_page_fault(vaddr_t fault_addr, int present, int write, int user)
+{
     if (user)
+    {
+        __sync_add_and_fetch(&user_pgfault, 1);
+    }
+    // turn on interrupt now that we have the fault address
+    intr_set_level(INTR_ON);
+
+    struct proc *curproc = proc_current();
+    kassert(curproc);
+
+    err_t err = resolve_fault(curproc, fault_addr, present, write, user);
+    if (err == ERR_OK)
+    {
+        return;
+    }
+    if (err == ERR_NOMEM)
+    {
+        fault_oom();
+        return;
+    }
+    // a page that exists but could not be read kills the process either way
+    if (user || err != ERR_VM_INVALID)
     {
         proc_exit(-1);
         panic("unreachable");
@@ -81,3 +227,19 @@ void handle_page_fault(vaddr_t fault_addr, int present, int write, int user)
         panic("Kernel error in page fault handler\n");
     }
 }
+
+err_t
+fault_in_user_page(vaddr_t addr, int write)
+{
+    struct proc *p = proc_current();
+    err_t err;
+
+    kassert(p);
+    err = resolve_fault(p, addr, False, write, True);
+    if (err == ERR_NOMEM)
+    {
+        // like fault_oom, the caller retries once some memory is freed
+        return reclaim_pages(FAULT_RECLAIM_PAGES) > 0 ? ERR_OK : ERR_NOMEM;
+    }
+    return err == ERR_OK ? ERR_OK : ERR_FAULT;
+}
@@ -14,6 +14,8 @@
 
 List ptable; // process table
 struct spinlock ptable_lock;
+// signaled when a process exits, protected by ptable_lock
+static struct condvar exit_cv;
 struct spinlock pid_lock;
 static int pid_allocator;
 struct kmem_cache *proc_allocator;
@@ -64,6 +66,7 @@ void proc_sys_init(void)
 {
     list_init(&ptable);
     spinlock_init(&ptable_lock);
+    condvar_init(&exit_cv);
     spinlock_init(&pid_lock);
     proc_allocator = kmem_cache_create(sizeof(struct proc));
     kassert(proc_allocator);
@@ -270,7 +273,8 @@ proc_fork()
     // Update child thread
     struct thread *t;
     // err_t err;
-    if ((t = thread_create(child->name, child, DEFAULT_PRI)) == NULL)
+    // child inherits the parent's priority
+    if ((t = thread_create(child->name, child, thread_current()->priority)) == NULL)
     {
         // err = ERR_NOMEM;
         goto error;
@@ -373,10 +377,10 @@ int proc_wait(pid_t pid, int *status)
     kassert(current_proc);
     struct proc *child_proc = NULL;
     int found_child = False;
+    spinlock_acquire(&ptable_lock);
     while (True)
     {
         found_child = False;
-        spinlock_acquire(&ptable_lock);
 
         // Check all processes in the global process table
         for (Node *n = list_begin(&ptable); n != list_end(&ptable); n = list_next(n))
@@ -404,14 +408,88 @@ int proc_wait(pid_t pid, int *status)
                 }
             }
         }
-        spinlock_release(&ptable_lock);
         if (!found_child)
         {
+            spinlock_release(&ptable_lock);
             return ERR_CHILD; // No matching child process
         }
+        // Sleep until some process exits instead of rescanning
+        condvar_wait(&exit_cv, &ptable_lock);
     }
 }
 
+err_t
+proc_set_priority(pid_t pid, int priority)
+{
+    struct proc *cur = proc_current();
+    err_t err = ERR_NOTEXIST;
+
+    if (priority < PRI_MIN || priority > PRI_MAX)
+    {
+        return ERR_INVAL;
+    }
+    spinlock_acquire(&ptable_lock);
+    for (Node *n = list_begin(&ptable); n != list_end(&ptable); n = list_next(n))
+    {
+        struct proc *p = list_entry(n, struct proc, proc_node);
+        if (p->pid == pid && !p->has_exited)
+        {
+            if (p != cur && p->parent != cur)
+            {
+                err = ERR_PERM;
+                break;
+            }
+            // queued threads pick up the new priority next time they are queued
+            for (Node *tn = list_begin(&p->threads); tn != list_end(&p->threads); tn = list_next(tn))
+            {
+                list_entry(tn, struct thread, thread_node)->priority = priority;
+            }
+            err = ERR_OK;
+            break;
+        }
+    }
+    spinlock_release(&ptable_lock);
+    return err;
+}
+
+struct proc *
+proc_lock_next_as(pid_t pid)
+{
+    struct proc *p, *found = NULL;
+
+    spinlock_acquire(&ptable_lock);
+    // two rounds: pids above pid first, then the rest
+    for (int round = 0; round < 2 && found == NULL; round++)
+    {
+        for (Node *n = list_begin(&ptable); n != list_end(&ptable); n = list_next(n))
+        {
+            p = list_entry(n, struct proc, proc_node);
+            if (p->has_exited || (round == 0 && p->pid <= pid) ||
+                (found != NULL && found->pid < p->pid))
+            {
+                continue;
+            }
+            if (rwsleeplock_try_acquire_write(&p->as.as_lock) != ERR_OK)
+            {
+                continue;
+            }
+            // as_destroy already ran, proc_wait may free p once we let go
+            if (p->as.vpmap == NULL)
+            {
+                rwsleeplock_release_write(&p->as.as_lock);
+                continue;
+            }
+            if (found != NULL)
+            {
+                rwsleeplock_release_write(&found->as.as_lock);
+            }
+            found = p;
+        }
+    }
+    spinlock_release(&ptable_lock);
+    return found;
+}
+
 /* Exit a process with a status */
 void proc_exit(int status)
 {
@@ -432,12 +510,24 @@ void proc_exit(int status)
     // release process's cwd
     fs_release_inode(p->cwd);
 
+    spinlock_acquire(&ptable_lock);
+    // p is freed once reaped, children must not keep pointing at it
+    for (Node *n = list_begin(&ptable); n != list_end(&ptable); n = list_next(n))
+    {
+        struct proc *child = list_entry(n, struct proc, proc_node);
+        if (child->parent == p)
+        {
+            child->parent = NULL;
+        }
+    }
     // Notify the parent process
     if (p->parent != NULL)
     {
         p->exit_status = status;
         p->has_exited = True;
+        condvar_broadcast(&exit_cv);
     }
+    spinlock_release(&ptable_lock);
 
     // Exit the current thread
     thread_exit(status);
@@ -453,6 +543,7 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     struct elfhdr elf;
     struct proghdr ph;
     struct file *f;
+    struct memstore *store;
     paddr_t paddr;
     vaddr_t vaddr;
     vaddr_t end = 0;
@@ -465,7 +556,8 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     // check if the file is actually an executable file
     if (fs_read_file(f, (void *)&elf, sizeof(elf), &ofs) != sizeof(elf) || elf.magic != ELF_MAGIC)
     {
-        return ERR_INVAL;
+        err = ERR_INVAL;
+        goto done;
     }
 
     // read elf and load binary
@@ -473,14 +565,16 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     {
         if (fs_read_file(f, (void *)&ph, sizeof(ph), &ofs) != sizeof(ph))
         {
-            return ERR_INVAL;
+            err = ERR_INVAL;
+            goto done;
         }
         if (ph.type != PT_LOAD)
             continue;
 
         if (ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr)
         {
-            return ERR_INVAL;
+            err = ERR_INVAL;
+            goto done;
         }
 
         memperm_t perm = MEMPERM_UR;
@@ -489,16 +583,29 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
             perm = MEMPERM_URW;
         }
 
+        // A segment whose file offset lines up with its address within a page
+        // is mapped from the file and paged in on demand, sharing read-only
+        // pages with other processes through the inode's page cache.
+        store = pg_ofs(ph.off) == pg_ofs(ph.vaddr) ? f->f_inode->store : NULL;
+
         // found loadable section, add as a memregion
         struct memregion *r = as_map_memregion(&p->as, pg_round_down(ph.vaddr),
-                                               pg_round_up(ph.memsz + pg_ofs(ph.vaddr)), perm, NULL, ph.off, False);
+                                               pg_round_up(ph.memsz + pg_ofs(ph.vaddr)), perm, store,
+                                               ph.off - pg_ofs(ph.vaddr), False);
         if (r == NULL)
         {
-            return ERR_NOMEM;
+            err = ERR_NOMEM;
+            goto done;
         }
         end = r->end;
+        if (store != NULL)
+        {
+            // the rest of the segment is bss, it reads as zeros
+            r->store_size = pg_ofs(ph.vaddr) + ph.filesz;
+            continue;
+        }
 
-        // pre-page in code and data, may span over multiple pages
+        // otherwise pre-page in code and data, may span over multiple pages
         int count = 0;
         size_t avail_bytes;
         size_t read_bytes = ph.filesz;
@@ -507,23 +614,25 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
         vaddr = pg_ofs(ph.vaddr);
         while (count < pages)
         {
-            // allocate a physical page and zero it first
-            if ((err = pmem_alloc(&paddr)) != ERR_OK)
+            // allocate a zeroed physical page
+            if ((err = pmem_alloc_zeroed(&paddr)) != ERR_OK)
             {
-                return err;
+                goto done;
             }
             vaddr += kmap_p2v(paddr);
-            memset((void *)pg_round_down(vaddr), 0, pg_size);
             // calculate how many bytes to read from file
             avail_bytes = read_bytes < (pg_size - pg_ofs(vaddr)) ? read_bytes : (pg_size - pg_ofs(vaddr));
             if (avail_bytes && fs_read_file(f, (void *)vaddr, avail_bytes, &ph.off) != avail_bytes)
             {
-                return ERR_INVAL;
+                pmem_free(paddr);
+                err = ERR_INVAL;
+                goto done;
             }
             // map physical page with code/data content to expected virtual address in the page table
             if ((err = vpmap_map(p->as.vpmap, ph.vaddr + count * pg_size, paddr, 1, perm)) != ERR_OK)
             {
-                return err;
+                pmem_free(paddr);
+                goto done;
             }
             read_bytes -= avail_bytes;
             count++;
@@ -535,10 +644,13 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     // create memregion for heap after data segment
     if ((p->as.heap = as_map_memregion(&p->as, end, 0, MEMPERM_URW, NULL, 0, 0)) == NULL)
     {
-        return ERR_NOMEM;
+        err = ERR_NOMEM;
     }
 
-    return ERR_OK;
+done:
+    // file-backed memregions hold their own reference to the inode
+    fs_close_file(f);
+    return err;
 }
 
 err_t stack_setup(struct proc *p, char **argv, vaddr_t *ret_stackptr)
@@ -549,11 +661,10 @@ err_t stack_setup(struct proc *p, char **argv, vaddr_t *ret_stackptr)
     vaddr_t stacktop = USTACK_UPPERBOUND - pg_size;
 
     // allocate a page of physical memory for stack
-    if ((err = pmem_alloc(&paddr)) != ERR_OK)
+    if ((err = pmem_alloc_zeroed(&paddr)) != ERR_OK)
     {
         return err;
     }
-    memset((void *)kmap_p2v(paddr), 0, pg_size);
 
     // create memregion for stack
     if (as_map_memregion(&p->as, stacktop - 9 * pg_size, pg_size * 10, MEMPERM_URW, NULL, 0, False) == NULL)
@@ -236,3 +236,34 @@ radix_tree_remove(struct radix_tree_root *root, int index)
     root->height = 0;
     return leaf;
 }
+
+void*
+radix_tree_next(struct radix_tree_root *root, int *index)
+{
+    int i, level, span;
+    struct radix_tree_node *node, *child;
+    void *leaf;
+
+    kassert(root);
+    kassert(index);
+    for (i = *index; i <= radix_tree_max_index(root);) {
+        // walk down towards i, stopping at the first missing subtree
+        for (level = root->height - 1, node = root->root_node; level > 0; level--, node = child) {
+            if ((child = node->slots[radix_tree_level_index(i, level)]) == NULL) {
+                break;
+            }
+        }
+        if (level > 0) {
+            // nothing below, skip to the next subtree on this level
+            span = 1 << (RADIX_TREE_WIDTH_POWER * level);
+            i = (i & ~(span - 1)) + span;
+            continue;
+        }
+        if ((leaf = node->slots[radix_tree_leaf_index(i)]) != NULL) {
+            *index = i;
+            return leaf;
+        }
+        i++;
+    }
+    return NULL;
+}
@@ -1,25 +1,104 @@
 #include <arch/cpu.h>
+#include <arch/percpu.h>
+#include <arch/lapic.h>
+#include <arch/trap.h>
 #include <kernel/trap.h>
 #include <kernel/sched.h>
+#include <kernel/timer.h>
 #include <kernel/console.h>
 #include <kernel/list.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
-List _ready_queue;
-List* ready_queue = &_ready_queue;
-/* 
- * Schedules a new thread, if no thread on the ready queue
- * current cpu's idle thread is scheduled. Returns a thread
- * if the descheduled thread needs to be reclaimed.
+/*
+ * Per-cpu run queue. A thread is queued on the run queue of the cpu it last
+ * ran on, so enqueue and dequeue on the local cpu only touch the local lock.
+ * The local run queue lock is held across a context switch and released by
+ * the thread being switched to.
+ *
+ * Each priority level has its own FIFO list, a bit in bitmap is set iff the
+ * level's list is non-empty, so picking the next thread is a single bit scan.
+ */
+struct runqueue {
+    struct spinlock lock;
+    List ready[NUM_PRI];    // threads ready to run on this cpu, by priority
+    uint32_t bitmap;        // non-empty levels of ready
+    int nr_ready;           // number of ready threads, read without lock when stealing
+    uint32_t ticks;         // timer ticks seen by this cpu, drives aging
+    int cpu;                // index of the owning cpu
+};
+
+/*
+ * Every SCHED_AGING_TICKS every waiting thread moves up one level, so a thread
+ * runs within (PRI_MAX - priority) * SCHED_AGING_TICKS ticks of becoming ready
+ * no matter how busy higher levels are. A thread drops back to its own
+ * priority the next time it is queued.
+ */
+#define SCHED_AGING_TICKS 10
+
+static DEFINE_PER_CPU(struct runqueue, runqueue);
+
+// bit i is set while cpu i is idle, such cpus may be halted with their tick stopped
+static volatile uint32_t idle_cpus;
+
+/*
+ * Schedules a new thread, if no thread on the run queue and no thread can be
+ * stolen from other cpus, current cpu's idle thread is scheduled. Returns a
+ * thread if the descheduled thread needs to be reclaimed.
  * */
-static struct thread* sched(void);
+static struct thread* sched(struct runqueue *rq);
+
+/* Disable interrupt, lock and return the run queue of the current cpu. */
+static struct runqueue* rq_lock_local(void);
+
+/* Append t to the run queue at its priority, rq->lock must be held. */
+static void rq_enqueue(struct runqueue *rq, struct thread *t);
+
+/* Pop the first thread of the highest non-empty level, rq->lock must be held. */
+static struct thread* rq_dequeue(struct runqueue *rq);
+
+/* Move every waiting thread up one level, rq->lock must be held. */
+static void rq_age(struct runqueue *rq);
+
+/*
+ * A thread was queued on cpu's run queue, wake up a halted cpu to run it:
+ * cpu itself if it is idle, otherwise another idle cpu that can steal it.
+ * Interrupt must be off.
+ */
+static void rq_kick(int cpu);
+
+/* Return True if any run queue has a ready thread. */
+static bool rq_any_ready(void);
+
+/* Resched IPI handler, the idle loop does the real work after the halt. */
+static void resched_trap_handler(irq_t irq, void *dev, void *regs);
+
+/*
+ * Steal a ready thread from the busiest other cpu, rq->lock must be held.
+ * Never spins on a remote lock, so two cpus stealing from each other can't deadlock.
+ */
+static struct thread* rq_steal(struct runqueue *rq);
 
 void
 sched_sys_init(void)
 {
-    list_init(ready_queue);
-    spinlock_init(&sched_lock);
+    for (int i = 0; i < ncpu; i++) {
+        struct runqueue *rq = per_cpu_ptr(runqueue, i);
+        for (int pri = PRI_MIN; pri <= PRI_MAX; pri++) {
+            list_init(&rq->ready[pri]);
+        }
+        rq->bitmap = 0;
+        rq->nr_ready = 0;
+        rq->ticks = 0;
+        rq->cpu = i;
+        spinlock_init(&rq->lock);
+    }
+}
+
+err_t
+sched_register_trap_handler(void)
+{
+    return trap_register_handler(T_IPI_RESCHED, NULL, resched_trap_handler);
 }
 
 err_t
@@ -53,54 +132,223 @@ void
 sched_ready(struct thread *t)
 {
     kassert(t);
-    spinlock_acquire(&sched_lock);
+    struct runqueue *rq;
+
+    intr_set_level(INTR_OFF);
+    // new threads start on the creating cpu, others go back to the cpu they
+    // last ran on. t can't be running or queued, so t->cpu is stable here.
+    if (t->cpu < 0) {
+        t->cpu = cpu_index(mycpu());
+    }
+    rq = per_cpu_ptr(runqueue, t->cpu);
+    spinlock_acquire(&rq->lock);
     t->state = READY;
-    list_append(ready_queue, &t->node);
-    spinlock_release(&sched_lock);
+    rq_enqueue(rq, t);
+    spinlock_release(&rq->lock);
+    rq_kick(t->cpu);
+    intr_set_level(INTR_ON);
 }
 
 void
 sched_sched(threadstate_t next_state, void* lock)
 {
     struct thread *curr = thread_current();
-    spinlock_acquire(&sched_lock);
+    struct runqueue *rq = rq_lock_local();
     if (next_state == READY && curr != cpu_idle_thread(mycpu())) {
-        list_append(ready_queue, &curr->node);
+        rq_enqueue(rq, curr);
     }
     curr->state = next_state;
     if (lock) {
         lock_release(lock);
     }
 
-    /* 
+    /*
      * schedule a new thread and see if any thread needs to be cleaned up
-     * newly scheduled thread will release the scheduler lock acquired by the previous thread
+     * newly scheduled thread will release the run queue lock acquired by the previous thread
      */
-    struct thread *dying = sched();
-    spinlock_release(&sched_lock);
+    struct thread *dying = sched(rq);
+    // curr may have been stolen by another cpu while it was ready
+    sched_finish_switch();
     if (dying) {
         thread_cleanup(dying);
     }
 }
 
-// function to schedule thread, sched_lock must be held before calling this function
+void
+sched_finish_switch(void)
+{
+    kassert(intr_get_level() == INTR_OFF);
+    spinlock_release(&this_cpu(runqueue).lock);
+}
+
+void
+sched_idle(void)
+{
+    uint32_t bit;
+
+    for (;;) {
+        intr_set_level(INTR_OFF);
+        bit = 1u << cpu_index(mycpu());
+        // announce idleness before checking for work, enqueuers check it after queuing
+        __sync_fetch_and_or(&idle_cpus, bit);
+        if (!rq_any_ready()) {
+            timer_tick_stop();
+            intr_wait();
+            intr_set_level(INTR_OFF);
+            timer_tick_restart();
+        }
+        __sync_fetch_and_and(&idle_cpus, ~bit);
+        intr_set_level(INTR_ON);
+        sched_sched(READY, NULL);
+    }
+}
+
+void
+sched_tick(void)
+{
+    struct runqueue *rq = rq_lock_local();
+    if (++rq->ticks % SCHED_AGING_TICKS == 0) {
+        rq_age(rq);
+    }
+    spinlock_release(&rq->lock);
+}
+
+size_t
+sched_nr_ready(int cpu)
+{
+    kassert(cpu >= 0 && cpu < ncpu);
+    return per_cpu(runqueue, cpu).nr_ready;
+}
+
+static struct runqueue*
+rq_lock_local(void)
+{
+    struct runqueue *rq;
+    // disable interrupt first so we can't migrate between picking and locking the run queue
+    intr_set_level(INTR_OFF);
+    rq = this_cpu_ptr(runqueue);
+    spinlock_acquire(&rq->lock);
+    intr_set_level(INTR_ON);
+    return rq;
+}
+
+static void
+rq_enqueue(struct runqueue *rq, struct thread *t)
+{
+    kassert(t->priority >= PRI_MIN && t->priority <= PRI_MAX);
+    list_append(&rq->ready[t->priority], &t->node);
+    rq->bitmap |= 1u << t->priority;
+    rq->nr_ready++;
+}
+
+static struct thread*
+rq_dequeue(struct runqueue *rq)
+{
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+    int pri = 31 - __builtin_clz(rq->bitmap);
+    Node *n = list_begin(&rq->ready[pri]);
+    struct thread *t = list_entry(n, struct thread, node);
+    kassert(t->state == READY);
+    list_remove(n);
+    if (list_empty(&rq->ready[pri])) {
+        rq->bitmap &= ~(1u << pri);
+    }
+    rq->nr_ready--;
+    return t;
+}
+
+static void
+rq_age(struct runqueue *rq)
+{
+    // go top down so a thread moves at most one level per call
+    for (int pri = PRI_MAX - 1; pri >= PRI_MIN; pri--) {
+        if (!(rq->bitmap & (1u << pri))) {
+            continue;
+        }
+        while (!list_empty(&rq->ready[pri])) {
+            Node *n = list_begin(&rq->ready[pri]);
+            list_remove(n);
+            list_append(&rq->ready[pri + 1], n);
+        }
+        rq->bitmap &= ~(1u << pri);
+        rq->bitmap |= 1u << (pri + 1);
+    }
+}
+
+static void
+rq_kick(int cpu)
+{
+    int self = cpu_index(mycpu());
+    uint32_t idle = idle_cpus & ~(1u << self);
+
+    if (idle == 0) {
+        return;
+    }
+    if (!(idle & (1u << cpu))) {
+        cpu = __builtin_ctz(idle);
+    }
+    lapic_send_ipi(x86_64_cpus[cpu].lapic_id, T_IPI_RESCHED);
+}
+
+static bool
+rq_any_ready(void)
+{
+    for (int i = 0; i < ncpu; i++) {
+        if (per_cpu(runqueue, i).nr_ready > 0) {
+            return True;
+        }
+    }
+    return False;
+}
+
+static void
+resched_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    trap_notify_irq_completion();
+}
+
+static struct thread*
+rq_steal(struct runqueue *rq)
+{
+    struct runqueue *victim = NULL;
+    struct thread *t = NULL;
+    int busiest = 0;
+
+    // racy scan is fine, nr_ready is rechecked under the victim's lock
+    for (int i = 0; i < ncpu; i++) {
+        struct runqueue *other = per_cpu_ptr(runqueue, i);
+        if (other != rq && other->nr_ready > busiest) {
+            busiest = other->nr_ready;
+            victim = other;
+        }
+    }
+    if (victim == NULL || spinlock_try_acquire(&victim->lock) != ERR_OK) {
+        return NULL;
+    }
+    if ((t = rq_dequeue(victim)) != NULL) {
+        t->cpu = rq->cpu;
+    }
+    spinlock_release(&victim->lock);
+    return t;
+}
+
+// function to schedule thread, rq->lock must be held before calling this function
 static struct thread*
-sched(void)
+sched(struct runqueue *rq)
 {
-    void *cpu = mycpu();
+    struct x86_64_cpu *cpu = mycpu();
     struct thread *curr = thread_current();
     struct thread *prev = NULL;
     struct thread *next = NULL;
 
-    if (!list_empty(ready_queue)) {
-        Node *n = list_begin(ready_queue);
-        next = (struct thread*) list_entry(n, struct thread, node);
-        kassert(next->state == READY);
-        list_remove(n);
-    } else {
-        // if current thread is not the idle thread, schedules to idle thread of the cpu
-        struct thread *idle = cpu_idle_thread(cpu);
-        next = idle;
+    if ((next = rq_dequeue(rq)) == NULL && (next = rq_steal(rq)) == NULL) {
+        // nothing runnable anywhere, schedules to idle thread of the cpu
+        next = cpu_idle_thread(cpu);
+    } else if (idle_cpus & (1u << cpu_index(cpu))) {
+        // idle thread got preempted by a tick that found work, we are busy now
+        __sync_fetch_and_and(&idle_cpus, ~(1u << cpu_index(cpu)));
     }
 
     next->state = RUNNING;
@@ -3,24 +3,106 @@
 #include <kernel/console.h>
 #include <kernel/thread.h>
 #include <kernel/sched.h>
+#include <kernel/timer.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
+#include <arch/asm.h>
+#include <arch/cpu.h>
+#include <arch/percpu.h>
 
 static bool synch_enabled = False;
 
+/*
+ * Maximum pause iterations an acquirer spins on a running mutex holder,
+ * comfortably longer than the critical sections mutexes are meant for.
+ */
+#define MUTEX_SPIN_LIMIT 1000
+// registered lock_stats, only ever pushed to
+static struct lock_stat *lock_stats;
+
+// lock_stat registration states, LOCK_STAT_INIT leaves it LOCK_STAT_NEW
+#define LOCK_STAT_NEW       0
+#define LOCK_STAT_CLAIMED   1
+#define LOCK_STAT_DONE      2
+
+// lock_stats with a per-cpu acquire counter, later ones only count contention
+#define LOCK_STAT_MAX 128
+static int lock_stat_slots;
+static DEFINE_PER_CPU(uint64_t, lock_acquires[LOCK_STAT_MAX]);
+
+/* Count a successful acquire of lock, interrupt must be off. */
+static void lock_stat_count(struct spinlock *lock);
+
+/* Add stat to lock_stats the first time a lock uses it. */
+static void lock_stat_register(struct lock_stat *stat);
+
 void
 synch_init(void)
 {
     synch_enabled = True;
 }
 
+static void
+lock_stat_register(struct lock_stat *stat)
+{
+    if (stat->registered != LOCK_STAT_NEW ||
+        !__sync_bool_compare_and_swap(&stat->registered, LOCK_STAT_NEW, LOCK_STAT_CLAIMED)) {
+        // another lock of the site is registering it, its slot must be set
+        // before this lock can be acquired
+        while (stat->registered != LOCK_STAT_DONE) {
+            __sync_synchronize();
+        }
+        return;
+    }
+    int slot = __sync_add_and_fetch(&lock_stat_slots, 1);
+    stat->slot = slot <= LOCK_STAT_MAX ? slot : 0;
+    do {
+        stat->next = lock_stats;
+    } while (!__sync_bool_compare_and_swap(&lock_stats, stat->next, stat));
+    // publish only once the slot is set
+    __sync_synchronize();
+    stat->registered = LOCK_STAT_DONE;
+}
+
+static void
+lock_stat_count(struct spinlock *lock)
+{
+    if (lock->stat->slot > 0) {
+        this_cpu(lock_acquires)[lock->stat->slot - 1]++;
+    }
+}
+
+struct lock_stat*
+lock_stat_list(void)
+{
+    return lock_stats;
+}
+
+uint64_t
+lock_stat_acquires(struct lock_stat *stat)
+{
+    uint64_t acquires = 0;
+
+    kassert(stat);
+    if (stat->slot == 0) {
+        return 0;
+    }
+    // other cpus' counters are read racily, good enough for statistics
+    for (int i = 0; i < ncpu; i++) {
+        acquires += per_cpu(lock_acquires, i)[stat->slot - 1];
+    }
+    return acquires;
+}
+
 void
-spinlock_init(struct spinlock* lock)
+spinlock_init_stat(struct spinlock* lock, struct lock_stat *stat)
 {
-    kassert(lock);
+    kassert(lock && stat);
     lock->type = SPIN;
-    lock->lock_status = 0;
+    lock->tickets = 0;
     lock->holder = NULL;
+    lock->stat = stat;
+    lock_stat_register(stat);
 }
 
 void
@@ -38,13 +120,23 @@ spinlock_acquire(struct spinlock* lock)
     }
     kassert(lock->holder == NULL || lock->holder != curr);
 
-    while (lock->lock_status || __sync_lock_test_and_set(&lock->lock_status, 1) != 0);
+    // take a ticket, wait for our turn without writing to the lock's cache line
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    if (*(volatile uint16_t*)&lock->owner != ticket) {
+        uint64_t start = rdtsc();
+        while (*(volatile uint16_t*)&lock->owner != ticket) {
+            pause();
+        }
+        __sync_fetch_and_add(&lock->stat->contended, 1);
+        __sync_fetch_and_add(&lock->stat->spin_cycles, rdtsc() - start);
+    }
 
     // Tell the C compiler and the processor to not move loads or stores
     // past this point, to ensure that the critical section's memory
     // references happen after the lock is acquired.
     __sync_synchronize();
     lock->holder = curr;
+    lock_stat_count(lock);
 }
 
 err_t
@@ -58,9 +150,13 @@ spinlock_try_acquire(struct spinlock* lock)
     // can't grab the same lock again
     struct thread *curr = thread_current();
     kassert(lock->holder == NULL || lock->holder != curr);
-    if (lock->lock_status == 0 && __sync_lock_test_and_set(&lock->lock_status, 1) == 0) {
+    // only take a ticket if it would be served right away
+    uint32_t tickets = *(volatile uint32_t*)&lock->tickets;
+    if ((tickets >> 16) == (tickets & 0xFFFF) &&
+        __sync_bool_compare_and_swap(&lock->tickets, tickets, tickets + (1 << 16))) {
         __sync_synchronize();
         lock->holder = curr;
+        lock_stat_count(lock);
         return ERR_OK;
     }
     intr_set_level(INTR_ON);
@@ -80,16 +176,17 @@ spinlock_release(struct spinlock* lock)
     // past this point, to ensure that all the stores in the critical
     // section are visible to other CPUs before the lock is released.
     __sync_synchronize();
-    __sync_lock_release(&lock->lock_status);
+    // only the holder writes owner, hand the lock to the next ticket
+    *(volatile uint16_t*)&lock->owner = lock->owner + 1;
     __sync_synchronize();
    intr_set_level(INTR_ON);
 }
 
 void
-sleeplock_init(struct sleeplock* lock)
+sleeplock_init_stat(struct sleeplock* lock, struct lock_stat *stat)
 {
     kassert(lock);
-    spinlock_init(&lock->lk);
+    spinlock_init_stat(&lock->lk, stat);
     condvar_init(&lock->waiters);
     lock->holder = NULL;
     lock->type = SLEEP;
@@ -140,6 +237,179 @@ sleeplock_release(struct sleeplock* lock)
     spinlock_release(&lock->lk);
 }
 
+void
+rwsleeplock_init_stat(struct rwsleeplock* lock, struct lock_stat *stat)
+{
+    kassert(lock);
+    spinlock_init_stat(&lock->lk, stat);
+    condvar_init(&lock->readers);
+    condvar_init(&lock->writers);
+    lock->nreaders = 0;
+    lock->nwriters_waiting = 0;
+    lock->holder = NULL;
+    lock->type = RWSLEEP;
+}
+
+void
+rwsleeplock_acquire_read(struct rwsleeplock* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock && lock->holder != thread_current());
+    spinlock_acquire(&lock->lk);
+    // let waiting writers go first so a stream of readers can't starve them
+    while (lock->holder != NULL || lock->nwriters_waiting > 0) {
+        condvar_wait(&lock->readers, &lock->lk);
+    }
+    lock->nreaders++;
+    spinlock_release(&lock->lk);
+}
+
+void
+rwsleeplock_release_read(struct rwsleeplock* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock);
+    spinlock_acquire(&lock->lk);
+    kassert(lock->nreaders > 0);
+    if (--lock->nreaders == 0 && lock->nwriters_waiting > 0) {
+        condvar_signal(&lock->writers);
+    }
+    spinlock_release(&lock->lk);
+}
+
+void
+rwsleeplock_acquire_write(struct rwsleeplock* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock && lock->holder != thread_current());
+    spinlock_acquire(&lock->lk);
+    lock->nwriters_waiting++;
+    while (lock->holder != NULL || lock->nreaders > 0) {
+        condvar_wait(&lock->writers, &lock->lk);
+    }
+    lock->nwriters_waiting--;
+    lock->holder = thread_current();
+    spinlock_release(&lock->lk);
+}
+
+err_t
+rwsleeplock_try_acquire_write(struct rwsleeplock* lock)
+{
+    if (!synch_enabled) {
+        return ERR_OK;
+    }
+    kassert(lock);
+    spinlock_acquire(&lock->lk);
+    if (lock->holder == NULL && lock->nreaders == 0) {
+        lock->holder = thread_current();
+        spinlock_release(&lock->lk);
+        return ERR_OK;
+    }
+    spinlock_release(&lock->lk);
+    return ERR_LOCK_BUSY;
+}
+
+void
+rwsleeplock_release_write(struct rwsleeplock* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock && lock->holder == thread_current());
+    spinlock_acquire(&lock->lk);
+    lock->holder = NULL;
+    // hand off to the next writer, readers only get in once no writer waits
+    if (lock->nwriters_waiting > 0) {
+        condvar_signal(&lock->writers);
+    } else {
+        condvar_broadcast(&lock->readers);
+    }
+    spinlock_release(&lock->lk);
+}
+
+void
+mutex_init_stat(struct mutex* lock, struct lock_stat *stat)
+{
+    kassert(lock);
+    spinlock_init_stat(&lock->lk, stat);
+    condvar_init(&lock->waiters);
+    lock->nwaiters = 0;
+    lock->holder = NULL;
+    lock->type = MUTEX;
+}
+
+err_t
+mutex_try_acquire(struct mutex* lock)
+{
+    if (!synch_enabled) {
+        return ERR_OK;
+    }
+    kassert(lock);
+    if (lock->holder == NULL && __sync_bool_compare_and_swap(&lock->holder, NULL, thread_current())) {
+        return ERR_OK;
+    }
+    return ERR_LOCK_BUSY;
+}
+
+void
+mutex_acquire(struct mutex* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock);
+    struct thread *curr = thread_current();
+    struct thread *holder;
+    kassert(lock->holder != curr);
+
+    // Spin while the holder is running, it is likely to release soon. Threads
+    // are never unmapped, so reading a stale holder's state is harmless.
+    for (int spins = 0; spins < MUTEX_SPIN_LIMIT; spins++) {
+        if ((holder = lock->holder) == NULL) {
+            if (__sync_bool_compare_and_swap(&lock->holder, NULL, curr)) {
+                return;
+            }
+        } else if (ncpu == 1 || holder->state != RUNNING) {
+            break;
+        }
+        pause();
+    }
+
+    spinlock_acquire(&lock->lk);
+    // announce ourselves before the last check, release looks at nwaiters
+    // after clearing holder, so one of the two sides sees the other
+    __sync_fetch_and_add(&lock->nwaiters, 1);
+    while (!__sync_bool_compare_and_swap(&lock->holder, NULL, curr)) {
+        condvar_wait(&lock->waiters, &lock->lk);
+    }
+    __sync_fetch_and_sub(&lock->nwaiters, 1);
+    spinlock_release(&lock->lk);
+}
+
+void
+mutex_release(struct mutex* lock)
+{
+    if (!synch_enabled) {
+        return;
+    }
+    kassert(lock && lock->holder == thread_current());
+    __sync_synchronize();
+    lock->holder = NULL;
+    __sync_synchronize();
+    if (lock->nwaiters > 0) {
+        // a sleeper holds lk until it is on the waiters list, so it can't miss this
+        spinlock_acquire(&lock->lk);
+        condvar_signal(&lock->waiters);
+        spinlock_release(&lock->lk);
+    }
+}
+
 void
 lock_acquire(void* lock)
 {
@@ -149,7 +419,11 @@ lock_acquire(void* lock)
     kassert(lock);
     if (LOCK_TYPE(lock) == SPIN) {
         spinlock_acquire(lock);
+    } else if (LOCK_TYPE(lock) == MUTEX) {
+        mutex_acquire(lock);
     } else {
+        // a rwsleeplock has two modes, there is no telling which one is meant
+        kassert(LOCK_TYPE(lock) == SLEEP);
         sleeplock_acquire(lock);
     }
 }
@@ -163,7 +437,11 @@ lock_release(void* lock)
     kassert(lock);
     if (LOCK_TYPE(lock) == SPIN) {
         spinlock_release(lock);
+    } else if (LOCK_TYPE(lock) == MUTEX) {
+        mutex_release(lock);
     } else {
+        // a rwsleeplock has two modes, there is no telling which one is meant
+        kassert(LOCK_TYPE(lock) == SLEEP);
         sleeplock_release(lock);
     }
 }
@@ -186,6 +464,8 @@ condvar_wait(struct condvar* cv, void* lock)
     struct thread *t = thread_current();
     if (LOCK_TYPE(lock) == SPIN) {
         kassert(((struct spinlock*)lock)->holder == t);
+    } else if (LOCK_TYPE(lock) == MUTEX) {
+        kassert(((struct mutex*)lock)->holder == t);
     } else {
         kassert(((struct sleeplock*)lock)->holder == t);
     }
@@ -198,6 +478,63 @@ condvar_wait(struct condvar* cv, void* lock)
     lock_acquire(lock);
 }
 
+/* Timeout state shared by condvar_wait_timeout and its timer callback */
+struct condvar_timeout {
+    struct condvar *cv;
+    void *lock;
+    struct thread *thread;
+    bool timed_out;
+};
+
+/* Timer callback: wake the waiter if it hasn't been signaled yet */
+static void
+condvar_timeout(void *aux)
+{
+    struct condvar_timeout *to = aux;
+
+    lock_acquire(to->lock);
+    for (Node *n = list_begin(&to->cv->waiters); n != list_end(&to->cv->waiters); n = list_next(n)) {
+        if (list_entry(n, struct thread, node) == to->thread) {
+            list_remove(n);
+            to->timed_out = True;
+            sched_ready(to->thread);
+            break;
+        }
+    }
+    lock_release(to->lock);
+}
+
+err_t
+condvar_wait_timeout(struct condvar* cv, void* lock, uint64_t nticks)
+{
+    if (!synch_enabled) {
+        return ERR_OK;
+    }
+    // assuming we are holding lock already
+    kassert(cv && lock);
+    struct thread *t = thread_current();
+    if (LOCK_TYPE(lock) == SPIN) {
+        kassert(((struct spinlock*)lock)->holder == t);
+    } else if (LOCK_TYPE(lock) == MUTEX) {
+        kassert(((struct mutex*)lock)->holder == t);
+    } else {
+        kassert(((struct sleeplock*)lock)->holder == t);
+    }
+
+    struct condvar_timeout to = { .cv = cv, .lock = lock, .thread = t, .timed_out = False };
+    struct timer timer;
+    timer_setup(&timer, condvar_timeout, &to);
+
+    list_append(&cv->waiters, &t->node);
+    // callback needs lock to wake us, so it can't run until we are asleep
+    timer_add(&timer, timer_get_ticks() + nticks);
+    sched_sched(SLEEPING, lock);
+    // callback takes lock, so cancel before reacquiring it
+    timer_cancel(&timer);
+    lock_acquire(lock);
+    return to.timed_out ? ERR_TIMEOUT : ERR_OK;
+}
+
 void
 condvar_signal(struct condvar* cv)
 {
@@ -3,11 +3,16 @@
 #include <kernel/console.h>
 #include <kernel/kmalloc.h>
 #include <kernel/fs.h>
+#include <kernel/timer.h>
+#include <kernel/futex.h>
+#include <kernel/shmms.h>
 #include <lib/syscall-num.h>
+#include <lib/syscall-flags.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
 #include <arch/asm.h>
+#include <arch/cpu.h>
 #include <kernel/pipe.h>
 
 // syscall handlers
@@ -34,13 +39,61 @@ static sysret_t sys_dup(void *arg);
 static sysret_t sys_pipe(void *arg);
 static sysret_t sys_info(void *arg);
 static sysret_t sys_halt(void *arg);
+static sysret_t sys_setpriority(void *arg);
+static sysret_t sys_lockstat(void *arg);
+static sysret_t sys_futex_wait(void *arg);
+static sysret_t sys_futex_wake(void *arg);
+static sysret_t sys_mmap(void *arg);
+static sysret_t sys_munmap(void *arg);
+static sysret_t sys_msync(void *arg);
+static sysret_t sys_kmembench(void *arg);
+static sysret_t sys_kmemaccess(void *arg);
+static sysret_t sys_kmallocstat(void *arg);
 
 extern size_t user_pgfault;
+extern size_t faultaround_mapped;
+extern size_t faultaround_hits;
 struct sys_info
 {
     size_t num_pgfault;
+    size_t num_cpus;
+    size_t ticks;
+    size_t num_faultaround;
+    size_t num_faultaround_hit;
 };
 
+#define LOCKSTAT_NAME_LEN 32
+struct lockstat
+{
+    char name[LOCKSTAT_NAME_LEN];
+    char file[LOCKSTAT_NAME_LEN];
+    int line;
+    size_t acquires;
+    size_t contended;
+    size_t spin_cycles;
+};
+
+struct kmallocstat
+{
+    size_t size;
+    size_t allocs;
+    size_t frees;
+    size_t live;
+    size_t wasted;
+};
+
+// kmalloc size classes sys_kmallocstat reports at most
+#define KMALLOCSTAT_MAX 16
+
+// objects sys_kmembench holds at once
+#define KMEMBENCH_BATCH 32
+
+// argument limits of the allocator benchmark syscalls
+#define KMEMBENCH_MAX_SIZE  (64 * 1024)
+#define KMEMBENCH_MAX_N     (1 << 20)
+#define KMEMACCESS_MAX_N    16384
+#define KMEMACCESS_MAX_ROUNDS 1000
+
 /*
  * Machine dependent syscall implementation: fetches the nth syscall argument.
  */
@@ -79,6 +132,16 @@ static sysret_t (*syscalls[])(void *) = {
     [SYS_pipe] = sys_pipe,
     [SYS_info] = sys_info,
     [SYS_halt] = sys_halt,
+    [SYS_setpriority] = sys_setpriority,
+    [SYS_lockstat] = sys_lockstat,
+    [SYS_futex_wait] = sys_futex_wait,
+    [SYS_futex_wake] = sys_futex_wake,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
+    [SYS_msync] = sys_msync,
+    [SYS_kmembench] = sys_kmembench,
+    [SYS_kmemaccess] = sys_kmemaccess,
+    [SYS_kmallocstat] = sys_kmallocstat,
 };
 
 static bool
@@ -239,11 +302,59 @@ sys_getpid(void *arg)
     return proc_current()->pid;
 }
 
+// int setpriority(int pid, int priority);
+static sysret_t
+sys_setpriority(void *arg)
+{
+    sysarg_t pid, priority;
+
+    kassert(fetch_arg(arg, 1, &pid));
+    kassert(fetch_arg(arg, 2, &priority));
+
+    return proc_set_priority((pid_t)pid, (int)priority);
+}
+
+// int futex_wait(int *addr, int val);
+static sysret_t
+sys_futex_wait(void *arg)
+{
+    sysarg_t addr, val;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &val));
+
+    if (!validate_ptr((void *)addr, sizeof(int)))
+    {
+        return ERR_FAULT;
+    }
+    return futex_wait(&proc_current()->as, (vaddr_t)addr, (int)val);
+}
+
+// int futex_wake(int *addr, int n);
+static sysret_t
+sys_futex_wake(void *arg)
+{
+    sysarg_t addr, n;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &n));
+
+    if ((int)n < 0)
+    {
+        return ERR_INVAL;
+    }
+    return futex_wake(&proc_current()->as, (vaddr_t)addr, (int)n);
+}
+
 // void sleep(unsigned int, seconds);
 static sysret_t
 sys_sleep(void *arg)
 {
-    panic("syscall sleep not implemented");
+    sysarg_t seconds;
+
+    kassert(fetch_arg(arg, 1, &seconds));
+    timer_sleep((uint64_t)(unsigned int)seconds * TIMER_FREQ);
+    return ERR_OK;
 }
 
 int find_lowest_null_fd(struct proc *p)
@@ -692,6 +803,221 @@ sys_meminfo(void *arg)
     return ERR_OK;
 }
 
+// void *mmap(void *addr, size_t length, int prot, int flags, int fd, offset_t offset);
+static sysret_t
+sys_mmap(void *arg)
+{
+    sysarg_t addr, length, prot, flags, fd, offset;
+    struct proc *p = proc_current();
+    struct file *file;
+    struct memstore *store = NULL;
+    struct memregion *r;
+    int shared;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+    kassert(fetch_arg(arg, 3, &prot));
+    kassert(fetch_arg(arg, 4, &flags));
+    kassert(fetch_arg(arg, 5, &fd));
+    kassert(fetch_arg(arg, 6, &offset));
+
+    // bound length before it is rounded up to pages, where it could wrap to 0
+    if (length == 0 || length > USTACK_UPPERBOUND || addr + length < addr || !pg_aligned(addr) ||
+        (offset_t)offset < 0 || !pg_aligned(offset))
+    {
+        return ERR_INVAL;
+    }
+    if (((int)prot & ~(PROT_READ | PROT_WRITE)) != 0 || !((int)prot & PROT_READ))
+    {
+        return ERR_INVAL;
+    }
+    if (((int)flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)) != 0 ||
+        !((int)flags & MAP_SHARED) == !((int)flags & MAP_PRIVATE))
+    {
+        return ERR_INVAL;
+    }
+    shared = ((int)flags & MAP_SHARED) != 0;
+
+    if ((int)flags & MAP_ANONYMOUS)
+    {
+        // private anonymous memory needs no store, it is zero-filled on fault
+        if (shared && (store = shmms_alloc()) == NULL)
+        {
+            return ERR_NOMEM;
+        }
+        offset = 0;
+    }
+    else
+    {
+        if ((int)fd < 0 || (int)fd >= PROC_MAX_FILE || (file = p->file_descriptors[(int)fd]) == NULL ||
+            file->f_inode == NULL || file->f_inode->i_ftype != FTYPE_FILE)
+        {
+            return ERR_INVAL;
+        }
+        // the mapping must be readable, and writable if writes reach the file
+        if ((file->oflag & (FS_WRONLY | FS_RDWR)) == FS_WRONLY ||
+            (shared && ((int)prot & PROT_WRITE) && !(file->oflag & FS_RDWR)))
+        {
+            return ERR_INVAL;
+        }
+        store = file->f_inode->store;
+    }
+
+    r = as_map_memregion(&p->as, addr == 0 ? ADDR_ANYWHERE : (vaddr_t)addr, pg_round_up(length),
+                         ((int)prot & PROT_WRITE) ? MEMPERM_URW : MEMPERM_UR, store, (offset_t)offset, shared);
+    if (r == NULL)
+    {
+        // a new shared memory store has no mapping holding on to it yet
+        if (shared && ((int)flags & MAP_ANONYMOUS))
+        {
+            shmms_free(store);
+        }
+        return ERR_NOMEM;
+    }
+    return (sysret_t)r->start;
+}
+
+// int munmap(void *addr, size_t length);
+static sysret_t
+sys_munmap(void *arg)
+{
+    sysarg_t addr, length;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+
+    return as_unmap_memregion(&proc_current()->as, (vaddr_t)addr, (size_t)length) == ERR_OK ? ERR_OK : ERR_INVAL;
+}
+
+// int msync(void *addr, size_t length);
+static sysret_t
+sys_msync(void *arg)
+{
+    sysarg_t addr, length;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+
+    switch (as_sync_memregion(&proc_current()->as, (vaddr_t)addr, (size_t)length))
+    {
+    case ERR_OK:
+        return ERR_OK;
+    case ERR_VM_INVALID:
+        return ERR_INVAL;
+    default:
+        return ERR_FAULT;
+    }
+}
+
+#ifdef KMEM_DEBUG
+// int kmembench(size_t size, int n);
+static sysret_t
+sys_kmembench(void *arg)
+{
+    sysarg_t size, n;
+    void *objs[KMEMBENCH_BATCH];
+    int i, batch;
+    bool failed;
+
+    kassert(fetch_arg(arg, 1, &size));
+    kassert(fetch_arg(arg, 2, &n));
+
+    if ((size_t)size == 0 || (size_t)size > KMEMBENCH_MAX_SIZE || (int)n < 0 || (int)n > KMEMBENCH_MAX_N)
+    {
+        return ERR_INVAL;
+    }
+    // hold a batch at a time so frees and allocations cross magazine boundaries
+    for (; (int)n > 0; n -= batch)
+    {
+        batch = min((int)n, KMEMBENCH_BATCH);
+        for (i = 0; i < batch && (objs[i] = kmalloc((size_t)size)) != NULL; i++);
+        failed = i < batch;
+        while (i > 0)
+        {
+            kfree(objs[--i]);
+        }
+        if (failed)
+        {
+            return ERR_NOMEM;
+        }
+    }
+    return ERR_OK;
+}
+
+// int kmemaccess(int type, int n, int rounds);
+static sysret_t
+sys_kmemaccess(void *arg)
+{
+    sysarg_t type, n, rounds;
+    struct kmem_cache *cache;
+    void *head = NULL, *obj;
+    uint64_t start, cycles;
+    sysret_t ret;
+    int i;
+
+    kassert(fetch_arg(arg, 1, &type));
+    kassert(fetch_arg(arg, 2, &n));
+    kassert(fetch_arg(arg, 3, &rounds));
+
+    if (((int)type != KMEM_THREAD && (int)type != KMEM_INODE) || (int)n <= 0 || (int)n > KMEMACCESS_MAX_N ||
+        (int)rounds <= 0 || (int)rounds > KMEMACCESS_MAX_ROUNDS)
+    {
+        return ERR_INVAL;
+    }
+    // a cache of its own has the same slab layout as the real one
+    if ((cache = kmem_cache_create((int)type == KMEM_THREAD ? sizeof(struct thread) : sizeof(struct inode))) == NULL)
+    {
+        return ERR_NOMEM;
+    }
+    for (i = 0; i < (int)n; i++)
+    {
+        if ((obj = kmem_cache_alloc(cache)) == NULL)
+        {
+            break;
+        }
+        *(void **)obj = head;
+        head = obj;
+    }
+    if (i < (int)n)
+    {
+        ret = ERR_NOMEM;
+    }
+    else
+    {
+        start = rdtsc();
+        for (i = 0; i < (int)rounds; i++)
+        {
+            // each load depends on the last, like walking a list of threads
+            for (obj = head; obj != NULL; obj = *(void *volatile *)obj);
+        }
+        cycles = rdtsc() - start;
+        ret = (sysret_t)(cycles * 1000 / ((uint64_t)n * (uint64_t)rounds));
+    }
+    for (; head != NULL; head = obj)
+    {
+        obj = *(void **)head;
+        kmem_cache_free(cache, head);
+    }
+    kmem_cache_destroy(cache);
+    return ret;
+}
+#else
+// the allocator benchmarks can tie up kernel memory and cpu time, debug builds only
+// int kmembench(size_t size, int n);
+static sysret_t
+sys_kmembench(void *arg)
+{
+    return ERR_PERM;
+}
+
+// int kmemaccess(int type, int n, int rounds);
+static sysret_t
+sys_kmemaccess(void *arg)
+{
+    return ERR_PERM;
+}
+#endif /* KMEM_DEBUG */
+
 // int dup(int fd);
 static sysret_t
 sys_dup(void *arg)
@@ -815,9 +1141,83 @@ sys_info(void *arg)
     }
     // fill in using user_pgfault
     ((struct sys_info *)info)->num_pgfault = user_pgfault;
+    ((struct sys_info *)info)->num_cpus = ncpu;
+    ((struct sys_info *)info)->ticks = timer_get_ticks();
+    ((struct sys_info *)info)->num_faultaround = faultaround_mapped;
+    ((struct sys_info *)info)->num_faultaround_hit = faultaround_hits;
     return ERR_OK;
 }
 
+// int lockstat(struct lockstat *buf, int n);
+static sysret_t
+sys_lockstat(void *arg)
+{
+    sysarg_t buf, n;
+    struct lockstat *ls;
+    struct lock_stat *stat;
+    int count = 0;
+
+    kassert(fetch_arg(arg, 1, &buf));
+    kassert(fetch_arg(arg, 2, &n));
+
+    if ((int)n < 0)
+    {
+        return ERR_INVAL;
+    }
+    if (!validate_ptr((void *)buf, sizeof(struct lockstat) * (int)n))
+    {
+        return ERR_FAULT;
+    }
+    ls = (struct lockstat *)buf;
+    // counters are read without synchronization, a snapshot may be slightly off
+    for (stat = lock_stat_list(); stat != NULL && count < (int)n; stat = stat->next, count++)
+    {
+        strncpy(ls[count].name, stat->name, LOCKSTAT_NAME_LEN - 1);
+        ls[count].name[LOCKSTAT_NAME_LEN - 1] = '\0';
+        strncpy(ls[count].file, stat->file, LOCKSTAT_NAME_LEN - 1);
+        ls[count].file[LOCKSTAT_NAME_LEN - 1] = '\0';
+        ls[count].line = stat->line;
+        ls[count].acquires = lock_stat_acquires(stat);
+        ls[count].contended = stat->contended;
+        ls[count].spin_cycles = stat->spin_cycles;
+    }
+    return count;
+}
+
+// int kmallocstat(struct kmallocstat *buf, int n);
+static sysret_t
+sys_kmallocstat(void *arg)
+{
+    sysarg_t buf, n;
+    struct kmallocstat *ks;
+    struct kmalloc_class_stat stats[KMALLOCSTAT_MAX];
+    int count;
+
+    kassert(fetch_arg(arg, 1, &buf));
+    kassert(fetch_arg(arg, 2, &n));
+
+    if ((int)n < 0)
+    {
+        return ERR_INVAL;
+    }
+    if (!validate_ptr((void *)buf, sizeof(struct kmallocstat) * (int)n))
+    {
+        return ERR_FAULT;
+    }
+    ks = (struct kmallocstat *)buf;
+    count = kmalloc_stats(stats, min((int)n, KMALLOCSTAT_MAX));
+    for (int i = 0; i < count; i++)
+    {
+        ks[i].size = stats[i].size;
+        ks[i].allocs = stats[i].allocs;
+        ks[i].frees = stats[i].frees;
+        // counters are read racily, a free may be counted before its alloc
+        ks[i].live = stats[i].allocs > stats[i].frees ? stats[i].allocs - stats[i].frees : 0;
+        ks[i].wasted = stats[i].wasted;
+    }
+    return count;
+}
+
 // void halt();
 static sysret_t
 sys_halt(void *arg)
@@ -62,6 +62,9 @@ thread_create(const char *name, struct proc *p, int priority)
     t->name[slen] = 0;
     t->proc = p;
     t->priority = priority;
+    t->cpu = -1;
+    t->region_cache = NULL;
+    t->region_cache_seq = 0;
 
     // allocate a trapframe for thread at top of kstack
     t->tf = (void*) (vaddr + pg_size - sizeof(*t->tf)); 
@@ -96,7 +99,7 @@ void
 thread_start()
 {
     kassert(intr_get_level() == INTR_OFF);
-    spinlock_release(&sched_lock);
+    sched_finish_switch();
 }
 
 /*
@@ -3,26 +3,90 @@
 #include <kernel/console.h>
 #include <kernel/trap.h>
 #include <kernel/sched.h>
+#include <kernel/thread.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
 // T_IRQ_TIMER is defined in arch-specific trap header
 #include <arch/trap.h>
+#include <arch/asm.h>
 #include <arch/cpu.h>
+#include <arch/lapic.h>
+#include <arch/percpu.h>
 
-static uint32_t ticks;
+/*
+ * Hierarchical timer wheel. Level 0 has one slot per tick for the next
+ * WHEEL_SIZE ticks, each slot of level n covers WHEEL_SIZE^n ticks. When
+ * the lower bits of ticks wrap, the current slot of the level above is
+ * cascaded down, so adding and expiring a timer is O(1) and each tick only
+ * looks at one slot per level. Deadlines past the last level are parked in
+ * its furthest slot and re-filed when cascaded.
+ */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_SPAN      ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+// only advanced by the first cpu, every cpu gets its own timer interrupt
+static volatile uint64_t ticks;
+// protects the wheel, the expired list and timer states
 static struct spinlock timer_lock;
+static List wheel[WHEEL_LEVELS][WHEEL_SIZE];
+// expired timers waiting for the timer thread
+static List expired;
+static struct condvar expired_cv;
+
+/*
+ * An idle cpu stops its periodic tick. The first cpu keeps time, so it only
+ * stops once every other cpu has, and then sleeps in one-shot mode until the
+ * next timer deadline. ticks is stale meanwhile: the first cpu catches up on
+ * the ticks it slept through when it wakes, and any other cpu leaving idle
+ * wakes it and waits for the catch up before computing deadlines. Partial
+ * ticks are carried over to the next catch up.
+ */
+static DEFINE_PER_CPU(bool, tick_stopped);
+// the rest are protected by timer_lock
+// tick the first cpu is set to wake up at, 0 if it is ticking
+static uint64_t idle_wakeup;
+// other cpus with their tick stopped
+static uint32_t stopped_cpus;
+// first cpu is in one-shot mode and ticks is behind
+static volatile bool ticks_stale;
+// part of a tick the first cpu slept through beyond its whole ticks
+static uint32_t idle_carry;
 
 /*
  * timer trap handler
  */
 static void timer_trap_handler(irq_t irq, void *dev, void *regs);
 
+/* File t into the wheel slot for its deadline, timer_lock must be held. */
+static void wheel_insert(struct timer *t);
+
+/* Advance the wheel to the current tick and collect expired timers, timer_lock must be held. */
+static void wheel_advance(void);
+
+/* Return ticks until the wheel next needs attention, 0 if empty, timer_lock must be held. */
+static uint64_t wheel_next_event(void);
+
+/* Advance ticks by one and process the wheel, timer_lock must be held. */
+static void tick(void);
+
+/* Run expired timer callbacks. */
+static int timer_thread(void *aux);
+
 static void
 timer_trap_handler(irq_t irq, void *dev, void *regs)
 {
-    // Increment timer ticks
-    spinlock_acquire(&timer_lock);
-    ticks++;
-    spinlock_release(&timer_lock);
+    // Increment timer ticks, interrupt is off so mycpu is safe.
+    // A one-shot deadline includes this tick in its catch up.
+    if (!timer_tick_restart() && cpu_index(mycpu()) == 0) {
+        spinlock_acquire(&timer_lock);
+        tick();
+        spinlock_release(&timer_lock);
+    }
     trap_notify_irq_completion();
+    sched_tick();
     sched_sched(READY, NULL);
 }
 
@@ -30,5 +94,259 @@ err_t timer_register_trap_handler(void)
 {
     ticks = 0;
     spinlock_init(&timer_lock);
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            list_init(&wheel[lvl][i]);
+        }
+    }
+    list_init(&expired);
+    condvar_init(&expired_cv);
     return trap_register_handler(T_IRQ_TIMER, NULL, timer_trap_handler);
 }
+
+void
+timer_sys_init(void)
+{
+    struct thread *t = thread_create("timer thread", NULL, PRI_MAX);
+    kassert(t);
+    thread_start_context(t, timer_thread, NULL);
+}
+
+uint64_t
+timer_get_ticks(void)
+{
+    return ticks;
+}
+
+void
+timer_setup(struct timer *t, timer_func *func, void *aux)
+{
+    kassert(t && func);
+    t->func = func;
+    t->aux = aux;
+    t->expires = 0;
+    t->state = TIMER_IDLE;
+}
+
+void
+timer_add(struct timer *t, uint64_t expires)
+{
+    spinlock_acquire(&timer_lock);
+    kassert(t->state == TIMER_IDLE);
+    // slot for the current tick has already been processed
+    t->expires = expires > ticks ? expires : ticks + 1;
+    t->state = TIMER_PENDING;
+    wheel_insert(t);
+    // first cpu is sleeping past this deadline, wake it up to reprogram
+    if (idle_wakeup != 0 && t->expires < idle_wakeup) {
+        idle_wakeup = 0;
+        lapic_send_ipi(x86_64_cpus[0].lapic_id, T_IPI_RESCHED);
+    }
+    spinlock_release(&timer_lock);
+}
+
+bool
+timer_cancel(struct timer *t)
+{
+    spinlock_acquire(&timer_lock);
+    while (t->state == TIMER_RUNNING) {
+        // callback is short, let the timer thread finish it
+        spinlock_release(&timer_lock);
+        sched_sched(READY, NULL);
+        spinlock_acquire(&timer_lock);
+    }
+    bool cancelled = t->state == TIMER_PENDING || t->state == TIMER_EXPIRED;
+    if (cancelled) {
+        list_remove(&t->node);
+        t->state = TIMER_IDLE;
+    }
+    spinlock_release(&timer_lock);
+    return cancelled;
+}
+
+void
+timer_tick_stop(void)
+{
+    kassert(intr_get_level() == INTR_OFF);
+    int cpu = cpu_index(mycpu());
+    uint32_t others = ((1u << ncpu) - 1) & ~1u;
+    uint64_t nticks = 0;
+
+    spinlock_acquire(&timer_lock);
+    if (cpu == 0) {
+        // keep time while another cpu may be reading it
+        if ((stopped_cpus & others) != others) {
+            spinlock_release(&timer_lock);
+            return;
+        }
+        // keep a deadline even with no timers so elapsed time can be measured
+        if ((nticks = wheel_next_event()) == 0) {
+            nticks = (uint64_t)-1;
+        }
+        nticks = lapic_timer_oneshot(nticks);
+        idle_wakeup = ticks + nticks;
+        ticks_stale = True;
+    } else {
+        lapic_timer_oneshot(0);
+        stopped_cpus |= 1u << cpu;
+    }
+    spinlock_release(&timer_lock);
+    this_cpu(tick_stopped) = True;
+}
+
+bool
+timer_tick_restart(void)
+{
+    kassert(intr_get_level() == INTR_OFF);
+    int cpu = cpu_index(mycpu());
+
+    if (!this_cpu(tick_stopped)) {
+        return False;
+    }
+    spinlock_acquire(&timer_lock);
+    if (cpu == 0) {
+        uint64_t elapsed = lapic_timer_elapsed(&idle_carry);
+        idle_wakeup = 0;
+        while (elapsed-- > 0) {
+            tick();
+        }
+        ticks_stale = False;
+        spinlock_release(&timer_lock);
+    } else {
+        stopped_cpus &= ~(1u << cpu);
+        if (ticks_stale) {
+            // our threads may compute deadlines from ticks, bring it up to date
+            lapic_send_ipi(x86_64_cpus[0].lapic_id, T_IPI_RESCHED);
+        }
+        spinlock_release(&timer_lock);
+        while (ticks_stale) {
+            pause();
+        }
+    }
+    lapic_timer_periodic();
+    this_cpu(tick_stopped) = False;
+    return True;
+}
+
+void
+timer_sleep(uint64_t nticks)
+{
+    // nobody signals cv, the timeout is the only way out
+    struct spinlock lock;
+    struct condvar cv;
+
+    spinlock_init(&lock);
+    condvar_init(&cv);
+    spinlock_acquire(&lock);
+    condvar_wait_timeout(&cv, &lock, nticks);
+    spinlock_release(&lock);
+}
+
+static void
+wheel_insert(struct timer *t)
+{
+    uint64_t expires = t->expires < ticks ? ticks : t->expires;
+    uint64_t delta = expires - ticks;
+    int lvl;
+
+    if (delta >= WHEEL_SPAN) {
+        expires = ticks + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    for (lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++) {
+        if (delta < ((uint64_t)1 << (WHEEL_BITS * (lvl + 1)))) {
+            break;
+        }
+    }
+    list_append(&wheel[lvl][(expires >> (WHEEL_BITS * lvl)) & WHEEL_MASK], &t->node);
+}
+
+static uint64_t
+wheel_next_event(void)
+{
+    uint64_t next = 0;
+
+    // wake up for the next cascade if anything is waiting in upper levels
+    for (int lvl = 1; lvl < WHEEL_LEVELS && next == 0; lvl++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            if (!list_empty(&wheel[lvl][i])) {
+                next = WHEEL_SIZE - (ticks & WHEEL_MASK);
+                break;
+            }
+        }
+    }
+    for (uint64_t i = 1; i < WHEEL_SIZE && (next == 0 || i < next); i++) {
+        if (!list_empty(&wheel[0][(ticks + i) & WHEEL_MASK])) {
+            return i;
+        }
+    }
+    return next;
+}
+
+static void
+tick(void)
+{
+    ticks++;
+    wheel_advance();
+}
+
+static void
+wheel_advance(void)
+{
+    List *slot;
+    List cascade;
+
+    // cascade from the top so timers land in slots that are processed below
+    for (int lvl = WHEEL_LEVELS - 1; lvl > 0; lvl--) {
+        if ((ticks & (((uint64_t)1 << (WHEEL_BITS * lvl)) - 1)) != 0) {
+            continue;
+        }
+        // far timers can be re-filed into the same slot, empty it first
+        slot = &wheel[lvl][(ticks >> (WHEEL_BITS * lvl)) & WHEEL_MASK];
+        list_init(&cascade);
+        while (!list_empty(slot)) {
+            Node *n = list_begin(slot);
+            list_remove(n);
+            list_append(&cascade, n);
+        }
+        while (!list_empty(&cascade)) {
+            Node *n = list_begin(&cascade);
+            list_remove(n);
+            wheel_insert(list_entry(n, struct timer, node));
+        }
+    }
+
+    slot = &wheel[0][ticks & WHEEL_MASK];
+    if (list_empty(slot)) {
+        return;
+    }
+    while (!list_empty(slot)) {
+        Node *n = list_begin(slot);
+        list_remove(n);
+        list_entry(n, struct timer, node)->state = TIMER_EXPIRED;
+        list_append(&expired, n);
+    }
+    condvar_signal(&expired_cv);
+}
+
+static int
+timer_thread(void *aux)
+{
+    spinlock_acquire(&timer_lock);
+    for (;;) {
+        while (list_empty(&expired)) {
+            condvar_wait(&expired_cv, &timer_lock);
+        }
+        Node *n = list_begin(&expired);
+        list_remove(n);
+        struct timer *t = list_entry(n, struct timer, node);
+        t->state = TIMER_RUNNING;
+        spinlock_release(&timer_lock);
+
+        t->func(t->aux);
+
+        spinlock_acquire(&timer_lock);
+        t->state = TIMER_IDLE;
+    }
+    return 0;
+}
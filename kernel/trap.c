@@ -5,6 +5,7 @@
 #include <kernel/console.h>
 #include <kernel/synch.h>
 #include <kernel/timer.h>
+#include <kernel/sched.h>
 #include <kernel/radix_tree.h>
 #include <lib/errcode.h>
 
@@ -24,6 +25,7 @@ static struct kmem_cache *entry_allocator;
  */
 extern err_t syscall_register_trap_handler(void);
 extern err_t pgfault_register_trap_handler(void);
+extern err_t vpmap_register_trap_handler(void);
 
 void
 trap_sys_init(void)
@@ -43,6 +45,12 @@ trap_sys_init(void)
     if (pgfault_register_trap_handler() != ERR_OK) {
         goto fail;
     }
+    if (sched_register_trap_handler() != ERR_OK) {
+        goto fail;
+    }
+    if (vpmap_register_trap_handler() != ERR_OK) {
+        goto fail;
+    }
     return;
 fail:
     panic("Failed to register trap handlers\n");
@@ -0,0 +1,108 @@
+#include <lib/usynch.h>
+#include <lib/usyscall.h>
+#include <lib/errcode.h>
+#include <lib/stdio.h>
+
+// Mutex states, see "Futexes Are Tricky" by Ulrich Drepper.
+#define UNLOCKED    0
+#define LOCKED      1
+#define CONTENDED   2
+
+// wake count for broadcast, larger than any number of waiters
+#define WAKE_ALL    0x7FFFFFFF
+
+/*
+ * Sleep while the word at addr holds val. A bad word would turn the callers'
+ * retry loops into a busy spin, so treat it like a bad memory access and
+ * end the process.
+ */
+static void futex_wait_checked(int *addr, int val);
+
+static void
+futex_wait_checked(int *addr, int val)
+{
+    int err = futex_wait(addr, val);
+
+    if (err == ERR_FAULT || err == ERR_INVAL) {
+        printf("usynch: futex_wait on %p failed with %d\n", addr, err);
+        exit(-1);
+    }
+}
+
+void
+umutex_init(struct umutex *m)
+{
+    m->state = UNLOCKED;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+    int c;
+
+    if ((c = __sync_val_compare_and_swap(&m->state, UNLOCKED, LOCKED)) == UNLOCKED) {
+        return;
+    }
+    // mark the mutex contended before sleeping so the holder's unlock wakes us
+    if (c != CONTENDED) {
+        c = __sync_lock_test_and_set(&m->state, CONTENDED);
+    }
+    while (c != UNLOCKED) {
+        futex_wait_checked(&m->state, CONTENDED);
+        c = __sync_lock_test_and_set(&m->state, CONTENDED);
+    }
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+    if (__sync_bool_compare_and_swap(&m->state, UNLOCKED, LOCKED)) {
+        return ERR_OK;
+    }
+    return ERR_LOCK_BUSY;
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+    // only enter the kernel if someone may be waiting
+    if (__sync_fetch_and_sub(&m->state, 1) != LOCKED) {
+        m->state = UNLOCKED;
+        __sync_synchronize();
+        futex_wake(&m->state, 1);
+    }
+}
+
+void
+ucondvar_init(struct ucondvar *cv)
+{
+    cv->seq = 0;
+}
+
+void
+ucondvar_wait(struct ucondvar *cv, struct umutex *m)
+{
+    // a signal after we read seq changes it, so futex_wait won't sleep through it
+    int seq = cv->seq;
+
+    umutex_unlock(m);
+    futex_wait_checked(&cv->seq, seq);
+    // we may race with other lockers after the wakeup, assume contention
+    while (__sync_lock_test_and_set(&m->state, CONTENDED) != UNLOCKED) {
+        futex_wait_checked(&m->state, CONTENDED);
+    }
+}
+
+void
+ucondvar_signal(struct ucondvar *cv)
+{
+    __sync_fetch_and_add(&cv->seq, 1);
+    futex_wake(&cv->seq, 1);
+}
+
+void
+ucondvar_broadcast(struct ucondvar *cv)
+{
+    __sync_fetch_and_add(&cv->seq, 1);
+    futex_wake(&cv->seq, WAKE_ALL);
+}
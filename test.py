@@ -17,6 +17,7 @@ TIMEOUT = {
     3: 60,
     4: 60,
     5: 60,
+    6: 60,
 }
 
 test_weights = {
@@ -55,7 +56,14 @@ test_weights = {
     "5-cow-large": 14,
     "5-cow-multiple": 20,
     "5-cow-low-mem": 25,
-    "5-REDO-4": 21
+    "5-REDO-4": 21,
+    "6-sleep-test": 10,
+    "6-futex-test": 10,
+    "6-cow-data": 10,
+    "6-exec-demand": 10,
+    "6-mmap-test": 10,
+    "6-mmap-write": 10,
+    "6-swap-low-mem": 10,
 }
 
 autograder_root = "/autograder"
@@ -0,0 +1,41 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * Kernel object cache benchmark, the OSV counterpart of CacheSizeTest/cache.c:
+ * for a growing number of kernel objects sized like struct thread and struct
+ * inode, walk them through the kmemaccess syscall and print the average read
+ * time. Like the array sweep in CacheSizeTest, the time per read steps up as
+ * the objects' first cache lines stop fitting in L1, then L2. Slab coloring
+ * spreads the objects over more cache sets, so the first step should come
+ * later than with every slab starting its objects at the same offset.
+ * Needs a kernel built with KMEM_DEBUG=1.
+ */
+
+#define ROUNDS      100
+#define MIN_OBJS    64
+#define MAX_OBJS    8192
+
+static void
+sweep(int type, char *name)
+{
+    int n, cycles;
+
+    printf("cachebench: %s objects, tsc cycles per 1000 reads\n", name);
+    for (n = MIN_OBJS; n <= MAX_OBJS; n *= 2) {
+        if ((cycles = kmemaccess(type, n, ROUNDS)) < 0) {
+            printf("cachebench: kmemaccess failed\n");
+            exit(-1);
+        }
+        printf("%d, %d\n", n, cycles);
+    }
+}
+
+int
+main()
+{
+    sweep(KMEM_THREAD, "thread");
+    sweep(KMEM_INODE, "inode");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * Kernel allocator benchmark: an increasing number of processes, up to one
+ * per cpu and then some, each kmalloc and kfree OPS objects through the
+ * kmembench syscall at the same time. Reports allocations per second for a
+ * small and a large object size. With per-cpu magazines the rate should
+ * grow with the number of processes until every cpu is busy.
+ * Needs a kernel built with KMEM_DEBUG=1.
+ */
+
+#define OPS         200000
+#define MAX_PROCS   8
+
+static void
+run(int nprocs, size_t size, int ncpus)
+{
+    struct sys_info before, after;
+    int i, status, ticks, ops;
+
+    info(&before);
+    for (i = 0; i < nprocs; i++) {
+        if (fork() == 0) {
+            if (kmembench(size, OPS) != ERR_OK) {
+                printf("kmallocbench: kmembench failed\n");
+                exit(-1);
+            }
+            exit(0);
+        }
+    }
+    for (i = 0; i < nprocs; i++) {
+        wait(-1, &status);
+    }
+    info(&after);
+
+    ticks = after.ticks - before.ticks;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    ops = OPS * nprocs;
+    printf("kmallocbench: %d cpus, %d procs, %d bytes, %d allocs in %d ticks, %d allocs/sec\n",
+           ncpus, nprocs, (int)size, ops, ticks, (int)((long)ops * TIMER_FREQ / ticks));
+}
+
+int
+main()
+{
+    struct sys_info si;
+
+    info(&si);
+    for (int nprocs = 1; nprocs <= MAX_PROCS; nprocs *= 2) {
+        run(nprocs, 64, si.num_cpus);
+        run(nprocs, 1024, si.num_cpus);
+    }
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * Print usage statistics of the kernel's kmalloc size classes, one line per
+ * class. Wasted bytes are what allocations got beyond the size they asked
+ * for, summed over all allocations. The "large" class counts allocations
+ * served from page runs.
+ */
+
+#define MAX_CLASSES 16
+
+static struct kmallocstat stats[MAX_CLASSES];
+
+int
+main()
+{
+    int n;
+
+    if ((n = kmallocstat(stats, MAX_CLASSES)) < 0) {
+        printf("kmallocstat: failed to read kmalloc statistics\n");
+        exit(-1);
+    }
+    printf("%s %s %s %s %s\n", "size", "allocs", "frees", "live", "wasted");
+    for (int i = 0; i < n; i++) {
+        if (stats[i].size == 0) {
+            printf("large ");
+        } else {
+            printf("%u ", (uint32_t)stats[i].size);
+        }
+        printf("%u %u %u %u\n", (uint32_t)stats[i].allocs, (uint32_t)stats[i].frees,
+               (uint32_t)stats[i].live, (uint32_t)stats[i].wasted);
+    }
+    exit(0);
+    return 0;
+}
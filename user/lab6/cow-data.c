@@ -0,0 +1,74 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+/*
+ * Data written before fork stays private to each side afterwards. The heap is
+ * big enough to be backed by 2 MiB pages, so this also covers copying a page
+ * out of a huge mapping that parent and child share.
+ */
+
+#define PAGES 1536
+
+static int
+pattern(int i, int gen)
+{
+    return i * 7 + gen * 100003;
+}
+
+int
+main()
+{
+    int pid, ret, status, i;
+    volatile int *a = sbrk(PAGES * 4096);
+
+    if (a == (void *)ERR_NOMEM) {
+        error("cow-data: sbrk failed");
+    }
+    for (i = 0; i < PAGES; i++) {
+        a[i * 1024] = pattern(i, 0);
+    }
+
+    if ((pid = fork()) == 0) {
+        for (i = 0; i < PAGES; i++) {
+            if (a[i * 1024] != pattern(i, 0)) {
+                error("cow-data: child read %d on page %d, expected %d", a[i * 1024], i, pattern(i, 0));
+            }
+        }
+        // write every other page, the pages in between must keep the old data
+        for (i = 0; i < PAGES; i += 2) {
+            a[i * 1024] = pattern(i, 1);
+        }
+        for (i = 0; i < PAGES; i++) {
+            if (a[i * 1024] != pattern(i, i % 2 == 0)) {
+                error("cow-data: child read %d on page %d after writing, expected %d",
+                    a[i * 1024], i, pattern(i, i % 2 == 0));
+            }
+        }
+        exit(0);
+    }
+    if ((ret = wait(pid, &status)) != pid) {
+        error("cow-data: wait failed, return value was %d", ret);
+    }
+    if (status != 0) {
+        error("cow-data: child exited with status %d", status);
+    }
+
+    // the child's writes must not show up here
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 1024] != pattern(i, 0)) {
+            error("cow-data: parent read %d on page %d, expected %d", a[i * 1024], i, pattern(i, 0));
+        }
+    }
+    for (i = 0; i < PAGES; i++) {
+        a[i * 1024] = pattern(i, 2);
+    }
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 1024] != pattern(i, 2)) {
+            error("cow-data: parent read %d on page %d after writing, expected %d", a[i * 1024], i, pattern(i, 2));
+        }
+    }
+
+    pass("cow-data");
+    exit(0);
+    return 0;
+}
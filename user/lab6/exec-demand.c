@@ -0,0 +1,84 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+/*
+ * Segments of the executable are loaded on demand. Initialized data and bss
+ * read correctly, touching pages that were never used faults them in, and
+ * private writes to data pages don't leak through the page cache into a
+ * freshly spawned copy of the same binary.
+ */
+
+#define DATA_PAGES 8
+#define BSS_PAGES 32
+#define MAGIC 0x5a5a5a5a
+
+static int data[DATA_PAGES * 1024] = { [0 ... DATA_PAGES * 1024 - 1] = MAGIC };
+static int bss[BSS_PAGES * 1024];
+
+static void
+check_data(const char *who)
+{
+    int i;
+
+    for (i = 0; i < DATA_PAGES * 1024; i += 256) {
+        if (data[i] != MAGIC) {
+            error("exec-demand: %s read %x at data[%d], expected %x", who, data[i], i, MAGIC);
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int pid, ret, status, i;
+    struct sys_info info_before, info_after;
+
+    if (argc > 1 && strcmp(argv[1], "child") == 0) {
+        check_data("child");
+        exit(0);
+    }
+
+    // nothing touched data or bss yet, so the first reads must fault
+    info(&info_before);
+    check_data("parent");
+    info(&info_after);
+    if (info_after.num_pgfault == info_before.num_pgfault) {
+        error("exec-demand: reading data caused no page faults, segments were loaded eagerly");
+    }
+
+    info(&info_before);
+    for (i = 0; i < BSS_PAGES * 1024; i += 256) {
+        if (bss[i] != 0) {
+            error("exec-demand: read %x at bss[%d], expected 0", bss[i], i);
+        }
+    }
+    info(&info_after);
+    if (info_after.num_pgfault == info_before.num_pgfault) {
+        error("exec-demand: reading bss caused no page faults, segments were loaded eagerly");
+    }
+
+    for (i = 0; i < DATA_PAGES * 1024; i += 1024) {
+        data[i] = i;
+        bss[i] = i;
+    }
+    for (i = 0; i < DATA_PAGES * 1024; i += 1024) {
+        if (data[i] != i || bss[i] != i) {
+            error("exec-demand: read %x and %x at index %d after writing, expected %x", data[i], bss[i], i, i);
+        }
+    }
+
+    if ((pid = spawn("exec-demand child")) < 0) {
+        error("exec-demand: spawn failed, return value was %d", pid);
+    }
+    if ((ret = wait(pid, &status)) != pid) {
+        error("exec-demand: wait failed, return value was %d", ret);
+    }
+    if (status != 0) {
+        error("exec-demand: child exited with status %d", status);
+    }
+
+    pass("exec-demand");
+    exit(0);
+    return 0;
+}
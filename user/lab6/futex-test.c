@@ -0,0 +1,66 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/usynch.h>
+
+/*
+ * Argument checks and the value comparison of futex_wait, futex_wake without
+ * waiters, and the uncontended paths of the futex based user mutex. A futex
+ * word on a heap page that was never touched is faulted in, not rejected.
+ */
+
+int
+main()
+{
+    int word = 5, ret;
+    int *fresh;
+    char *end;
+    struct umutex m;
+
+    if ((ret = futex_wait((int *)((char *)&word + 1), 5)) != ERR_INVAL) {
+        error("futex-test: futex_wait on a misaligned address returned %d, expected %d", ret, ERR_INVAL);
+    }
+    if ((ret = futex_wait((int *)KMAP_BASE, 0)) != ERR_FAULT) {
+        error("futex-test: futex_wait on a kernel address returned %d, expected %d", ret, ERR_FAULT);
+    }
+    // well past the end of the heap, nothing is mapped there
+    end = (char *)sbrk(0) + 16 * 1024 * 1024;
+    if ((ret = futex_wait((int *)end, 0)) != ERR_FAULT) {
+        error("futex-test: futex_wait on an unmapped address returned %d, expected %d", ret, ERR_FAULT);
+    }
+    if ((ret = futex_wait(&word, 6)) != ERR_AGAIN) {
+        error("futex-test: futex_wait with a stale value returned %d, expected %d", ret, ERR_AGAIN);
+    }
+
+    // the page behind a fresh sbrk has not been touched yet, it reads as zero
+    if ((fresh = sbrk(4096)) == (void *)ERR_NOMEM) {
+        error("futex-test: sbrk failed");
+    }
+    if ((ret = futex_wait(fresh, 1)) != ERR_AGAIN) {
+        error("futex-test: futex_wait on an untouched page returned %d, expected %d", ret, ERR_AGAIN);
+    }
+    if (*fresh != 0) {
+        error("futex-test: untouched heap word reads %d, expected 0", *fresh);
+    }
+
+    if ((ret = futex_wake(&word, 1)) != 0) {
+        error("futex-test: futex_wake without waiters returned %d, expected 0", ret);
+    }
+    if ((ret = futex_wake(&word, -1)) != ERR_INVAL) {
+        error("futex-test: futex_wake with negative n returned %d, expected %d", ret, ERR_INVAL);
+    }
+
+    umutex_init(&m);
+    umutex_lock(&m);
+    if ((ret = umutex_trylock(&m)) != ERR_LOCK_BUSY) {
+        error("futex-test: umutex_trylock on a held mutex returned %d, expected %d", ret, ERR_LOCK_BUSY);
+    }
+    umutex_unlock(&m);
+    if ((ret = umutex_trylock(&m)) != 0) {
+        error("futex-test: umutex_trylock on a free mutex returned %d, expected 0", ret);
+    }
+    umutex_unlock(&m);
+
+    pass("futex-test");
+    exit(0);
+    return 0;
+}
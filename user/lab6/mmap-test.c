@@ -0,0 +1,195 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+/*
+ * File-backed and anonymous mappings: shared file writes reach the file
+ * through msync and munmap, private ones don't, shared anonymous memory is
+ * shared with a forked child and private anonymous memory is copied.
+ */
+
+#define PAGES 2
+#define FILE "mmap-test-file"
+
+static char buf[PAGES * 4096];
+
+// mmap returns a negative error code in place of the address
+static int
+mmap_failed(void *p)
+{
+    return (long)p < 0 && (long)p > -4096;
+}
+
+static void
+read_file(char *dst)
+{
+    int fd, ret;
+
+    if ((fd = open(FILE, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("mmap-test: failed to reopen %s, return value was %d", FILE, fd);
+    }
+    if ((ret = read(fd, dst, PAGES * 4096)) != PAGES * 4096) {
+        error("mmap-test: read %d bytes of %s, expected %d", ret, FILE, PAGES * 4096);
+    }
+    close(fd);
+}
+
+static void
+bad_args(int fd)
+{
+    void *p;
+    int ret;
+
+    if ((p = mmap(NULL, 0, PROT_READ, MAP_SHARED, fd, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap with length 0 returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, (size_t)-4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap with a huge length returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 100)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap with a misaligned offset returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, 4096, PROT_WRITE, MAP_SHARED, fd, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap without PROT_READ returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, 4096, PROT_READ, MAP_SHARED | MAP_PRIVATE, fd, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap with both MAP_SHARED and MAP_PRIVATE returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, 100, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap of a bad fd returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, 0, 0)) != (void *)ERR_INVAL) {
+        error("mmap-test: mmap of the console returned %p, expected %d", p, ERR_INVAL);
+    }
+    if ((ret = munmap((void *)0x10000000, 4096)) != ERR_INVAL) {
+        error("mmap-test: munmap of an unmapped range returned %d, expected %d", ret, ERR_INVAL);
+    }
+}
+
+static void
+file_shared(int fd)
+{
+    char *p;
+    int i, ret;
+
+    if (mmap_failed(p = mmap(NULL, PAGES * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))) {
+        error("mmap-test: shared file mmap failed, return value was %d", (int)(long)p);
+    }
+    for (i = 0; i < PAGES * 4096; i++) {
+        if (p[i] != (char)i) {
+            error("mmap-test: shared mapping read %d at offset %d, expected %d", p[i], i, (char)i);
+        }
+    }
+    for (i = 0; i < PAGES * 4096; i += 512) {
+        p[i] = 'm';
+    }
+    if ((ret = msync(p, PAGES * 4096)) != ERR_OK) {
+        error("mmap-test: msync returned %d", ret);
+    }
+    read_file(buf);
+    for (i = 0; i < PAGES * 4096; i++) {
+        if (buf[i] != (i % 512 == 0 ? 'm' : (char)i)) {
+            error("mmap-test: file has %d at offset %d after msync", buf[i], i);
+        }
+    }
+
+    // munmap writes back whatever msync hasn't
+    p[1] = 'u';
+    if ((ret = munmap(p, PAGES * 4096)) != ERR_OK) {
+        error("mmap-test: munmap of the shared mapping returned %d", ret);
+    }
+    if ((ret = munmap(p, PAGES * 4096)) != ERR_INVAL) {
+        error("mmap-test: second munmap returned %d, expected %d", ret, ERR_INVAL);
+    }
+    read_file(buf);
+    if (buf[1] != 'u') {
+        error("mmap-test: file has %d at offset 1 after munmap, expected %d", buf[1], 'u');
+    }
+}
+
+static void
+file_private(int fd)
+{
+    char *p;
+    int ret;
+
+    if (mmap_failed(p = mmap(NULL, PAGES * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0))) {
+        error("mmap-test: private file mmap failed, return value was %d", (int)(long)p);
+    }
+    if (p[0] != 'm' || p[1] != 'u') {
+        error("mmap-test: private mapping doesn't see the file contents");
+    }
+    p[0] = 'p';
+    if ((ret = msync(p, PAGES * 4096)) != ERR_OK) {
+        error("mmap-test: msync of a private mapping returned %d", ret);
+    }
+    if ((ret = munmap(p, PAGES * 4096)) != ERR_OK) {
+        error("mmap-test: munmap of the private mapping returned %d", ret);
+    }
+    read_file(buf);
+    if (buf[0] != 'm') {
+        error("mmap-test: private write reached the file, offset 0 has %d", buf[0]);
+    }
+}
+
+static void
+anon_fork(int flags)
+{
+    volatile int *p;
+    int pid, ret, status;
+    int shared = (flags & MAP_SHARED) != 0;
+
+    if (mmap_failed((void *)(p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0)))) {
+        error("mmap-test: anonymous mmap failed, return value was %d", (int)(long)p);
+    }
+    if (*p != 0) {
+        error("mmap-test: anonymous mapping reads %d, expected 0", *p);
+    }
+    *p = 1;
+    if ((pid = fork()) == 0) {
+        if (*p != 1) {
+            error("mmap-test: child reads %d from the anonymous mapping, expected 1", *p);
+        }
+        *p = 2;
+        exit(0);
+    }
+    if ((ret = wait(pid, &status)) != pid || status != 0) {
+        error("mmap-test: child failed, wait returned %d and status %d", ret, status);
+    }
+    if (*p != (shared ? 2 : 1)) {
+        error("mmap-test: %s anonymous mapping reads %d after fork, expected %d",
+            shared ? "shared" : "private", *p, shared ? 2 : 1);
+    }
+    if ((ret = munmap((void *)p, 4096)) != ERR_OK) {
+        error("mmap-test: munmap of the anonymous mapping returned %d", ret);
+    }
+}
+
+int
+main()
+{
+    int fd, ret, i;
+
+    if ((fd = open(FILE, FS_CREAT | FS_RDWR, EMPTY_MODE)) < 0) {
+        error("mmap-test: failed to create %s, return value was %d", FILE, fd);
+    }
+    for (i = 0; i < PAGES * 4096; i++) {
+        buf[i] = (char)i;
+    }
+    if ((ret = write(fd, buf, PAGES * 4096)) != PAGES * 4096) {
+        error("mmap-test: wrote %d bytes to %s, expected %d", ret, FILE, PAGES * 4096);
+    }
+
+    bad_args(fd);
+    file_shared(fd);
+    file_private(fd);
+    anon_fork(MAP_SHARED);
+    anon_fork(MAP_PRIVATE);
+
+    close(fd);
+    if ((ret = unlink(FILE)) != ERR_OK) {
+        error("mmap-test: failed to unlink %s, return value was %d", FILE, ret);
+    }
+    pass("mmap-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+/*
+ * write() and a shared mapping of the same file see each other's data: bytes
+ * written through a file descriptor show up in the mapping right away, and
+ * after msync and munmap the file holds both the write() data and the stores
+ * made through the mapping.
+ */
+
+#define FILE "mmap-write-file"
+
+static char buf[4096];
+
+int
+main()
+{
+    int fd, wfd, ret, i;
+    char *p;
+
+    if ((fd = open(FILE, FS_CREAT | FS_RDWR, EMPTY_MODE)) < 0) {
+        error("mmap-write: failed to create %s, return value was %d", FILE, fd);
+    }
+    for (i = 0; i < 4096; i++) {
+        buf[i] = 'a';
+    }
+    if ((ret = write(fd, buf, 4096)) != 4096) {
+        error("mmap-write: wrote %d bytes to %s, expected 4096", ret, FILE);
+    }
+
+    p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ((long)p < 0 && (long)p > -4096) {
+        error("mmap-write: mmap failed, return value was %d", (int)(long)p);
+    }
+    // the mapping holds on to the file
+    close(fd);
+    if (p[0] != 'a' || p[4095] != 'a') {
+        error("mmap-write: mapping doesn't see the file contents");
+    }
+
+    // overwrite the first 100 bytes through a fresh descriptor
+    if ((wfd = open(FILE, FS_RDWR, EMPTY_MODE)) < 0) {
+        error("mmap-write: failed to reopen %s, return value was %d", FILE, wfd);
+    }
+    for (i = 0; i < 100; i++) {
+        buf[i] = 'b';
+    }
+    if ((ret = write(wfd, buf, 100)) != 100) {
+        error("mmap-write: wrote %d bytes through the second descriptor, expected 100", ret);
+    }
+    close(wfd);
+    for (i = 0; i < 4096; i++) {
+        if (p[i] != (i < 100 ? 'b' : 'a')) {
+            error("mmap-write: mapping has %c at offset %d after write()", p[i], i);
+        }
+    }
+
+    for (i = 2000; i < 2100; i++) {
+        p[i] = 'c';
+    }
+    if ((ret = msync(p, 4096)) != ERR_OK) {
+        error("mmap-write: msync returned %d", ret);
+    }
+    if ((ret = munmap(p, 4096)) != ERR_OK) {
+        error("mmap-write: munmap returned %d", ret);
+    }
+
+    if ((fd = open(FILE, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("mmap-write: failed to reopen %s, return value was %d", FILE, fd);
+    }
+    if ((ret = read(fd, buf, 4096)) != 4096) {
+        error("mmap-write: read %d bytes of %s, expected 4096", ret, FILE);
+    }
+    close(fd);
+    for (i = 0; i < 4096; i++) {
+        if (buf[i] != (i < 100 ? 'b' : (i >= 2000 && i < 2100) ? 'c' : 'a')) {
+            error("mmap-write: file has %c at offset %d", buf[i], i);
+        }
+    }
+
+    if ((ret = unlink(FILE)) != ERR_OK) {
+        error("mmap-write: failed to unlink %s, return value was %d", FILE, ret);
+    }
+    pass("mmap-write");
+    exit(0);
+    return 0;
+}
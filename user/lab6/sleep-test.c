@@ -0,0 +1,60 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define NCHILD 4
+
+/*
+ * sleep(1) must take at least a second of timer ticks, and not much more.
+ * Sleepers block instead of spinning, so several sleeping at once still take
+ * about a second in total.
+ */
+
+static size_t
+now(void)
+{
+    struct sys_info si;
+
+    info(&si);
+    return si.ticks;
+}
+
+int
+main()
+{
+    size_t start, elapsed;
+    int i, pid;
+
+    start = now();
+    sleep(1);
+    elapsed = now() - start;
+    if (elapsed < TIMER_FREQ) {
+        error("sleep-test: sleep(1) returned after %d ticks, expected at least %d", elapsed, TIMER_FREQ);
+    }
+    if (elapsed > 2 * TIMER_FREQ) {
+        error("sleep-test: sleep(1) took %d ticks, expected about %d", elapsed, TIMER_FREQ);
+    }
+
+    start = now();
+    for (i = 0; i < NCHILD; i++) {
+        if ((pid = fork()) < 0) {
+            error("sleep-test: fork failed, return value was %d", pid);
+        }
+        if (pid == 0) {
+            sleep(1);
+            exit(0);
+        }
+    }
+    for (i = 0; i < NCHILD; i++) {
+        if (wait(-1, NULL) < 0) {
+            error("sleep-test: wait failed");
+        }
+    }
+    elapsed = now() - start;
+    if (elapsed < TIMER_FREQ || elapsed > 2 * TIMER_FREQ) {
+        error("sleep-test: %d concurrent sleep(1) took %d ticks, expected about %d", NCHILD, elapsed, TIMER_FREQ);
+    }
+
+    pass("sleep-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+/**
+ * This test assumes qemu is run with 4 MB of physical memory
+ * (use make qemu-low-mem)
+ *
+ * Fill more private anonymous memory than fits in RAM, so pages have to go
+ * to swap, and check every page comes back intact, also in a forked child
+ * that shares the swapped pages.
+ */
+
+#define PAGES 1024
+
+static void
+check(volatile int *a, const char *who)
+{
+    int i;
+
+    for (i = 0; i < PAGES; i++) {
+        if (a[i * 1024] != i || a[i * 1024 + 1023] != ~i) {
+            error("swap-low-mem: %s read %d and %d on page %d, expected %d and %d",
+                who, a[i * 1024], a[i * 1024 + 1023], i, i, ~i);
+        }
+    }
+}
+
+int
+main()
+{
+    volatile int *a;
+    int pid, ret, status, i;
+
+    a = mmap(NULL, PAGES * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((long)a < 0 && (long)a > -4096) {
+        error("swap-low-mem: mmap failed, return value was %d", (int)(long)a);
+    }
+    for (i = 0; i < PAGES; i++) {
+        a[i * 1024] = i;
+        a[i * 1024 + 1023] = ~i;
+    }
+    check(a, "parent");
+    // a second pass reads back the pages swapped out during the first one
+    check(a, "parent");
+
+    if ((pid = fork()) == 0) {
+        check(a, "child");
+        exit(0);
+    }
+    if ((ret = wait(pid, &status)) != pid || status != 0) {
+        error("swap-low-mem: child failed, wait returned %d and status %d", ret, status);
+    }
+    check(a, "parent");
+
+    if ((ret = munmap((void *)a, PAGES * 4096)) != ERR_OK) {
+        error("swap-low-mem: munmap returned %d", ret);
+    }
+    pass("swap-low-mem");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * Print contention statistics of kernel locks, one line per lock init call
+ * site that has been acquired at least once. Spin time is in thousands of
+ * tsc cycles.
+ */
+
+#define MAX_LOCKS 64
+
+static struct lockstat stats[MAX_LOCKS];
+
+int
+main()
+{
+    int n;
+
+    if ((n = lockstat(stats, MAX_LOCKS)) < 0) {
+        printf("lockstat: failed to read lock statistics\n");
+        exit(-1);
+    }
+    printf("%s %s %s %s\n", "acquires", "contended", "kcycles", "lock");
+    for (int i = 0; i < n; i++) {
+        if (stats[i].acquires == 0) {
+            continue;
+        }
+        printf("%u %u %u %s (%s:%d)\n", (uint32_t)stats[i].acquires,
+               (uint32_t)stats[i].contended, (uint32_t)(stats[i].spin_cycles / 1000),
+               stats[i].name, stats[i].file, stats[i].line);
+    }
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * Scheduler benchmark: pairs of processes ping-pong a byte through two pipes,
+ * so every message blocks one side and wakes the other. Reports context
+ * switches per second for an increasing number of pairs. Boot with a
+ * different number of cpus to compare run queue scaling.
+ */
+
+#define ROUNDS      2000
+#define MAX_PAIRS   8
+
+static void
+pinger(int out, int in, int done)
+{
+    char c = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        if (write(out, &c, 1) != 1 || read(in, &c, 1) != 1) {
+            printf("schedbench: pinger pipe error\n");
+            exit(-1);
+        }
+    }
+    write(done, &c, 1);
+    exit(0);
+}
+
+static void
+ponger(int in, int out)
+{
+    char c;
+    for (int i = 0; i < ROUNDS; i++) {
+        if (read(in, &c, 1) != 1 || write(out, &c, 1) != 1) {
+            printf("schedbench: ponger pipe error\n");
+            exit(-1);
+        }
+    }
+    exit(0);
+}
+
+static void
+run(int npairs, int ncpus)
+{
+    int ping[2], pong[2], done[2];
+    struct sys_info before, after;
+    char buf[MAX_PAIRS];
+    int i, status, ticks, switches;
+
+    if (pipe(done) != ERR_OK) {
+        printf("schedbench: pipe failed\n");
+        exit(-1);
+    }
+    info(&before);
+    for (i = 0; i < npairs; i++) {
+        if (pipe(ping) != ERR_OK || pipe(pong) != ERR_OK) {
+            printf("schedbench: pipe failed\n");
+            exit(-1);
+        }
+        if (fork() == 0) {
+            pinger(ping[1], pong[0], done[1]);
+        }
+        if (fork() == 0) {
+            ponger(ping[0], pong[1]);
+        }
+        close(ping[0]);
+        close(ping[1]);
+        close(pong[0]);
+        close(pong[1]);
+    }
+    // block on the done pipe rather than spinning in wait
+    if (read(done[0], buf, npairs) != npairs) {
+        printf("schedbench: done pipe error\n");
+        exit(-1);
+    }
+    info(&after);
+    for (i = 0; i < 2 * npairs; i++) {
+        wait(-1, &status);
+    }
+    close(done[0]);
+    close(done[1]);
+
+    ticks = after.ticks - before.ticks;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    // each round trip blocks and wakes both sides once
+    switches = 2 * ROUNDS * npairs;
+    printf("schedbench: %d cpus, %d pairs, %d switches in %d ticks, %d switches/sec\n",
+           ncpus, npairs, switches, ticks, switches * TIMER_FREQ / ticks);
+}
+
+int
+main()
+{
+    struct sys_info si;
+
+    info(&si);
+    for (int npairs = 1; npairs <= MAX_PAIRS; npairs *= 2) {
+        run(npairs, si.num_cpus);
+    }
+    exit(0);
+    return 0;
+}
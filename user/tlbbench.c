@@ -0,0 +1,56 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+
+/*
+ * TLB benchmark, the OSV counterpart of TLBSizeTest/tlb.c: grow the heap by
+ * npages, then repeatedly touch one int per page. Reports page faults taken
+ * to populate the heap and timer ticks for the access loop. Heap chunks
+ * covering a whole aligned huge page are backed by a single 2 MiB mapping,
+ * so both numbers should drop sharply once npages reaches a few huge pages.
+ */
+
+#define PAGESIZE    4096
+#define TRIALS      200
+#define MAX_PAGES   8192
+
+int
+main()
+{
+    struct sys_info before, after;
+    int npages, trial, i, faults, ticks;
+    int jump = PAGESIZE / sizeof(int);
+    int *array;
+    int sum = 0;
+
+    if ((array = sbrk(MAX_PAGES * PAGESIZE)) == (void*)ERR_NOMEM) {
+        printf("tlbbench: sbrk failed\n");
+        exit(-1);
+    }
+    printf("tlbbench: pages, faults, ticks for %d trials\n", TRIALS);
+    for (npages = 64; npages <= MAX_PAGES; npages *= 2) {
+        info(&before);
+        // first touch faults in the pages not touched by the previous round
+        for (i = 0; i < npages * jump; i += jump) {
+            array[i] += 1;
+        }
+        info(&after);
+        faults = after.num_pgfault - before.num_pgfault;
+
+        info(&before);
+        for (trial = 0; trial < TRIALS; trial++) {
+            for (i = 0; i < npages * jump; i += jump) {
+                array[i] += 1;
+            }
+        }
+        info(&after);
+        ticks = after.ticks - before.ticks;
+        printf("%d, %d, %d\n", npages, faults, ticks);
+    }
+    // use the array so the loops can't be optimized away
+    for (i = 0; i < MAX_PAGES * jump; i += jump) {
+        sum += array[i];
+    }
+    printf("tlbbench: checksum %d\n", sum);
+    exit(0);
+    return 0;
+}